@@ -0,0 +1,22 @@
+#ifndef APPLY_H
+#define APPLY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "document.h"
+#include "protocol.h"
+/**
+ * This file is the header file of the edit dispatch: it turns a decoded edit into the
+ * markdown call that applies it. The server applies client edits with it and the replay
+ * tool applies recorded edits with it, so both always drive the engine the same way.
+ */
+
+/**
+ * True for the opcodes that change the document
+ */
+int apply_is_edit(int opcode);
+/**
+ * Apply one edit to doc as part of version. Return what the markdown call returned, or
+ * -1 (an invalid position) for an opcode that is not an edit.
+ */
+int apply_op(document *doc, uint64_t version, const op *o);
+#endif
@@ -0,0 +1,39 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+/**
+ * This file is the header file of edit coalescing: the client merges edits typed within a
+ * short window into one command against the same version. An insert shifts the positions
+ * after it at once, so an insert that starts where the last one ended continues it.
+ * Deleted text keeps its place until the version commits, so deletes whose spans touch
+ * are one span of the same text. Either way the merged command leaves the document as the
+ * separate edits would have.
+ */
+
+#define COALESCE_MAX 160 // merged insert content, the broadcast line still fits the listener's line
+
+typedef struct coalesced {
+    op merged; // its payload points into content, so a coalesced is not copied
+    char content[COALESCE_MAX]; // insert content of merged
+} coalesced;
+
+/**
+ * True for an edit that can be merged at all: an INSERT whose content fits, or a DEL
+ */
+int coalesce_takes(const op *o);
+/**
+ * Start a merged command from o, which coalesce_takes
+ */
+void coalesce_start(coalesced *c, const op *o);
+/**
+ * True when o continues the merged command: an insert right after the merged content, or
+ * a delete touching the merged range, against the same version
+ */
+int coalesce_continues(const coalesced *c, const op *o);
+/**
+ * Merge o, which coalesce_continues, into the command
+ */
+void coalesce_add(coalesced *c, const op *o);
+#endif
@@ -27,6 +27,7 @@ typedef struct {
     chunk *head; // pointing to the first chunk
     int is_modify; // use to determine wheater this document is modified the period of time
     uint64_t version; // version number
+    struct merkle *hashes; // hash tree over current_version, see merkle.h
 } document;
 
 // Functions from here onwards.
@@ -0,0 +1,87 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "protocol.h"
+/**
+ * This file is the header file of the version history. Every committed version keeps the
+ * ops that were applied in it, delta encoded, so the history can be used to catch clients
+ * up and to audit who changed what. The store is a fixed ring that also drops its oldest
+ * entries by age and by total size, so its memory stays flat however long the server runs.
+ *
+ * Entry encoding (all integers varints):
+ *   user_count, { name_len, name }*,
+ *   { u8 opcode, u8 result, user_index, zigzag(arg0 - previous arg0), zigzag(arg1 - arg0), len, payload }*
+ */
+
+#define HISTORY_USER_MAX 64 // longest username kept in an entry
+
+typedef struct history_entry {
+    uint64_t num; // version number
+    uint64_t time_ns; // commit time, CLOCK_REALTIME
+    unsigned char *data;
+    size_t len;
+} history_entry;
+
+/**
+ * The entry that is being built during one tick
+ */
+typedef struct history_builder {
+    char (*users)[HISTORY_USER_MAX]; // grows with the distinct users of the tick
+    size_t user_count;
+    size_t user_cap;
+    unsigned char *ops;
+    size_t len;
+    size_t cap;
+    size_t op_count;
+    uint64_t last_arg0;
+} history_builder;
+
+typedef struct history {
+    history_entry *ring;
+    size_t cap; // retention by count
+    size_t first; // index of the oldest entry
+    size_t count;
+    size_t bytes; // encoded bytes held
+    size_t max_bytes; // retention by size
+    long max_age; // retention by age in seconds, 0 keeps entries regardless of age
+    pthread_mutex_t lock;
+} history;
+
+/**
+ * Called for every op of an entry while decoding. The payload points into the entry.
+ */
+typedef void (*history_visit)(const char *user, const op *o, int result, void *arg);
+
+// === store ===
+int history_init(history *h, size_t max_entries, size_t max_bytes, long max_age);
+void history_free(history *h);
+/**
+ * Commit the builder as version num and reset it. Old entries are dropped first when
+ * the count, size or age limit would be exceeded.
+ */
+int history_commit(history *h, history_builder *b, uint64_t num);
+/**
+ * Drop every entry, for a store whose next version no longer follows the newest one
+ */
+void history_clear(history *h);
+/**
+ * Copy out the entry of version num. Return 0 and a malloc'd copy, or -1 if the version is
+ * not (or no longer) in the history.
+ */
+int history_get(history *h, uint64_t num, history_entry *out);
+/**
+ * The oldest and newest version held, both 0 when the history is empty
+ */
+void history_range(history *h, uint64_t *oldest, uint64_t *newest);
+
+// === entries ===
+void builder_reset(history_builder *b);
+void builder_free(history_builder *b);
+int builder_add(history_builder *b, const char *user, const op *o, int result);
+/**
+ * Walk the ops of an encoded entry. Return the number of ops, or -1 if it is malformed.
+ */
+long history_decode(const unsigned char *data, size_t len, history_visit visit, void *arg);
+#endif
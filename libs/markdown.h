@@ -15,9 +15,22 @@
 // Initialize and free a document
 document * markdown_init(void);
 void markdown_free(document *doc);
+// build the committed document of version from its text and the layout of its chunks (see
+// markdown_layout), e.g. a copy received from the server. NULL if the layout does not fit.
+document *markdown_load(const char *text, size_t len, const char *layout, uint64_t version);
+// where the chunks that are not plain text lie, as "<plain><type><len>" words: plain
+// bytes since the previous one, then n (newline), o (ordered list) or u (unordered list)
+// and the chunk's length. A copy of the text needs it to behave like the original.
+char *markdown_layout(const document *doc);
+// a committed copy of doc at version with the bytes [start, end) replaced by content as
+// plain text; the chunks outside the span keep their types. NULL if out of memory.
+document *markdown_splice(const document *doc, size_t start, size_t end, const char *content, size_t len,
+                          uint64_t version);
 
 // === Edit Commands ===
 int markdown_insert(document *doc, uint64_t version, size_t pos, const char *content);
+// same as markdown_insert for content that is not NUL terminated
+int markdown_insert_len(document *doc, uint64_t version, size_t pos, const char *content, size_t len);
 int markdown_delete(document *doc, uint64_t version, size_t pos, size_t len);
 
 // === Formatting Commands ===
@@ -0,0 +1,50 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+#include <stddef.h>
+#include <stdint.h>
+/**
+ * This file is the header file of the hash tree over a committed text. The text is cut
+ * into blocks where a rolling hash of the bytes since the block start hits a pattern
+ * (content defined, between MERKLE_BLOCK_MIN and MERKLE_BLOCK_MAX bytes), so an edit only
+ * moves the boundaries around it and two copies of the same text always get the same
+ * blocks. The leaves hash the blocks and the tree combines them up to one root.
+ *
+ * After a commit only the blocks between the first and the last changed byte are cut and
+ * hashed again; the others keep their hashes and the tree is updated along their paths.
+ */
+
+#define MERKLE_BLOCK_MIN 64
+#define MERKLE_BLOCK_MAX 2048
+#define MERKLE_BLOCK_MASK 0xff00000000000000ULL // one boundary per 256 bytes on average
+
+typedef struct merkle_block {
+    size_t pos;
+    size_t len;
+    uint64_t hash;
+} merkle_block;
+
+typedef struct merkle {
+    merkle_block *blocks;
+    size_t count;
+    size_t cap;
+    uint64_t *nodes; // nodes[1] is the root, the leaves start at nodes[width]
+    size_t width; // leaf slots, a power of two
+} merkle;
+
+void merkle_init(merkle *m);
+void merkle_free(merkle *m);
+/**
+ * Cut and hash the whole text. Return 0, or -1 when out of memory (the tree is empty then).
+ */
+int merkle_build(merkle *m, const char *text, size_t len);
+/**
+ * The text changed from old to text: cut and hash again only what lies between the
+ * common prefix and the common suffix. Return 0 or -1 like merkle_build.
+ */
+int merkle_update(merkle *m, const char *old, size_t old_len, const char *text, size_t len);
+/**
+ * The root hash, 0 for an empty text
+ */
+uint64_t merkle_root(const merkle *m);
+uint64_t merkle_hash(const char *data, size_t len);
+#endif
@@ -0,0 +1,157 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+/**
+ * This file is the header file of the wire protocol shared by the server and the client.
+ * A client creates its own FIFO pair (the channel), holds both ends open and then writes
+ * one CONNECT line to the server's rendezvous FIFO. The server answers on the channel.
+ * The text protocol is one command per line. A client that asks for it at the handshake
+ * (username followed by " BINARY") switches to length-prefixed binary frames afterwards:
+ *
+ *   varint body_len | u8 opcode | varint version | varint arg0 | varint arg1 | varint len | payload
+ *
+ * body_len counts everything after itself, so a reader can frame without decoding.
+ * Every integer is an unsigned LEB128 varint, so small positions cost one byte.
+ */
+
+#define PROTOCOL_BINARY "BINARY" // handshake keyword
+#define PROTOCOL_CONNECT "CONNECT" // rendezvous request: CONNECT <channel> <username> [BINARY] [STANDBY] [LAYOUT] [RESUME <version>] [DOC <name>]
+#define FIFO_SERVER "FIFO_SERVER_%d" // rendezvous FIFO of a server, by pid
+#define FIFO_C2S "FIFO_C2S_%s" // channel FIFOs, created by the client before it connects
+#define FIFO_S2C "FIFO_S2C_%s"
+#define PROTOCOL_SNAPSHOT "SNAPSHOT" // role line: <role> [BINARY] [SNAPSHOT <region>] [RESUME] [LAYOUT]
+#define PROTOCOL_RESUME "RESUME" // the handshake carries the versions since the cached one, not the content
+#define PROTOCOL_DOCUMENT "DOC" // the named document to join, created on first use
+#define PROTOCOL_STANDBY "STANDBY" // a standby server subscribing to the committed versions of every document
+#define PROTOCOL_LAYOUT "LAYOUT" // every full copy of the document comes with the layout of its chunks (markdown_layout)
+#define DOCUMENT_DEFAULT "doc" // joined when the request names none, saved to doc.md
+#define SNAPSHOT_NAME "/markdown_%d" // shared memory snapshot of a server, by pid
+#define SNAPSHOT_DOCUMENT_NAME "/markdown_%d_%s" // the same for a named document, by pid and name
+#define CHANNEL_MAX 24 // longest channel id, letters, digits, '-' and '_'
+#define FRAME_HEADER_MAX 51 // 5 varints of at most 10 bytes and the opcode
+#define FRAME_MAX (16 * 1024 * 1024) // largest frame a reader accepts
+
+// === opcodes, client to server ===
+#define OP_NONE 0
+#define OP_INSERT 1 // arg0 pos, payload content
+#define OP_DEL 2 // arg0 pos, arg1 len
+#define OP_NEWLINE 3 // arg0 pos
+#define OP_HEADING 4 // arg0 level, arg1 pos
+#define OP_BOLD 5 // arg0 start, arg1 end
+#define OP_ITALIC 6 // arg0 start, arg1 end
+#define OP_BLOCKQUOTE 7 // arg0 pos
+#define OP_ORDERED_LIST 8 // arg0 pos
+#define OP_UNORDERED_LIST 9 // arg0 pos
+#define OP_CODE 10 // arg0 start, arg1 end
+#define OP_HORIZONTAL_RULE 11 // arg0 pos
+#define OP_LINK 12 // arg0 start, arg1 end, payload url
+#define OP_DOC 13 // query, answered with OP_DOC and the content as payload, then the layout (arg1 its length) for LAYOUT
+#define OP_PERM 14 // query, answered with OP_PERM and the role as payload
+#define OP_DISCONNECT 15
+#define OP_HASH 16 // query, answered with OP_HASH and "<root> <blocks>" as payload
+#define OP_BLOCKS 17 // query, arg0 first block, arg1 count, answered with OP_BLOCKS and the block lines
+#define OP_RANGE 18 // query, arg0 pos, arg1 len, answered with OP_RANGE and the bytes as payload
+#define OP_READ 19 // query, arg0 pos, arg1 len, answered with OP_READ and the bytes as payload
+#define OP_READLINES 20 // query, arg0 first line, arg1 count, answered with OP_READLINES and the lines as payload
+#define OP_PASTE 21 // arg0 pos, arg1 len: the next DATA pieces carry len bytes, inserted at pos as one edit
+#define OP_DATA 22 // payload the next piece of the open paste, escaped like a broadcast in the text form
+#define OP_COUNT 23
+
+// === opcodes, server to client ===
+#define OP_RESULT 64 // arg0 result code of a failed command
+#define OP_RESYNC 65 // version, payload content of a fresh snapshot, then the layout (arg1 its length) for LAYOUT
+#define OP_VERSION 66 // version, payload the history entry of the version (see history.h)
+
+// === opcodes, server to standby ===
+#define OP_REPLICA_DOC 67 // version, arg0 name length, arg1 layout length, payload the document name, its content and layout; a standby asks for one again with the name alone
+#define OP_REPLICA_VERSION 68 // version, arg0 name length, arg1 commit time (CLOCK_REALTIME ns), payload the name, the root and the history entry
+#define REPLICA_ROOT_BYTES 8 // merkle root of the text after an OP_REPLICA_VERSION, little endian
+
+// === result codes carried by OP_RESULT ===
+#define RESULT_SUCCESS 0
+#define RESULT_INVALID_POSITION 1
+#define RESULT_DELETED_POSITION 2
+#define RESULT_OUTDATED_VERSION 3
+#define RESULT_UNAUTHORISED 4
+
+/**
+ * A decoded command. payload is not NUL terminated and points into the buffer it was
+ * decoded from, so the op is only valid as long as that buffer is.
+ */
+typedef struct op {
+    int opcode;
+    uint64_t version;
+    uint64_t args[2];
+    const char *payload;
+    size_t len;
+} op;
+
+// === varints ===
+size_t varint_encode(uint64_t value, unsigned char *out);
+/**
+ * Return the bytes consumed, 0 if more input is needed, -1 if the varint is malformed.
+ */
+int varint_decode(const unsigned char *in, size_t avail, uint64_t *value);
+
+// === frames ===
+/**
+ * Write the frame header of o into out (at least FRAME_HEADER_MAX bytes) and return its
+ * length. The o->len payload bytes must follow it on the wire.
+ */
+size_t frame_header(const op *o, unsigned char *out);
+/**
+ * Decode one frame. Return the bytes consumed, 0 if the frame is incomplete, -1 if it is
+ * malformed or larger than FRAME_MAX.
+ */
+long frame_decode(const unsigned char *in, size_t avail, op *o);
+/**
+ * Read one whole frame from a stream into *buffer (grown as needed) and decode it.
+ * Return 0 on success, -1 on EOF or a malformed frame.
+ */
+int frame_read(FILE *in, unsigned char **buffer, size_t *cap, op *o);
+/**
+ * Build header and payload of o in one malloc'd buffer, its size is stored in *len
+ */
+unsigned char *frame_build(const op *o, size_t *len);
+
+// === text form ===
+#define PARSE_UNKNOWN -1 // not a command keyword
+#define PARSE_BAD_ARGS -2 // known keyword, o->opcode is set but the arguments do not parse
+/**
+ * Parse one text command (no trailing newline) into o. The payload points into line.
+ * Return 0 on success, PARSE_UNKNOWN or PARSE_BAD_ARGS.
+ */
+int op_parse_text(const char *line, op *o);
+/**
+ * Write the text form of o into out, like snprintf: the return value is the full length
+ * even when it did not fit. Backslashes and newlines in the payload are escaped as \\ and
+ * \n, so the command stays on one line.
+ */
+size_t op_format(const op *o, char *out, size_t cap);
+/**
+ * Undo the escaping of op_format in place, return the new length
+ */
+size_t op_unescape(char *text, size_t len);
+const char *op_name(int opcode);
+const char *result_name(int code);
+
+// === connecting, client side ===
+#define CONNECT_CHANNEL -1 // the channel FIFOs could not be created or opened
+#define CONNECT_REQUEST -2 // the rendezvous FIFO of the server could not be written
+#define CONNECT_TIMEOUT -3 // the server did not answer in time
+#define CONNECT_STANDBY 2 // binary value of channel_connect: binary framing, as a standby
+#define CONNECT_LAYOUT 4 // or'd into binary: ask for the chunk layout with every copy of the document
+/**
+ * Create the channel FIFOs, open our ends, write the CONNECT request and wait up to
+ * timeout_ms for the server to answer. A resume version other than 0 offers the cached
+ * copy of that version, a document other than NULL joins that one instead of the default
+ * document. binary is True for binary framing, or CONNECT_STANDBY to subscribe as a standby
+ * server, with CONNECT_LAYOUT or'd in to ask for chunk layouts. On success both ends are
+ * blocking and the FIFO names are unlinked already; the answer (role line and snapshot) is
+ * left to read from *fd_s2c. Return 0 or one of the CONNECT_ codes, errno tells why.
+ */
+int channel_connect(int server_pid, const char *channel, const char *username, const char *document, int binary,
+                    uint64_t resume, int timeout_ms, int *fd_c2s, int *fd_s2c);
+#endif
@@ -0,0 +1,43 @@
+#ifndef RECORD_H
+#define RECORD_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+/**
+ * This file is the header file of the command recording. With -r the server writes every
+ * edit that reached the document, in the order it was applied, and marks where each tick
+ * ended. The replay tool feeds a recording straight into markdown.c.
+ *
+ * A recording is RECORD_MAGIC followed by protocol frames (see protocol.h):
+ *   - an edit frame per applied edit, its version field is the version it was applied as
+ *   - a RECORD_TICK frame after the edits of a tick: version is the document version after
+ *     the tick, arg0 is 1 when the tick committed, and the payload holds the return code
+ *     of each edit of the tick, one signed byte each
+ * Ticks that applied nothing and committed nothing are left out.
+ */
+
+#define RECORD_MAGIC "MDRECRD1"
+#define RECORD_TICK 128
+
+typedef struct recorder {
+    FILE *file;
+    signed char *results; // return codes of the running tick
+    size_t count;
+    size_t cap;
+} recorder;
+
+/**
+ * Start a recording, an existing file is replaced. Return 0 or -1.
+ */
+int record_open(recorder *r, const char *path);
+/**
+ * Record an edit applied as version with its return code
+ */
+void record_op(recorder *r, const op *o, uint64_t version, int result);
+/**
+ * Close the running tick and flush it, so a crash loses at most the tick in flight
+ */
+void record_tick(recorder *r, uint64_t version, int committed);
+void record_close(recorder *r);
+#endif
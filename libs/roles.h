@@ -0,0 +1,48 @@
+#ifndef ROLES_H
+#define ROLES_H
+#include <stddef.h>
+/**
+ * This file is the header file of the role table. roles.txt is read once into an
+ * open addressing hash table, so a connect looks a user up without touching the file.
+ * A table is never changed after it is loaded; a reload builds a new one that replaces it.
+ *
+ * roles.txt holds one "username role [rate [burst]]" line per user, role is read or write.
+ * rate and burst limit the commands of the user that go to the commit loop, per second
+ * and at once; without them the limit of the role applies.
+ */
+
+#define ROLE_USER_MAX 64 // longest username and its NUL, a line with a longer one is skipped
+#define ROLE_NONE -1 // not in the table
+#define ROLE_READ 0
+#define ROLE_WRITE 1
+
+typedef struct role_entry {
+    const char *name; // points into the table's copy of the file, NULL for an empty slot
+    int role;
+    double rate; // commands per second, 0 when the user has no limit of its own
+    double burst; // tokens the bucket holds at most
+} role_entry;
+
+typedef struct roles {
+    role_entry *slots;
+    size_t mask; // slot count - 1, the slot count is a power of two
+    size_t count;
+    char *text; // the file, tokenized in place
+} roles;
+
+/**
+ * Load a role file. Return NULL if it can not be read. The first line of a user wins,
+ * anything but "write" is read access.
+ */
+roles *roles_load(const char *path);
+/**
+ * Return ROLE_READ, ROLE_WRITE or ROLE_NONE
+ */
+int roles_lookup(const roles *table, const char *username);
+/**
+ * Store the limit of a user in *rate and *burst. Return 1 if roles.txt gives the user one,
+ * 0 if the limit of its role applies.
+ */
+int roles_limit(const roles *table, const char *username, double *rate, double *burst);
+void roles_free(roles *table);
+#endif
@@ -0,0 +1,73 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+/**
+ * This file is the header file of the published snapshot. The server copies every
+ * committed version into a POSIX shared memory region; local readers map it once and
+ * read the latest text without a syscall or a request to the server.
+ *
+ * The header is a seqlock: seq is odd while the server writes. A reader takes seq,
+ * reads, and keeps the result only if seq is even and did not change meanwhile:
+ *
+ *   uint64_t seq;
+ *   do {
+ *       seq = snapshot_begin(&region);
+ *       ... read region.header->version, len and text in place ...
+ *   } while (snapshot_retry(&region, seq));
+ *
+ * The region only grows. A reader whose mapping is smaller than the published size maps
+ * it again in snapshot_begin, the only case where reading costs a syscall.
+ */
+
+#define SNAPSHOT_MAGIC 0x4e534d44 // "DMSN"
+
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t reserved;
+    _Atomic uint64_t seq; // odd while a version is being written
+    _Atomic uint64_t size; // bytes of the region, header included
+    uint64_t version;
+    uint64_t len; // bytes of text, not counting the NUL
+    char text[]; // NUL terminated
+} snapshot_header;
+
+typedef struct snapshot_region {
+    char name[64];
+    int fd;
+    int writer;
+    snapshot_header *header;
+    size_t size; // bytes mapped by this process
+} snapshot_region;
+
+// === server ===
+/**
+ * Create (or replace) the region name and publish an empty version 0. Return 0 or -1.
+ */
+int snapshot_create(snapshot_region *r, const char *name);
+/**
+ * Publish a version. The region grows when the text does not fit. Return 0 or -1.
+ */
+int snapshot_publish(snapshot_region *r, uint64_t version, const char *text, size_t len);
+/**
+ * Unmap and remove the region
+ */
+void snapshot_destroy(snapshot_region *r);
+
+// === readers ===
+int snapshot_open(snapshot_region *r, const char *name);
+/**
+ * Start a read, waiting out a write in progress. Return the seq to pass to snapshot_retry.
+ */
+uint64_t snapshot_begin(snapshot_region *r);
+/**
+ * Return non-zero if the data read since snapshot_begin may be torn and must be read again
+ */
+int snapshot_retry(const snapshot_region *r, uint64_t seq);
+/**
+ * Copy out the latest version. Return a malloc'd NUL terminated text, or NULL.
+ */
+char *snapshot_read(snapshot_region *r, uint64_t *version, size_t *len);
+void snapshot_close(snapshot_region *r);
+#endif
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+/**
+ * This file is the header file of the server's latency histograms. A histogram is log
+ * linear like HDR histograms: values below HIST_SUB are counted exactly, above that every
+ * power of two is split into HIST_SUB buckets, so a bucket is at most 1/HIST_SUB of its
+ * value wide (about 6%) and any uint64_t fits in a fixed array.
+ *
+ * Recording is one relaxed atomic add, so each thread records into its own histograms
+ * without a lock and a reader merges them whenever it wants a report. Counts read during
+ * a merge may be a few records behind, never torn.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total; // values recorded
+    _Atomic uint64_t sum; // of the values, for the mean
+} histogram;
+
+/**
+ * A monotonic clock in nanoseconds, the unit latencies are recorded in
+ */
+uint64_t stats_now_ns();
+
+void hist_record(histogram *h, uint64_t value);
+/**
+ * Add the counts of from into into. into should not be recorded into meanwhile.
+ */
+void hist_merge(histogram *into, histogram *from);
+void hist_reset(histogram *h);
+/**
+ * The smallest value below which the fraction p (0 to 1) of the values fall, rounded down
+ * to its bucket. 0 when the histogram is empty.
+ */
+uint64_t hist_percentile(histogram *h, double p);
+/**
+ * Print one line: name count mean p50 p99 p999 max, every value divided by unit
+ * (1000 prints nanoseconds as microseconds, 1 prints plain counts)
+ */
+void hist_print(FILE *out, const char *name, histogram *h, double unit);
+/**
+ * The column titles that go with hist_print
+ */
+void hist_print_header(FILE *out, const char *unit_name);
+#endif
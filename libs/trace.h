@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <stdatomic.h>
+/**
+ * This file is the header file of the hot path trace. Every thread writes compact records
+ * into its own ring, always on, without a lock: a record is a clock read and a few
+ * stores. The rings keep the last TRACE_RING records of each thread, so after a slow
+ * tick a dump still holds what every thread did during it. trace2json turns a dump into
+ * Chrome trace JSON (chrome://tracing, Perfetto).
+ *
+ * Dump file (little endian, as written by the server):
+ *   "MDTRACE1" | u32 thread_count | { u32 thread, char name[TRACE_NAME], u32 count, record* }*
+ */
+
+#define TRACE_RING 4096 // records kept per thread, a power of two
+#define TRACE_NAME 16
+#define TRACE_MAGIC "MDTRACE1"
+
+// === events ===
+#define TRACE_ENQUEUE 1 // arg client id, arg2 commands in the batch
+#define TRACE_TICK_BEGIN 2 // a tick found commands queued
+#define TRACE_APPLY_BEGIN 3 // arg client id, arg2 opcode
+#define TRACE_APPLY_END 4 // arg client id, arg2 return code
+#define TRACE_TICK_END 5 // arg commands applied
+#define TRACE_COMMIT 6 // arg version
+#define TRACE_BROADCAST 7 // arg version, arg2 clients
+#define TRACE_WRITE 8 // arg client id, arg2 bytes
+#define TRACE_CONNECT 9 // arg client id, arg2 role
+#define TRACE_DISCONNECT 10 // arg client id
+#define TRACE_QUERY 11 // arg client id, arg2 opcode
+#define TRACE_EVENTS 12
+
+typedef struct trace_record {
+    uint64_t ts_ns; // CLOCK_MONOTONIC
+    uint64_t arg;
+    uint32_t arg2;
+    uint16_t event;
+    uint16_t reserved;
+} trace_record;
+
+/**
+ * The ring of one thread. Only its thread writes; head counts every record ever written,
+ * so record i lives at records[i % TRACE_RING] until head passes i + TRACE_RING.
+ */
+typedef struct trace_ring {
+    struct trace_ring *next;
+    _Atomic uint64_t head;
+    uint32_t thread; // stable id, rings are reused but never renumbered
+    int in_use;
+    char name[TRACE_NAME];
+    trace_record records[TRACE_RING];
+} trace_ring;
+
+/**
+ * Give the calling thread a ring, reusing the ring of a thread that exited. Threads that
+ * record without calling it get a ring named after their id on the first event.
+ */
+void trace_thread(const char *name);
+/**
+ * The calling thread exits, its ring (and what it holds) is kept until another thread
+ * takes it
+ */
+void trace_thread_exit();
+void trace_event(uint16_t event, uint64_t arg, uint32_t arg2);
+/**
+ * Write every ring to path in the dump format. Return 0, or -1 if the file can not be
+ * written. Records overwritten while they were copied are left out.
+ */
+int trace_dump(const char *path);
+const char *trace_event_name(uint16_t event);
+#endif
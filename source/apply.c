@@ -0,0 +1,85 @@
+#include "../libs/apply.h"
+#include "../libs/markdown.h"
+#include <string.h>
+
+#define INVALID_CURSOR_POS -1
+
+static int apply_insert(document *doc, uint64_t version, const op *o) {
+    return markdown_insert_len(doc, version, o->args[0], o->payload, o->len);
+}
+
+static int apply_delete(document *doc, uint64_t version, const op *o) {
+    return markdown_delete(doc, version, o->args[0], o->args[1]);
+}
+
+static int apply_newline(document *doc, uint64_t version, const op *o) {
+    return markdown_newline(doc, version, o->args[0]);
+}
+
+static int apply_heading(document *doc, uint64_t version, const op *o) {
+    return markdown_heading(doc, version, (int)o->args[0], o->args[1]);
+}
+
+static int apply_bold(document *doc, uint64_t version, const op *o) {
+    return markdown_bold(doc, version, o->args[0], o->args[1]);
+}
+
+static int apply_italic(document *doc, uint64_t version, const op *o) {
+    return markdown_italic(doc, version, o->args[0], o->args[1]);
+}
+
+static int apply_blockquote(document *doc, uint64_t version, const op *o) {
+    return markdown_blockquote(doc, version, o->args[0]);
+}
+
+static int apply_ordered_list(document *doc, uint64_t version, const op *o) {
+    return markdown_ordered_list(doc, version, o->args[0]);
+}
+
+static int apply_unordered_list(document *doc, uint64_t version, const op *o) {
+    return markdown_unordered_list(doc, version, o->args[0]);
+}
+
+static int apply_code(document *doc, uint64_t version, const op *o) {
+    return markdown_code(doc, version, o->args[0], o->args[1]);
+}
+
+static int apply_horizontal_rule(document *doc, uint64_t version, const op *o) {
+    return markdown_horizontal_rule(doc, version, o->args[0]);
+}
+
+static int apply_link(document *doc, uint64_t version, const op *o) {
+    // the url is the only payload that is handed on as a string
+    char url[256];
+    size_t len = o->len < sizeof(url) ? o->len : sizeof(url) - 1;
+    memcpy(url, o->payload, len);
+    url[len] = '\0';
+    return markdown_link(doc, version, o->args[0], o->args[1], url);
+}
+
+/**
+ * The edits, indexed by opcode
+ */
+static int (*const edit_table[OP_COUNT])(document *doc, uint64_t version, const op *o) = {
+    [OP_INSERT] = apply_insert,
+    [OP_DEL] = apply_delete,
+    [OP_NEWLINE] = apply_newline,
+    [OP_HEADING] = apply_heading,
+    [OP_BOLD] = apply_bold,
+    [OP_ITALIC] = apply_italic,
+    [OP_BLOCKQUOTE] = apply_blockquote,
+    [OP_ORDERED_LIST] = apply_ordered_list,
+    [OP_UNORDERED_LIST] = apply_unordered_list,
+    [OP_CODE] = apply_code,
+    [OP_HORIZONTAL_RULE] = apply_horizontal_rule,
+    [OP_LINK] = apply_link,
+};
+
+int apply_is_edit(int opcode) {
+    return opcode > OP_NONE && opcode < OP_COUNT && edit_table[opcode];
+}
+
+int apply_op(document *doc, uint64_t version, const op *o) {
+    if (!apply_is_edit(o->opcode)) return INVALID_CURSOR_POS;
+    return edit_table[o->opcode](doc, version, o);
+}
@@ -10,6 +10,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "../libs/protocol.h"
+#include "../libs/history.h"
+#include "../libs/snapshot.h"
+#include "../libs/markdown.h"
+#include "../libs/apply.h"
+#include "../libs/merkle.h"
+#include "../libs/coalesce.h"
 
 #define True 1
 #define False 0
@@ -17,158 +26,1042 @@
 #define SUCCESS 0
 #define UNSUCCESS 1
 
-#define FIFO_NAME_LEN 32
+#define HANDSHAKE_TIMEOUT_MS 5000 // how long to wait for the server to answer
+#define BATCH_INPUTS 64 // inputs merged into one command at most
+#define SENT_MAX 64 // merged commands remembered until their broadcast
+#define PASTE_PIECE 1024 // content bytes per DATA piece, escaped or framed it stays within PIPE_BUF
 #define command_number 12
 
-volatile sig_atomic_t handshake = 0; // volatile type
-
 // argv
 pid_t server_pid;
 char* username;
+int binary = False; // -b: binary framing after the handshake
+snapshot_region snapshot; // mapped when the server offers it, DOC? is then read locally
+int has_snapshot = False;
+int coalesce_ms = 0; // -c: window in which adjacent edits are merged, 0 sends every line
+char* cache_path = NULL; // -r: the last document is kept here, a reconnect resumes from it
+char* document_name = NULL; // -d: the document to join, the server's default one when NULL
 
 // doc
 uint64_t version;
+document* replica = NULL; // the committed document, kept up to date from the broadcasts
+int replica_stale = False; // a version was missed or did not apply, wait for a RESYNC
+pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *valid_cmds[] = {
     "INSERT", "DEL", "NEWLINE", "HEADING", "BOLD", "ITALIC", "BLOCKQUOTE",
     "ORDERED_LIST", "UNORDERED_LIST", "CODE", "HORIZONTAL_RULE", "LINK"
 };
 
+// coalescing
+/**
+ * Edits typed within the window, merged into one command (see coalesce.h)
+ */
+typedef struct batch {
+    coalesced edits;
+    char* inputs[BATCH_INPUTS]; // text form of every merged input
+    int count;
+    struct timespec deadline; // CLOCK_REALTIME, when the batch is sent at the latest
+} batch;
+
+/**
+ * A merged command on its way, its broadcast line is printed once per input
+ */
+typedef struct sent_batch {
+    char* command; // text form of the merged command
+    char* inputs[BATCH_INPUTS];
+    int count;
+} sent_batch;
+
+batch pending;
+sent_batch sent[SENT_MAX]; // oldest first
+int sent_count = 0;
+int input_done = False;
+pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+// verify
+#define VERIFY_IDLE 0
+#define VERIFY_ROOT 1 // HASH? sent
+#define VERIFY_BLOCKS 2 // BLOCKS? sent, the roots differ
+#define VERIFY_RANGE 3 // RANGE? sent for the blocks that differ
+
+/**
+ * A VERIFY in progress, with replica_lock held. The answers arrive on the listener, which
+ * sends the next query itself.
+ */
+typedef struct verify_state {
+    int step;
+    int fd;
+    uint64_t root; // the server's root, the repaired replica must reach it
+    size_t blocks; // the server's block count
+    size_t local_start; // the replica bytes the RANGE? answer replaces
+    size_t local_end;
+} verify_state;
+
+verify_state verifying = {.step = VERIFY_IDLE, .fd = -1};
+
 // === helper function ===
 int is_valid_output(const char *line) {
     if (strncmp(line, "EDIT ", 5) != 0){
         return False;
     }
 
-    char buf[256];
-    strncpy(buf, line, sizeof(buf));
-    buf[sizeof(buf)-1] = '\0';
-
-    // divided the message into 3 parts name/command/message
-    char *p = buf + 5;
-    char *name_end = strchr(p, ' ');
+    // divided the message into 3 parts name/command/message, a pasted line can be long
+    const char *p = line + 5;
+    const char *name_end = strchr(p, ' ');
     if (!name_end) return False;
-    *name_end = '\0';
-    char *command = name_end + 1;
-    char *cmd_end = strchr(command, ' ');
+    const char *command = name_end + 1;
+    const char *cmd_end = strchr(command, ' ');
     if (!cmd_end) return False;
-    *cmd_end = '\0';
-    char *message = cmd_end + 1;
+    size_t command_len = cmd_end - command;
+    const char *message = cmd_end + 1;
     if (*message == '\0') return False;
     
     for (size_t i = 0; i < command_number; i++) {
-        if (strcmp(command, valid_cmds[i]) == 0) {
+        if (strlen(valid_cmds[i]) == command_len && strncmp(command, valid_cmds[i], command_len) == 0) {
             return True;
         }
     }
     return False;
 }
 
+// === replica ===
+/**
+ * Replace the replica with a copy of the document at version v, its chunks laid out as
+ * layout says. Called with the initial document and with every RESYNC.
+ */
+void replica_reset(const char* text, size_t len, const char* layout, uint64_t v) {
+    pthread_mutex_lock(&replica_lock);
+    markdown_free(replica);
+    replica = markdown_load(text, len, layout, v);
+    replica_stale = replica == NULL;
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/**
+ * Read the cached document of a server:
+ * "MDCACHE3 <server_pid> <document> <version> <len>\n<content>\n<layout>\n". Return
+ * SUCCESS and malloc'd copies of the content and its layout, or UNSUCCESS when there is
+ * none for this server and document.
+ */
+int cache_load(const char* path, uint64_t* v, char** text, size_t* len, char** layout) {
+    FILE* f = fopen(path, "r");
+    if (!f) return UNSUCCESS;
+    long pid;
+    char name[CHANNEL_MAX];
+    const char* joined = document_name ? document_name : DOCUMENT_DEFAULT;
+    int result = UNSUCCESS;
+    if (fscanf(f, "MDCACHE3 %ld %23s %lu %zu", &pid, name, v, len) == 4 && fgetc(f) == '\n' &&
+        pid == server_pid && strcmp(name, joined) == 0) {
+        *text = malloc(*len + 1);
+        *layout = NULL;
+        size_t cap = 0;
+        if (*text && fread(*text, 1, *len, f) == *len && fgetc(f) == '\n' && getline(layout, &cap, f) > 0) {
+            (*text)[*len] = '\0';
+            (*layout)[strcspn(*layout, "\n")] = '\0';
+            result = SUCCESS;
+        } else {
+            free(*text);
+            free(*layout);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+/**
+ * Write the replica to the cache, with replica_lock held. The file is replaced in one step,
+ * so a crash leaves the previous copy.
+ */
+void cache_save() {
+    if (!cache_path || !replica || replica_stale || !replica->current_version) return;
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) return;
+    char* layout = markdown_layout(replica);
+    if (!layout) {
+        fclose(f);
+        remove(tmp);
+        return;
+    }
+    size_t len = strlen(replica->current_version);
+    fprintf(f, "MDCACHE3 %ld %s %lu %zu\n", (long)server_pid, document_name ? document_name : DOCUMENT_DEFAULT,
+            replica->version, len);
+    fwrite(replica->current_version, 1, len, f);
+    fprintf(f, "\n%s\n", layout);
+    free(layout);
+    if (fclose(f) == 0) rename(tmp, cache_path);
+}
+
+/**
+ * Whether the edits of version num are to be applied, with replica_lock held. Versions the
+ * replica already holds are skipped; after a gap the replica is stale until a RESYNC.
+ */
+int replica_follows(uint64_t num) {
+    if (!replica || replica_stale || num <= replica->version) return False;
+    if (num != replica->version + 1) {
+        fprintf(stderr, "Replica at version %lu missed version %lu\n", replica->version, num - 1);
+        replica_stale = True;
+        return False;
+    }
+    return True;
+}
+
+/**
+ * Apply one op of a broadcast version, with replica_lock held. Only edits that succeeded on
+ * the server changed its document; one that fails here means the replica diverged.
+ */
+void replica_apply(const char* user, const op* o, int result, void* arg) {
+    (void)user;
+    (void)arg;
+    if (replica_stale || result != RESULT_SUCCESS) return;
+    if (apply_op(replica, replica->version + 1, o) != SUCCESS) {
+        fprintf(stderr, "Replica diverged at version %lu\n", replica->version + 1);
+        replica_stale = True;
+    }
+}
+
+/**
+ * Commit the edits of version num, with replica_lock held
+ */
+void replica_commit(uint64_t num) {
+    if (replica_stale) return;
+    markdown_increment_version(replica);
+    if (replica->version != num) {
+        fprintf(stderr, "Replica diverged at version %lu\n", num);
+        replica_stale = True;
+    }
+}
+
+/**
+ * Parse an "EDIT <user> <command> SUCCESS" line into o, the payload points into buf.
+ * Return False for rejected edits and anything else.
+ */
+int parse_edit_line(const char* line, char* buf, size_t size, op* o) {
+    if (strncmp(line, "EDIT ", 5) != 0) return False;
+    const char* command = strchr(line + 5, ' ');
+    const char* status = strrchr(line, ' ');
+    if (!command || status <= command || strcmp(status, " SUCCESS") != 0) return False;
+    size_t len = status - (command + 1);
+    if (len >= size) return False;
+    memcpy(buf, command + 1, len);
+    buf[len] = '\0';
+    if (op_parse_text(buf, o) != SUCCESS) return False;
+
+    // the payload was escaped to fit on the line
+    if (o->len > 0) o->len = op_unescape(buf + (o->payload - buf), o->len);
+    return True;
+}
+
+/**
+ * If command is a merged command of ours, print the line of the broadcast once for every
+ * input it stands for, with the result of the merged command. Return False otherwise.
+ */
+int expand_edit(const char* user, const char* command, const char* status) {
+    if (strcmp(user, username) != 0) return False;
+    pthread_mutex_lock(&batch_lock);
+    int found = -1;
+    for (int i = 0; i < sent_count && found < 0; i++) {
+        if (strcmp(sent[i].command, command) == 0) found = i;
+    }
+    if (found < 0) {
+        pthread_mutex_unlock(&batch_lock);
+        return False;
+    }
+
+    sent_batch* b = &sent[found];
+    for (int i = 0; i < b->count; i++) {
+        printf("EDIT %s %s %s\n", user, b->inputs[i], status);
+        free(b->inputs[i]);
+    }
+    free(b->command);
+    memmove(&sent[found], &sent[found + 1], (sent_count - found - 1) * sizeof(sent_batch));
+    sent_count--;
+    pthread_mutex_unlock(&batch_lock);
+    return True;
+}
+
+/**
+ * expand_edit for a text broadcast line "EDIT <user> <command> SUCCESS|Reject <reason>"
+ */
+int expand_line(const char* line) {
+    char* buf = strdup(line);
+    if (!buf) return False;
+    int expanded = False;
+
+    char* user = buf + 5;
+    char* command = strchr(user, ' ');
+    char* status = command ? strrchr(command + 1, ' ') : NULL;
+    if (status) {
+        *command++ = '\0';
+
+        // the status is the last word, or the last two after a Reject
+        if (strcmp(status, " SUCCESS") != 0) {
+            *status = '\0';
+            char* reject = strrchr(command, ' ');
+            *status = ' ';
+            status = reject && strncmp(reject, " Reject ", 8) == 0 ? reject : NULL;
+        }
+    }
+    if (status) {
+        *status++ = '\0';
+        expanded = expand_edit(user, command, status);
+    }
+    free(buf);
+    return expanded;
+}
+
+/**
+ * Print one op of a version the way the text protocol sends it
+ */
+void print_edit(const char* user, const op* o, int result, void* arg) {
+    (void)arg;
+    size_t len = op_format(o, NULL, 0);
+    char* line = malloc(len + 1);
+    if (!line) return;
+    op_format(o, line, len + 1);
+    char status[64];
+    if (result == RESULT_SUCCESS) {
+        snprintf(status, sizeof(status), "SUCCESS");
+    } else {
+        snprintf(status, sizeof(status), "Reject %s", result_name(result));
+    }
+    if (!expand_edit(user, line, status)) printf("EDIT %s %s %s\n", user, line, status);
+    free(line);
+}
+
+// === verify ===
+void send_binary(int fd, const char* input);
+
+/**
+ * Send a query on the way VERIFY was typed
+ */
+void verify_send(const char* query) {
+    if (binary) {
+        send_binary(verifying.fd, query);
+    } else {
+        dprintf(verifying.fd, "%s\n", query);
+    }
+}
+
+/**
+ * The answer is for another version than the replica's, a broadcast is still on its way.
+ * Give up, the next VERIFY compares again.
+ */
+int verify_raced(uint64_t v) {
+    if (replica->version == v) return False;
+    printf("VERIFY RACED replica %lu server %lu\n", replica->version, v);
+    verifying.step = VERIFY_IDLE;
+    return True;
+}
+
+/**
+ * VERIFY: compare the replica with the server's hash tree, and when they differ fetch only
+ * the bytes of the blocks that differ
+ */
+void verify_start(int fd) {
+    pthread_mutex_lock(&replica_lock);
+    if (!replica || replica_stale) {
+        printf("VERIFY STALE\n");
+    } else if (verifying.step != VERIFY_IDLE) {
+        printf("VERIFY BUSY\n");
+    } else {
+        verifying.step = VERIFY_ROOT;
+        verifying.fd = fd;
+        verify_send("HASH?");
+    }
+    pthread_mutex_unlock(&replica_lock);
+    fflush(stdout);
+}
+
+/**
+ * Whether the listener should hand the next answer of a step to verify
+ */
+int verify_expects(int step) {
+    pthread_mutex_lock(&replica_lock);
+    int expects = verifying.step == step;
+    pthread_mutex_unlock(&replica_lock);
+    return expects;
+}
+
+/**
+ * The server's root. Equal roots end the check, otherwise ask for the leaves.
+ */
+void verify_hash(uint64_t v, uint64_t root, size_t blocks) {
+    pthread_mutex_lock(&replica_lock);
+    if (verifying.step == VERIFY_ROOT && replica && !verify_raced(v)) {
+        if (merkle_root(replica->hashes) == root) {
+            printf("VERIFY OK %lu\n", v);
+            verifying.step = VERIFY_IDLE;
+        } else {
+            verifying.step = VERIFY_BLOCKS;
+            verifying.root = root;
+            verifying.blocks = blocks;
+            char query[64];
+            snprintf(query, sizeof(query), "BLOCKS? 0 %zu", blocks);
+            verify_send(query);
+        }
+    }
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/**
+ * The server's leaves, one "<pos> <len> <hash>" line each. The blocks that match from the
+ * front and from the back are the same bytes on both sides, only the span between them is
+ * fetched. A truncated answer fetches everything after the front.
+ */
+void verify_blocks(uint64_t v, size_t count, const char* lines) {
+    pthread_mutex_lock(&replica_lock);
+    if (verifying.step != VERIFY_BLOCKS || !replica || verify_raced(v)) {
+        pthread_mutex_unlock(&replica_lock);
+        return;
+    }
+    merkle_block* theirs = malloc((count ? count : 1) * sizeof(merkle_block));
+    if (!theirs) {
+        verifying.step = VERIFY_IDLE;
+        pthread_mutex_unlock(&replica_lock);
+        return;
+    }
+    size_t n = 0;
+    for (const char* p = lines; n < count && p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        if (sscanf(p, "%zu %zu %lx", &theirs[n].pos, &theirs[n].len, &theirs[n].hash) == 3) n++;
+    }
+
+    const merkle* ours = replica->hashes;
+    size_t front = 0;
+    while (front < n && front < ours->count && theirs[front].hash == ours->blocks[front].hash &&
+           theirs[front].len == ours->blocks[front].len) {
+        front++;
+    }
+    int truncated = n < verifying.blocks;
+    size_t back = 0;
+    while (!truncated && back < n - front && back < ours->count - front &&
+           theirs[n - 1 - back].hash == ours->blocks[ours->count - 1 - back].hash &&
+           theirs[n - 1 - back].len == ours->blocks[ours->count - 1 - back].len) {
+        back++;
+    }
+
+    size_t start = front > 0 ? ours->blocks[front - 1].pos + ours->blocks[front - 1].len : 0;
+    size_t their_len = n > 0 ? theirs[n - 1].pos + theirs[n - 1].len : 0;
+    size_t their_end = truncated ? SIZE_MAX : back > 0 ? theirs[n - back].pos : their_len;
+    verifying.local_start = start;
+    verifying.local_end = back > 0 ? ours->blocks[ours->count - back].pos : strlen(replica->current_version);
+    free(theirs);
+
+    verifying.step = VERIFY_RANGE;
+    char query[80];
+    snprintf(query, sizeof(query), "RANGE? %zu %zu", start, their_end - start);
+    verify_send(query);
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/**
+ * The server's bytes of the span that differs: splice them into the replica
+ */
+void verify_range(uint64_t v, const char* content, size_t len) {
+    pthread_mutex_lock(&replica_lock);
+    if (verifying.step != VERIFY_RANGE || !replica || verify_raced(v)) {
+        pthread_mutex_unlock(&replica_lock);
+        return;
+    }
+    verifying.step = VERIFY_IDLE;
+    // the chunks around the span keep their types
+    document* repaired = markdown_splice(replica, verifying.local_start, verifying.local_end, content, len, v);
+    markdown_free(replica);
+    replica = repaired;
+    replica_stale = replica == NULL;
+    if (replica && merkle_root(replica->hashes) == verifying.root) {
+        printf("VERIFY REPAIRED %lu %zu bytes fetched\n", v, len);
+    } else {
+        printf("VERIFY MISMATCH %lu\n", v);
+    }
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/**
+ * Print binary frames from the server in the same form as the text protocol
+ */
+void listen_binary(FILE* in) {
+    unsigned char* buffer = NULL;
+    size_t cap = 0;
+    op o;
+
+    while (frame_read(in, &buffer, &cap, &o) == SUCCESS) {
+        if (o.opcode == OP_RESULT) {
+            printf("%s\n", result_name((int)o.args[0]));
+        } else if (o.opcode == OP_VERSION) {
+            version = o.version; // later commands are made against this version
+            printf("VERSION %lu\n", o.version);
+            history_decode((const unsigned char*)o.payload, o.len, print_edit, NULL);
+
+            pthread_mutex_lock(&replica_lock);
+            if (replica_follows(o.version)) {
+                history_decode((const unsigned char*)o.payload, o.len, replica_apply, NULL);
+                replica_commit(o.version);
+            }
+            pthread_mutex_unlock(&replica_lock);
+        } else if (o.opcode == OP_RESYNC) {
+            // the content, then its layout (arg1 long)
+            size_t len = o.len - (size_t)o.args[1];
+            char* layout = strndup(o.payload + len, (size_t)o.args[1]);
+            replica_reset(o.payload, len, layout, o.version);
+            free(layout);
+            printf("RESYNC\n%lu\n%zu\n%.*s\n", o.version, len, (int)len, o.payload);
+        } else if (o.opcode == OP_HASH) {
+            // "<root> <blocks>"
+            char answer[64];
+            snprintf(answer, sizeof(answer), "%.*s", (int)o.len, o.payload);
+            uint64_t root = strtoull(answer, NULL, 16);
+            size_t blocks = strtoull(strchr(answer, ' ') ? strchr(answer, ' ') : "0", NULL, 10);
+            if (verify_expects(VERIFY_ROOT)) {
+                verify_hash(o.version, root, blocks);
+            } else {
+                printf("HASH %lu %s\n", o.version, answer);
+            }
+        } else if (o.opcode == OP_BLOCKS) {
+            if (verify_expects(VERIFY_BLOCKS)) {
+                char* lines = strndup(o.payload, o.len);
+                if (lines) verify_blocks(o.version, o.args[1], lines);
+                free(lines);
+            } else {
+                printf("BLOCKS %lu %lu %lu\n%.*s", o.version, o.args[0], o.args[1], (int)o.len, o.payload);
+            }
+        } else if (o.opcode == OP_RANGE) {
+            if (verify_expects(VERIFY_RANGE)) {
+                verify_range(o.version, o.payload, o.len);
+            } else {
+                printf("RANGE %lu %lu %lu\n%.*s\n", o.version, o.args[0], o.args[1], (int)o.len, o.payload);
+            }
+        } else if (o.opcode == OP_READ) {
+            printf("READ %lu %lu %lu\n%.*s\n", o.version, o.args[0], o.args[1], (int)o.len, o.payload);
+        } else if (o.opcode == OP_READLINES) {
+            printf("READLINES %lu %lu %lu %zu\n%.*s\n", o.version, o.args[0], o.args[1], o.len, (int)o.len, o.payload);
+        } else {
+            // a DOC? answer carries its version, a stale replica starts over from it
+            pthread_mutex_lock(&replica_lock);
+            int stale = replica_stale;
+            pthread_mutex_unlock(&replica_lock);
+            size_t len = o.len;
+            if (o.opcode == OP_DOC) len -= (size_t)o.args[1]; // the layout follows the content
+            if (o.opcode == OP_DOC && stale) {
+                char* layout = strndup(o.payload + len, (size_t)o.args[1]);
+                replica_reset(o.payload, len, layout, o.version);
+                free(layout);
+            }
+            printf("%.*s\n", (int)len, o.payload); // DOC? and PERM? answers
+        }
+        fflush(stdout);
+    }
+    free(buffer);
+}
+
+/**
+ * Read the rest of a text RESYNC (version, length, content, layout) and start the replica
+ * over
+ */
+void listen_resync(FILE* in) {
+    char line[64];
+    if (!fgets(line, sizeof(line), in)) return;
+    uint64_t v = strtoull(line, NULL, 10);
+    if (!fgets(line, sizeof(line), in)) return;
+    size_t len = strtoull(line, NULL, 10);
+
+    char* content = malloc(len + 1);
+    if (!content) return;
+    size_t got = fread(content, 1, len, in);
+    content[got] = '\0';
+    fgetc(in); // the newline after the content
+    char* layout = NULL;
+    size_t cap = 0;
+    if (getline(&layout, &cap, in) > 0) layout[strcspn(layout, "\n")] = '\0';
+
+    replica_reset(content, got, layout, v);
+    printf("RESYNC\n%lu\n%zu\n%s\n", v, got, content);
+    free(layout);
+    free(content);
+}
+
+/**
+ * Read the block lines of a text BLOCKS answer for verify, or print them
+ */
+void listen_blocks(FILE* in, const char* header) {
+    uint64_t v;
+    size_t first, count;
+    if (sscanf(header, "BLOCKS %lu %zu %zu", &v, &first, &count) != 3) {
+        printf("%s\n", header);
+        return;
+    }
+    char* lines = malloc(count * 64 + 1);
+    if (!lines) return;
+    size_t len = 0;
+    char line[64];
+    for (size_t i = 0; i < count && fgets(line, sizeof(line), in); i++) {
+        size_t n = strlen(line);
+        memcpy(lines + len, line, n);
+        len += n;
+    }
+    lines[len] = '\0';
+    verify_blocks(v, count, lines);
+    free(lines);
+}
+
+/**
+ * Read the bytes of a text RANGE answer (they may hold newlines) for verify
+ */
+void listen_range(FILE* in, const char* header) {
+    uint64_t v;
+    size_t pos, len;
+    if (sscanf(header, "RANGE %lu %zu %zu", &v, &pos, &len) != 3) {
+        printf("%s\n", header);
+        return;
+    }
+    char* content = malloc(len + 1);
+    if (!content) return;
+    size_t got = fread(content, 1, len, in);
+    fgetc(in); // the newline after the bytes
+    verify_range(v, content, got);
+    free(content);
+}
+
 /**
  * This thread is used to listen the message from the server
  * FIX: Accepts a FILE* stream, handles all subsequent reads, and closes the stream on exit.
  */
 void* listener_thread(void* stream) {
     FILE* in = (FILE*)stream; 
-    char line[256];
+    char* line = NULL; // the EDIT line of a paste is as long as the paste
+    size_t cap = 0;
 
-    while (fgets(line, sizeof(line), in)) {
+    if (binary) {
+        listen_binary(in);
+    }
+
+    while (!binary && getline(&line, &cap, in) > 0) {
         line[strcspn(line, "\n")] = '\0';
 
         if (strncmp(line, "VERSION", 7) == 0) {
             printf("%s\n", line); // print the version line
+            uint64_t num = strtoull(line + 7, NULL, 10);
+            version = num; // edits are coalesced within a version
 
-            while (fgets(line, sizeof(line), in)) {
+            // the replica is locked until END, so a local DOC? never sees half a version
+            pthread_mutex_lock(&replica_lock);
+            int follows = replica_follows(num);
+            while (getline(&line, &cap, in) > 0) {
                 line[strcspn(line, "\n")] = '\0';
                 if (strcmp(line, "END") == 0){
                     break;;
                 }
                 
-                if (is_valid_output(line)) {
+                if (is_valid_output(line) && !expand_line(line)) {
                     printf("%s\n", line);
                 }  
+
+                size_t size = strlen(line) + 1;
+                char* command = follows ? malloc(size) : NULL;
+                op o;
+                if (command && parse_edit_line(line, command, size, &o)) {
+                    replica_apply(NULL, &o, RESULT_SUCCESS, NULL);
+                }
+                free(command);
             }
+            if (follows) replica_commit(num);
+            pthread_mutex_unlock(&replica_lock);
+        } else if (strcmp(line, "RESYNC") == 0) {
+            listen_resync(in);
+        } else if (strncmp(line, "HASH ", 5) == 0 && verify_expects(VERIFY_ROOT)) {
+            uint64_t v, root;
+            size_t blocks;
+            if (sscanf(line, "HASH %lu %lx %zu", &v, &root, &blocks) == 3) verify_hash(v, root, blocks);
+        } else if (strncmp(line, "BLOCKS ", 7) == 0 && verify_expects(VERIFY_BLOCKS)) {
+            listen_blocks(in, line);
+        } else if (strncmp(line, "RANGE ", 6) == 0 && verify_expects(VERIFY_RANGE)) {
+            listen_range(in, line);
         } else {
             printf("%s\n", line); 
         }
     }
     
+    // keep what we have for the next connection
+    pthread_mutex_lock(&replica_lock);
+    cache_save();
+    pthread_mutex_unlock(&replica_lock);
+
     // FIX: Close the stream when the server closes the pipe.
+    free(line);
     fclose(in); 
     
     return NULL;
 }
 
 /**
- * This thread is used to handle stdin input
+ * Encode one typed command as a binary frame and write it in one go
  */
-void* stdin_thread(void* fd_c2s) {
+void send_binary(int fd, const char* input) {
+    op o;
+    if (op_parse_text(input, &o) != SUCCESS) {
+        if (input[0] != '\0') printf("Unknown command: %s\n", input);
+        return;
+    }
+    o.version = version;
+
+    size_t len;
+    unsigned char* frame = frame_build(&o, &len);
+    if (!frame) return;
+    write(fd, frame, len);
+    free(frame);
+}
+
+// === coalescing ===
+/**
+ * Send a merged INSERT or DEL. The text form is written raw, like a typed line.
+ */
+void send_merged(int fd, const op* o) {
+    if (binary) {
+        size_t len;
+        unsigned char* frame = frame_build(o, &len);
+        if (!frame) return;
+        write(fd, frame, len);
+        free(frame);
+    } else if (o->opcode == OP_INSERT) {
+        dprintf(fd, "INSERT %lu %.*s\n", o->args[0], (int)o->len, o->payload);
+    } else {
+        dprintf(fd, "DEL %lu %lu\n", o->args[0], o->args[1]);
+    }
+}
+
+/**
+ * Send the pending batch, with batch_lock held. A batch of several inputs is remembered
+ * until its broadcast, the oldest is forgotten when too many are on their way (a command
+ * that failed in a tick without a commit is never broadcast).
+ */
+void batch_flush(int fd) {
+    if (pending.count == 0) return;
+    send_merged(fd, &pending.edits.merged);
+
+    if (pending.count == 1) {
+        free(pending.inputs[0]);
+    } else {
+        if (sent_count == SENT_MAX) {
+            for (int i = 0; i < sent[0].count; i++) free(sent[0].inputs[i]);
+            free(sent[0].command);
+            memmove(&sent[0], &sent[1], (SENT_MAX - 1) * sizeof(sent_batch));
+            sent_count--;
+        }
+        sent_batch* b = &sent[sent_count++];
+        size_t len = op_format(&pending.edits.merged, NULL, 0);
+        b->command = malloc(len + 1);
+        if (b->command) op_format(&pending.edits.merged, b->command, len + 1);
+        memcpy(b->inputs, pending.inputs, pending.count * sizeof(char*));
+        b->count = pending.count;
+        if (!b->command) {
+            for (int i = 0; i < b->count; i++) free(b->inputs[i]);
+            sent_count--;
+        }
+    }
+    pending.count = 0;
+}
+
+/**
+ * Whether o continues the pending batch
+ */
+int batch_merges(const op* o) {
+    return pending.count > 0 && pending.count < BATCH_INPUTS && coalesce_continues(&pending.edits, o);
+}
+
+/**
+ * Add an edit to the pending batch, with batch_lock held. Return False for a command that
+ * is not coalesced, the batch is then sent first so the order is kept.
+ */
+int batch_add(int fd, const op* o) {
+    if (!coalesce_takes(o)) {
+        batch_flush(fd);
+        return False;
+    }
+
+    char* input = malloc(op_format(o, NULL, 0) + 1);
+    if (!input) {
+        batch_flush(fd);
+        return False;
+    }
+    op_format(o, input, op_format(o, NULL, 0) + 1);
+
+    if (batch_merges(o)) {
+        coalesce_add(&pending.edits, o);
+        pending.inputs[pending.count++] = input;
+        return True;
+    }
+
+    // a new batch, sent when the window closes
+    batch_flush(fd);
+    coalesce_start(&pending.edits, o);
+    pending.inputs[0] = input;
+    pending.count = 1;
+    clock_gettime(CLOCK_REALTIME, &pending.deadline);
+    pending.deadline.tv_nsec += (long)(coalesce_ms % 1000) * 1000000;
+    pending.deadline.tv_sec += coalesce_ms / 1000 + pending.deadline.tv_nsec / 1000000000;
+    pending.deadline.tv_nsec %= 1000000000;
+    pthread_cond_signal(&batch_cond);
+    return True;
+}
+
+/**
+ * This thread sends a batch when its window closes
+ */
+void* coalesce_thread(void* fd_c2s) {
     int fd = *(int*)fd_c2s;
+    pthread_mutex_lock(&batch_lock);
+    while (!input_done) {
+        if (pending.count == 0) {
+            pthread_cond_wait(&batch_cond, &batch_lock);
+            continue;
+        }
+        struct timespec deadline = pending.deadline;
+        if (pthread_cond_timedwait(&batch_cond, &batch_lock, &deadline) != ETIMEDOUT) continue;
 
-    char input[256];
-    while (fgets(input, sizeof(input), stdin)) {
-        if (strncmp(input, "DISCONNECT", 10) == 0) {
-            dprintf(fd, "DISCONNECT\n");
-            break;
+        // a newer batch may have taken the place of the one waited for
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec > pending.deadline.tv_sec ||
+            (now.tv_sec == pending.deadline.tv_sec && now.tv_nsec >= pending.deadline.tv_nsec)) {
+            batch_flush(fd);
         }
-        dprintf(fd, "%s\n", input);
     }
+    pthread_mutex_unlock(&batch_lock);
     return NULL;
 }
 
+// === paste ===
+/**
+ * Write one command in a single write. Pieces stay within PIPE_BUF, so a query the
+ * listener sends in between never lands inside one.
+ */
+void send_piece(int fd, const op* o) {
+    if (binary) {
+        size_t len;
+        unsigned char* frame = frame_build(o, &len);
+        if (!frame) return;
+        write(fd, frame, len);
+        free(frame);
+        return;
+    }
+
+    // escaped like a broadcast payload; a leading space is escaped too, the parser skips it
+    char line[8 + 2 * PASTE_PIECE];
+    size_t n;
+    if (o->opcode == OP_PASTE) {
+        n = snprintf(line, sizeof(line), "PASTE %lu %lu\n", o->args[0], o->args[1]);
+    } else {
+        n = snprintf(line, sizeof(line), "DATA ");
+        for (size_t i = 0; i < o->len; i++) {
+            char c = o->payload[i];
+            if (c == '\\' || c == '\n' || (i == 0 && c == ' ')) {
+                line[n++] = '\\';
+                c = c == '\n' ? 'n' : c;
+            }
+            line[n++] = c;
+        }
+        line[n++] = '\n';
+    }
+    write(fd, line, n);
+}
+
+/**
+ * Send content of any length as a PASTE and its DATA pieces. The server gathers the
+ * pieces and applies them as one insert in a single tick.
+ */
+void send_paste(int fd, uint64_t pos, const char* content, size_t len) {
+    op paste = {.opcode = OP_PASTE, .version = version, .args = {pos, len}};
+    send_piece(fd, &paste);
+    for (size_t off = 0; off < len; off += PASTE_PIECE) {
+        op piece = {.opcode = OP_DATA, .version = version, .payload = content + off};
+        piece.len = len - off < PASTE_PIECE ? len - off : PASTE_PIECE;
+        send_piece(fd, &piece);
+    }
+}
 
 /**
- * signal 
+ * Read a whole file into a malloc'd buffer, its size is stored in *len
  */
-void handle_sig(int sig) {
-    if (sig == SIGRTMIN + 1) {
-        handshake = True;
+char* read_file(const char* path, size_t* len) {
+    FILE* f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t cap = 4096;
+    char* content = malloc(cap);
+    *len = 0;
+    size_t n;
+    while (content && (n = fread(content + *len, 1, cap - *len, f)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            char* bigger = realloc(content, cap *= 2);
+            if (!bigger) free(content);
+            content = bigger;
+        }
     }
+    fclose(f);
+    return content;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <server_pid> <username>\n", argv[0]);
-        return UNSUCCESS;
+/**
+ * The inputs that stream content: "PASTE <pos> <len>" followed by len raw bytes on stdin,
+ * "IMPORT <pos> <file>", and an INSERT too long for one piece. Return False for any other
+ * input.
+ */
+int paste_input(int fd, const char* input) {
+    uint64_t pos;
+    size_t len;
+    char path[256];
+    char* content = NULL;
+    if (sscanf(input, "PASTE %lu %zu", &pos, &len) == 2) {
+        content = malloc(len + 1);
+        if (content) len = fread(content, 1, len, stdin);
+    } else if (sscanf(input, "IMPORT %lu %255s", &pos, path) == 2) {
+        content = read_file(path, &len);
+        if (!content) printf("Cannot read %s\n", path);
+    } else {
+        op o;
+        if (strlen(input) <= PASTE_PIECE || strncmp(input, "INSERT ", 7) != 0 || op_parse_text(input, &o) != SUCCESS) {
+            return False;
+        }
+        send_paste(fd, o.args[0], o.payload, o.len);
+        return True;
     }
-    
-    server_pid = atoi(argv[1]);
-    username = argv[2];
 
-    // make our handle_sig function work
-    struct sigaction sa;
-    sa.sa_handler = handle_sig;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGRTMIN + 1, &sa, NULL);
+    if (content && len > 0) send_paste(fd, pos, content, len);
+    free(content);
+    return True;
+}
+
+/**
+ * This thread is used to handle stdin input
+ */
+void* stdin_thread(void* fd_c2s) {
+    int fd = *(int*)fd_c2s;
+
+    char* input = NULL; // a typed line has no length limit
+    size_t cap = 0;
+    while (getline(&input, &cap, stdin) > 0) {
+        // edits wait for the window, anything else sends them first
+        if (coalesce_ms > 0) {
+            char* line = strndup(input, strcspn(input, "\n"));
+            if (!line) continue;
+            op o;
+            int parsed = op_parse_text(line, &o) == SUCCESS;
+            o.version = version;
 
-    // send signal to server
-    kill(server_pid, SIGRTMIN);
+            pthread_mutex_lock(&batch_lock);
+            int batched = parsed ? batch_add(fd, &o) : False;
+            if (!parsed) batch_flush(fd);
+            pthread_mutex_unlock(&batch_lock);
+            free(line);
+            if (batched) continue;
+        }
 
-    while (handshake == False) {
-        usleep(20);
+        // the replica holds the latest committed version, no need to ask
+        if (strcmp(input, "DOC?\n") == 0) {
+            pthread_mutex_lock(&replica_lock);
+            char* content = replica && !replica_stale ? markdown_flatten(replica) : NULL;
+            pthread_mutex_unlock(&replica_lock);
+            if (content) {
+                printf("%s\n", content);
+                fflush(stdout);
+                free(content);
+                continue;
+            }
+        }
+        // or it is in our own mapping
+        if (has_snapshot && strcmp(input, "DOC?\n") == 0) {
+            uint64_t snapshot_version;
+            size_t len;
+            char* content = snapshot_read(&snapshot, &snapshot_version, &len);
+            if (content) {
+                printf("%s\n", content);
+                fflush(stdout);
+                free(content);
+                continue;
+            }
+        }
+        if (strcmp(input, "VERIFY\n") == 0) {
+            verify_start(fd);
+            continue;
+        }
+        input[strcspn(input, "\n")] = '\0';
+        if (paste_input(fd, input)) continue;
+        if (strncmp(input, "DISCONNECT", 10) == 0) {
+            if (binary) {
+                send_binary(fd, "DISCONNECT");
+            } else {
+                dprintf(fd, "DISCONNECT\n");
+            }
+            break;
+        }
+        if (binary) {
+            send_binary(fd, input);
+            continue;
+        }
+        dprintf(fd, "%s\n", input);
     }
+    free(input);
+    return NULL;
+}
 
-    // open fifos
-    pid_t client_pid = getpid(); 
-    char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
-    snprintf(fifo_c2s, sizeof(fifo_c2s), "FIFO_C2S_%d", client_pid);
-    snprintf(fifo_s2c, sizeof(fifo_s2c), "FIFO_S2C_%d", client_pid);
 
-    int fd_c2s = open(fifo_c2s, O_WRONLY);
-    if (fd_c2s < 0) {
-        perror("Error opening C2S FIFO");
-        return UNSUCCESS;
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "bc:r:d:")) != -1) {
+        if (opt == 'b') {
+            binary = True;
+        } else if (opt == 'c') {
+            coalesce_ms = atoi(optarg);
+        } else if (opt == 'r') {
+            cache_path = optarg;
+        } else if (opt == 'd') {
+            document_name = optarg;
+        } else {
+            optind = argc; // force the usage message
+            break;
+        }
     }
-    
-    int fd_s2c = open(fifo_s2c, O_RDONLY);
-    if (fd_s2c < 0) {
-        perror("Error opening S2C FIFO");
-        close(fd_c2s);
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: %s [-b] [-c coalesce_ms] [-r cache_file] [-d document] <server_pid> <username>\n", argv[0]);
         return UNSUCCESS;
     }
+    
+    server_pid = atoi(argv[optind]);
+    username = argv[optind + 1];
 
+    // the channel is named after our pid
+    char channel[CHANNEL_MAX];
+    snprintf(channel, sizeof(channel), "%d", getpid());
 
-    dprintf(fd_c2s, "%s\n", username); // send user name to server
+    // ask for a connection, optionally with binary framing
+    int fd_c2s = -1, fd_s2c = -1;
+    // offer the cached version, the server sends what changed since if it still can
+    uint64_t cached_version = 0;
+    char* cached = NULL;
+    size_t cached_len = 0;
+    char* cached_layout = NULL;
+    if (cache_path && cache_load(cache_path, &cached_version, &cached, &cached_len, &cached_layout) != SUCCESS) {
+        cached = NULL;
+        cached_layout = NULL;
+    }
+    // every copy of the document comes with its layout, the replica needs it
+    int connected = channel_connect(server_pid, channel, username, document_name, binary | CONNECT_LAYOUT,
+                                    cached ? cached_version : 0, HANDSHAKE_TIMEOUT_MS, &fd_c2s, &fd_s2c);
+    if (connected == CONNECT_CHANNEL) {
+        perror("Error creating channel FIFOs");
+        return UNSUCCESS;
+    }
+    if (connected == CONNECT_REQUEST) {
+        perror("Error connecting to server");
+        return UNSUCCESS;
+    }
+    if (connected == CONNECT_TIMEOUT) {
+        fprintf(stderr, "No answer from server\n");
+        return UNSUCCESS;
+    }
 
     // handle return message from server
     FILE* in = fdopen(fd_s2c, "r");
@@ -181,13 +1074,34 @@ int main(int argc, char** argv) {
     }
     line[strcspn(line, "\n")] = '\0';
 
-    if (strcmp(line, "Reject UNAUTHORISED") == 0) {
-        fprintf(stderr, "Rejected: UNAUTHORISED\n"); 
+    if (strcmp(line, "Reject UNAUTHORISED") == 0 || strcmp(line, "Reject INVALID_DOCUMENT") == 0) {
+        fprintf(stderr, "Rejected: %s\n", line + strlen("Reject ")); 
         fclose(in);
         close(fd_c2s);
         return UNSUCCESS;
     }
 
+    // the server confirms binary framing after the role, otherwise stay with text.
+    // Readers may also be offered the snapshot region.
+    char* save = NULL;
+    strtok_r(line, " ", &save);
+    int confirmed = False;
+    int resumed = False; // the versions since the cached one follow the handshake
+    int laid_out = False; // the layout of the content follows it
+    for (char* word = strtok_r(NULL, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+        if (strcmp(word, PROTOCOL_BINARY) == 0) {
+            confirmed = True;
+        } else if (strcmp(word, PROTOCOL_RESUME) == 0) {
+            resumed = True;
+        } else if (strcmp(word, PROTOCOL_LAYOUT) == 0) {
+            laid_out = True;
+        } else if (strcmp(word, PROTOCOL_SNAPSHOT) == 0) {
+            char* region = strtok_r(NULL, " ", &save);
+            has_snapshot = region && snapshot_open(&snapshot, region) == SUCCESS;
+        }
+    }
+    binary = binary && confirmed;
+
     // Read Permission
     char permission[16];
     strncpy(permission, line, sizeof(permission));
@@ -197,7 +1111,7 @@ int main(int argc, char** argv) {
     if (fgets(line, sizeof(line), in) == NULL) { // get version
         fclose(in); close(fd_c2s); return UNSUCCESS;
     }
-    uint64_t version = strtoull(line, NULL, 10); 
+    version = strtoull(line, NULL, 10); 
     printf("Initial Version: %lu\n", version);
 
     if (fgets(line, sizeof(line), in) == NULL) { // get document len
@@ -212,28 +1126,55 @@ int main(int argc, char** argv) {
         fclose(in); close(fd_c2s); return UNSUCCESS;
     }
     
-    // Read the document content
+    // Read the document content, the replica starts from it or from the cached copy
     size_t bytes_read = fread(doc, 1, doc_len, in); 
     doc[bytes_read] = '\0';
-    printf("Initial Document Content:\n---\n%s\n---\n", doc);
 
     // FIX: Consume the extra newline separator sent by the server
     char newline_char;
     fread(&newline_char, 1, 1, in); 
 
+    char* layout = NULL;
+    size_t layout_cap = 0;
+    if (laid_out && getline(&layout, &layout_cap, in) > 0) layout[strcspn(layout, "\n")] = '\0';
+    if (resumed && cached && version == cached_version) {
+        printf("Resumed from cached version %lu:\n---\n%s\n---\n", version, cached);
+        replica_reset(cached, cached_len, cached_layout, version);
+    } else {
+        printf("Initial Document Content:\n---\n%s\n---\n", doc);
+        replica_reset(doc, bytes_read, layout, version);
+    }
+    free(layout);
+    free(doc);
+    free(cached);
+    free(cached_layout);
+
     pthread_t listener_thread_tid;
     pthread_create(&listener_thread_tid, NULL, listener_thread, in); 
 
+    pthread_t coalesce_thread_tid;
+    if (coalesce_ms > 0) pthread_create(&coalesce_thread_tid, NULL, coalesce_thread, &fd_c2s);
+
     pthread_t stdin_thread_tid;
     pthread_create(&stdin_thread_tid, NULL, stdin_thread, &fd_c2s);
 
     pthread_join(stdin_thread_tid, NULL);
+    if (coalesce_ms > 0) {
+        pthread_mutex_lock(&batch_lock);
+        batch_flush(fd_c2s);
+        input_done = True;
+        pthread_cond_signal(&batch_cond);
+        pthread_mutex_unlock(&batch_lock);
+        pthread_join(coalesce_thread_tid, NULL);
+    }
     
+    pthread_mutex_lock(&replica_lock);
+    cache_save();
+    pthread_mutex_unlock(&replica_lock);
+
     // FIX: Clean up fds opened by main thread
     close(fd_c2s); // Close the write pipe to signal end of input to server
     pthread_detach(listener_thread_tid); // Allow listener thread to clean up stream (fclose(in)) in background
     
-    free(doc);
-    
     return SUCCESS;
 }
@@ -0,0 +1,38 @@
+#include "../libs/coalesce.h"
+#include <string.h>
+
+#define True 1
+#define False 0
+
+int coalesce_takes(const op *o) {
+    return o->opcode == OP_DEL || (o->opcode == OP_INSERT && o->len <= COALESCE_MAX);
+}
+
+void coalesce_start(coalesced *c, const op *o) {
+    c->merged = *o;
+    memcpy(c->content, o->payload, o->len);
+    c->merged.payload = c->content;
+}
+
+int coalesce_continues(const coalesced *c, const op *o) {
+    const op *m = &c->merged;
+    if (o->opcode != m->opcode || o->version != m->version) return False;
+    if (o->opcode == OP_INSERT) {
+        return o->args[0] == m->args[0] + m->len && m->len + o->len <= COALESCE_MAX;
+    }
+    return o->args[0] <= m->args[0] + m->args[1] && m->args[0] <= o->args[0] + o->args[1];
+}
+
+void coalesce_add(coalesced *c, const op *o) {
+    op *m = &c->merged;
+    if (o->opcode == OP_INSERT) {
+        memcpy(c->content + m->len, o->payload, o->len);
+        m->len += o->len;
+        return;
+    }
+    uint64_t start = o->args[0] < m->args[0] ? o->args[0] : m->args[0];
+    uint64_t end = o->args[0] + o->args[1] > m->args[0] + m->args[1] ? o->args[0] + o->args[1]
+                                                                       : m->args[0] + m->args[1];
+    m->args[0] = start;
+    m->args[1] = end - start;
+}
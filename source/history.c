@@ -0,0 +1,264 @@
+#include "../libs/history.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUCCESS 0
+#define INVALID -1
+#define NS_PER_SEC 1000000000ULL
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// === store ===
+int history_init(history *h, size_t max_entries, size_t max_bytes, long max_age) {
+    if (max_entries == 0) return INVALID;
+    h->ring = calloc(max_entries, sizeof(history_entry));
+    if (!h->ring) return INVALID;
+    h->cap = max_entries;
+    h->first = 0;
+    h->count = 0;
+    h->bytes = 0;
+    h->max_bytes = max_bytes;
+    h->max_age = max_age;
+    pthread_mutex_init(&h->lock, NULL);
+    return SUCCESS;
+}
+
+void history_free(history *h) {
+    for (size_t i = 0; i < h->count; i++) {
+        free(h->ring[(h->first + i) % h->cap].data);
+    }
+    free(h->ring);
+    h->ring = NULL;
+    h->count = 0;
+    pthread_mutex_destroy(&h->lock);
+}
+
+/**
+ * Drop the oldest entry. Caller must hold h->lock.
+ */
+static void drop_oldest(history *h) {
+    history_entry *e = &h->ring[h->first];
+    h->bytes -= e->len;
+    free(e->data);
+    e->data = NULL;
+    h->first = (h->first + 1) % h->cap;
+    h->count--;
+}
+
+int history_commit(history *h, history_builder *b, uint64_t num) {
+    // users first, then the ops as they were added
+    size_t head_max = 10 + b->user_count * (HISTORY_USER_MAX + 10);
+    unsigned char *data = malloc(head_max + b->len);
+    if (!data) return INVALID;
+    size_t head_len = varint_encode(b->user_count, data);
+    for (size_t i = 0; i < b->user_count; i++) {
+        size_t name_len = strlen(b->users[i]);
+        head_len += varint_encode(name_len, data + head_len);
+        memcpy(data + head_len, b->users[i], name_len);
+        head_len += name_len;
+    }
+    if (b->len > 0) memcpy(data + head_len, b->ops, b->len);
+    size_t len = head_len + b->len;
+    builder_reset(b);
+
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&h->lock);
+
+    // retention: count, size and age
+    while (h->count > 0 && (h->count == h->cap || (h->max_bytes > 0 && h->bytes + len > h->max_bytes))) {
+        drop_oldest(h);
+    }
+    while (h->count > 0 && h->max_age > 0 &&
+           now - h->ring[h->first].time_ns > (uint64_t)h->max_age * NS_PER_SEC) {
+        drop_oldest(h);
+    }
+
+    history_entry *e = &h->ring[(h->first + h->count) % h->cap];
+    e->num = num;
+    e->time_ns = now;
+    e->data = data;
+    e->len = len;
+    h->count++;
+    h->bytes += len;
+
+    pthread_mutex_unlock(&h->lock);
+    return SUCCESS;
+}
+
+void history_clear(history *h) {
+    pthread_mutex_lock(&h->lock);
+    while (h->count > 0) drop_oldest(h);
+    pthread_mutex_unlock(&h->lock);
+}
+
+int history_get(history *h, uint64_t num, history_entry *out) {
+    int result = INVALID;
+    pthread_mutex_lock(&h->lock);
+
+    // versions are consecutive, so the entry is found by offset
+    if (h->count > 0) {
+        uint64_t oldest = h->ring[h->first].num;
+        if (num >= oldest && num - oldest < h->count) {
+            history_entry *e = &h->ring[(h->first + (num - oldest)) % h->cap];
+            out->data = malloc(e->len);
+            if (out->data) {
+                memcpy(out->data, e->data, e->len);
+                out->len = e->len;
+                out->num = e->num;
+                out->time_ns = e->time_ns;
+                result = SUCCESS;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&h->lock);
+    return result;
+}
+
+void history_range(history *h, uint64_t *oldest, uint64_t *newest) {
+    pthread_mutex_lock(&h->lock);
+    *oldest = h->count ? h->ring[h->first].num : 0;
+    *newest = h->count ? h->ring[(h->first + h->count - 1) % h->cap].num : 0;
+    pthread_mutex_unlock(&h->lock);
+}
+
+// === entries ===
+void builder_reset(history_builder *b) {
+    b->user_count = 0;
+    b->len = 0;
+    b->op_count = 0;
+    b->last_arg0 = 0;
+}
+
+void builder_free(history_builder *b) {
+    free(b->ops);
+    b->ops = NULL;
+    b->cap = 0;
+    free(b->users);
+    b->users = NULL;
+    b->user_cap = 0;
+    builder_reset(b);
+}
+
+int builder_add(history_builder *b, const char *user, const op *o, int result) {
+    // find or add the user, an entry rarely has more than a few
+    size_t index = 0;
+    while (index < b->user_count && strncmp(b->users[index], user, HISTORY_USER_MAX - 1) != 0) {
+        index++;
+    }
+    if (index == b->user_count) {
+        if (b->user_count == b->user_cap) {
+            size_t cap = b->user_cap ? b->user_cap * 2 : 8;
+            char (*bigger)[HISTORY_USER_MAX] = realloc(b->users, cap * sizeof(*bigger));
+            if (!bigger) return INVALID;
+            b->users = bigger;
+            b->user_cap = cap;
+        }
+        strncpy(b->users[index], user, HISTORY_USER_MAX - 1);
+        b->users[index][HISTORY_USER_MAX - 1] = '\0';
+        b->user_count++;
+    }
+
+    // grow the op buffer to hold the worst case
+    size_t need = b->len + 2 + 4 * 10 + o->len;
+    if (need > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < need) cap *= 2;
+        unsigned char *bigger = realloc(b->ops, cap);
+        if (!bigger) return INVALID;
+        b->ops = bigger;
+        b->cap = cap;
+    }
+
+    // positions are stored relative to each other, edits nearby cost one byte each
+    unsigned char *p = b->ops + b->len;
+    *p++ = (unsigned char)o->opcode;
+    *p++ = (unsigned char)result;
+    p += varint_encode(index, p);
+    p += varint_encode(zigzag((int64_t)(o->args[0] - b->last_arg0)), p);
+    p += varint_encode(zigzag((int64_t)(o->args[1] - o->args[0])), p);
+    p += varint_encode(o->len, p);
+    if (o->len > 0) memcpy(p, o->payload, o->len);
+    p += o->len;
+
+    b->len = p - b->ops;
+    b->last_arg0 = o->args[0];
+    b->op_count++;
+    return SUCCESS;
+}
+
+long history_decode(const unsigned char *data, size_t len, history_visit visit, void *arg) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    uint64_t user_count;
+    int n;
+
+    // every name takes at least its length byte, so the count is bounded by the entry
+    n = varint_decode(p, end - p, &user_count);
+    if (n <= 0 || user_count > (uint64_t)(end - p - n)) return INVALID;
+    p += n;
+    char (*users)[HISTORY_USER_MAX] = malloc((user_count ? user_count : 1) * sizeof(*users));
+    if (!users) return INVALID;
+    for (uint64_t i = 0; i < user_count; i++) {
+        uint64_t name_len;
+        n = varint_decode(p, end - p, &name_len);
+        if (n <= 0 || name_len >= HISTORY_USER_MAX || name_len > (uint64_t)(end - p - n)) {
+            free(users);
+            return INVALID;
+        }
+        p += n;
+        memcpy(users[i], p, name_len);
+        users[i][name_len] = '\0';
+        p += name_len;
+    }
+
+    long count = 0;
+    uint64_t last_arg0 = 0;
+    while (p < end) {
+        if (end - p < 2) {
+            count = INVALID;
+            break;
+        }
+        op o;
+        memset(&o, 0, sizeof(op));
+        o.opcode = *p++;
+        int result = *p++;
+
+        uint64_t fields[4];
+        int i = 0;
+        for (; i < 4; i++) {
+            n = varint_decode(p, end - p, &fields[i]);
+            if (n <= 0) break;
+            p += n;
+        }
+        if (i < 4 || fields[0] >= user_count || fields[3] > (uint64_t)(end - p)) {
+            count = INVALID;
+            break;
+        }
+
+        o.args[0] = last_arg0 + (uint64_t)unzigzag(fields[1]);
+        o.args[1] = o.args[0] + (uint64_t)unzigzag(fields[2]);
+        o.len = fields[3];
+        o.payload = (const char *)p;
+        p += o.len;
+        last_arg0 = o.args[0];
+
+        if (visit) visit(users[fields[0]], &o, result, arg);
+        count++;
+    }
+    free(users);
+    return count;
+}
@@ -0,0 +1,549 @@
+// loadgen: drive a running server with many simulated clients and report what it sustains
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../libs/protocol.h"
+#include "../libs/history.h"
+#include "../libs/stats.h"
+
+#define True 1
+#define False 0
+#define SUCCESS 0
+#define UNSUCCESS 1
+
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define CLIENTS 8 // default simulated clients
+#define RATE 20 // default actions per second of one client
+#define DURATION 10 // default seconds of load
+#define WRITERS 75 // default percentage of clients that connect as a writer
+#define ROLES_FILE "roles.txt"
+#define USERS_MAX 64
+#define BURST 5 // characters typed in one burst
+#define PENDING_MAX 4096 // edits of one client waiting for their broadcast
+#define PAYLOAD_KEY 16 // payload bytes an edit is matched on
+#define DRAIN_MS 3000 // how long to wait for outstanding broadcasts at the end
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_MS 1000000ULL
+
+// === actions ===
+#define ACTION_TYPE 0 // a burst of one character inserts
+#define ACTION_DELETE 1 // delete a short range
+#define ACTION_FORMAT 2 // bold, italic, code, link, heading, blockquote or a list
+#define ACTION_DOC 3 // DOC? poll
+#define ACTIONS 4
+
+static const char *action_names[ACTIONS] = {"type", "delete", "format", "doc"};
+
+/**
+ * An edit sent and not broadcast yet. The key is what the history entry gives back.
+ */
+typedef struct pending_edit {
+    int opcode;
+    uint64_t args[2];
+    size_t len;
+    char payload[PAYLOAD_KEY];
+    uint64_t sent_ns; // when it was due, so a late sender does not hide latency
+} pending_edit;
+
+typedef struct sim_client {
+    int index;
+    const char *user;
+    int writer;
+    int fd_c2s;
+    FILE *in;
+    unsigned seed;
+    pthread_t sender;
+    pthread_t listener;
+    int connected;
+
+    pthread_mutex_t lock; // guards everything below
+    pending_edit pending[PENDING_MAX]; // a ring, oldest at first
+    size_t first;
+    size_t count;
+    uint64_t queries[PENDING_MAX]; // due times of the DOC? polls not answered yet
+    size_t queries_first;
+    size_t queries_count;
+    uint64_t doc_len; // estimate, exact after every DOC? answer
+    uint64_t version;
+
+    uint64_t sent; // edits and queries
+    uint64_t broadcast; // edits seen in a broadcast
+    uint64_t rejected; // edits answered with a result code
+    uint64_t lost; // edits never seen in a broadcast
+    uint64_t versions; // versions received
+    uint64_t missed; // versions skipped
+    uint64_t resyncs;
+    uint64_t results[RESULT_UNAUTHORISED + 1];
+    histogram edit_latency; // due time to the broadcast that carried it
+    histogram query_latency; // due time to the DOC? answer
+} sim_client;
+
+// === options ===
+static int server_pid;
+static int clients_n = CLIENTS;
+static double rate = RATE;
+static double duration = DURATION;
+static int writers_percent = WRITERS;
+static const char *roles_file = ROLES_FILE;
+static int documents_n = 0; // clients are spread over documents lg0.. in turn, 0 joins the default one
+static int mix[ACTIONS] = {60, 10, 20, 10}; // writers; readers only poll
+static int mix_total = 100;
+
+static volatile int running = True;
+static histogram connect_latency;
+static uint64_t connect_failed = 0;
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns() {
+    return stats_now_ns();
+}
+
+static void sleep_until(uint64_t when) {
+    struct timespec ts = {(time_t)(when / NS_PER_SEC), (long)(when % NS_PER_SEC)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// === users ===
+/**
+ * Split roles.txt into writers and readers, in file order
+ */
+static int load_users(char users[][64], int *roles, int max) {
+    FILE *f = fopen(roles_file, "r");
+    if (!f) return 0;
+    char line[256];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        char name[64], role[16];
+        if (sscanf(line, "%63s %15s", name, role) != 2) continue;
+        strcpy(users[n], name);
+        roles[n] = strcmp(role, "write") == 0;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+/**
+ * Parse a mix like type:60,delete:10,format:20,doc:10
+ */
+static int parse_mix(char *spec) {
+    int parsed[ACTIONS] = {0};
+    char *save = NULL;
+    for (char *item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(item, ':');
+        if (!colon) return UNSUCCESS;
+        *colon = '\0';
+        int action = 0;
+        while (action < ACTIONS && strcmp(action_names[action], item) != 0) action++;
+        if (action == ACTIONS) return UNSUCCESS;
+        parsed[action] = atoi(colon + 1);
+    }
+    mix_total = 0;
+    for (int i = 0; i < ACTIONS; i++) {
+        mix[i] = parsed[i] < 0 ? 0 : parsed[i];
+        mix_total += mix[i];
+    }
+    return mix_total > 0 ? SUCCESS : UNSUCCESS;
+}
+
+// === sending ===
+/**
+ * Append one frame to buf, remember the edit and count it. Caller holds cli->lock.
+ */
+static size_t add_edit(sim_client *cli, unsigned char *buf, op *o, uint64_t due) {
+    o->version = cli->version;
+    size_t n = frame_header(o, buf);
+    if (o->len > 0) memcpy(buf + n, o->payload, o->len);
+    n += o->len;
+    cli->sent++;
+
+    if (o->opcode == OP_DOC) {
+        if (cli->queries_count < PENDING_MAX) {
+            cli->queries[(cli->queries_first + cli->queries_count++) % PENDING_MAX] = due;
+        }
+        return n;
+    }
+    if (cli->count == PENDING_MAX) { // never answered, make room
+        cli->first = (cli->first + 1) % PENDING_MAX;
+        cli->count--;
+        cli->lost++;
+    }
+    pending_edit *p = &cli->pending[(cli->first + cli->count++) % PENDING_MAX];
+    p->opcode = o->opcode;
+    p->args[0] = o->args[0];
+    p->args[1] = o->args[1];
+    p->len = o->len < PAYLOAD_KEY ? o->len : PAYLOAD_KEY;
+    memcpy(p->payload, o->payload, p->len);
+    p->sent_ns = due;
+    return n;
+}
+
+/**
+ * Build the frames of one action into buf and return their length
+ */
+static size_t build_action(sim_client *cli, int action, unsigned char *buf, uint64_t due) {
+    static const char *links[] = {"http://a.b", "http://example.org/x"};
+    pthread_mutex_lock(&cli->lock);
+    uint64_t len = cli->doc_len;
+    uint64_t pos = len ? (uint64_t)rand_r(&cli->seed) % (len + 1) : 0;
+    size_t n = 0;
+
+    if (action == ACTION_TYPE) {
+        for (int i = 0; i < BURST; i++) {
+            char c = 'a' + rand_r(&cli->seed) % 26;
+            op o = {.opcode = OP_INSERT, .args = {pos + i, 0}, .payload = &c, .len = 1};
+            n += add_edit(cli, buf + n, &o, due);
+        }
+        cli->doc_len += BURST; // until the next DOC? tells better
+    } else if (action == ACTION_DELETE) {
+        uint64_t count = 1 + rand_r(&cli->seed) % 8;
+        if (pos + count > len) pos = len > count ? len - count : 0;
+        op o = {.opcode = OP_DEL, .args = {pos, count}};
+        n += add_edit(cli, buf + n, &o, due);
+        cli->doc_len = cli->doc_len > count ? cli->doc_len - count : 0;
+    } else if (action == ACTION_FORMAT) {
+        uint64_t end = pos + 1 + rand_r(&cli->seed) % 8;
+        if (end > len) end = len;
+        op o = {.args = {pos, end}};
+        switch (rand_r(&cli->seed) % 7) {
+            case 0: o.opcode = OP_BOLD; break;
+            case 1: o.opcode = OP_ITALIC; break;
+            case 2: o.opcode = OP_CODE; break;
+            case 3:
+                o.opcode = OP_LINK;
+                o.payload = links[rand_r(&cli->seed) % 2];
+                o.len = strlen(o.payload);
+                break;
+            case 4: o.opcode = OP_HEADING; o.args[0] = 1 + rand_r(&cli->seed) % 3; o.args[1] = pos; break;
+            case 5: o.opcode = OP_BLOCKQUOTE; o.args[1] = 0; break;
+            default: o.opcode = OP_UNORDERED_LIST; o.args[1] = 0; break;
+        }
+        n += add_edit(cli, buf + n, &o, due);
+    } else {
+        op o = {.opcode = OP_DOC};
+        n += add_edit(cli, buf + n, &o, due);
+    }
+    pthread_mutex_unlock(&cli->lock);
+    return n;
+}
+
+static int pick_action(sim_client *cli) {
+    if (!cli->writer) return ACTION_DOC;
+    int r = rand_r(&cli->seed) % mix_total;
+    for (int i = 0; i < ACTIONS; i++) {
+        if (r < mix[i]) return i;
+        r -= mix[i];
+    }
+    return ACTION_DOC;
+}
+
+/**
+ * Send actions on a fixed schedule. Latency is measured from the due time, so a sender
+ * that falls behind shows up in the percentiles instead of slowing the offered load.
+ */
+static void *sender_thread(void *arg) {
+    sim_client *cli = arg;
+    uint64_t period = (uint64_t)(NS_PER_SEC / rate);
+    uint64_t due = now_ns() + (uint64_t)rand_r(&cli->seed) % period; // spread the clients
+    unsigned char buf[BURST * (FRAME_HEADER_MAX + 32)];
+
+    while (running) {
+        sleep_until(due);
+        size_t n = build_action(cli, pick_action(cli), buf, due);
+        if (write(cli->fd_c2s, buf, n) != (ssize_t)n) break;
+        due += period;
+    }
+
+    // give the last edits time to be broadcast, then leave
+    uint64_t give_up = now_ns() + DRAIN_MS * NS_PER_MS;
+    while (now_ns() < give_up) {
+        pthread_mutex_lock(&cli->lock);
+        int idle = cli->count == 0 && cli->queries_count == 0;
+        pthread_mutex_unlock(&cli->lock);
+        if (idle) break;
+        usleep(10 * 1000);
+    }
+    op bye = {.opcode = OP_DISCONNECT};
+    size_t n = frame_header(&bye, buf);
+    if (write(cli->fd_c2s, buf, n) < 0) {
+        // the server is gone, the listener sees EOF as well
+    }
+    close(cli->fd_c2s);
+    return NULL;
+}
+
+// === receiving ===
+static int same_edit(const pending_edit *p, const op *o) {
+    size_t len = o->len < PAYLOAD_KEY ? o->len : PAYLOAD_KEY;
+    return p->opcode == o->opcode && p->args[0] == o->args[0] && p->args[1] == o->args[1] &&
+           p->len == len && memcmp(p->payload, o->payload, len) == 0;
+}
+
+/**
+ * Match one op of a broadcast against our oldest pending edits. Edits of a client are
+ * applied in the order they were sent, so pending edits older than the match were left
+ * out of every broadcast: their tick changed nothing and was never committed.
+ */
+static void match_edit(const char *user, const op *o, int result, void *arg) {
+    sim_client *cli = arg;
+    (void)result;
+    if (strcmp(user, cli->user) != 0) return;
+
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < cli->count && i < 64; i++) {
+        pending_edit *p = &cli->pending[(cli->first + i) % PENDING_MAX];
+        if (!same_edit(p, o)) continue;
+        hist_record(&cli->edit_latency, now > p->sent_ns ? now - p->sent_ns : 0);
+        cli->broadcast++;
+        cli->lost += i;
+        cli->first = (cli->first + i + 1) % PENDING_MAX;
+        cli->count -= i + 1;
+        return;
+    }
+}
+
+static void *listener_thread(void *arg) {
+    sim_client *cli = arg;
+    unsigned char *buffer = NULL;
+    size_t cap = 0;
+    op o;
+
+    while (frame_read(cli->in, &buffer, &cap, &o) == SUCCESS) {
+        pthread_mutex_lock(&cli->lock);
+        if (o.opcode == OP_VERSION) {
+            if (cli->version && o.version > cli->version + 1) cli->missed += o.version - cli->version - 1;
+            cli->version = o.version;
+            cli->versions++;
+            history_decode((const unsigned char *)o.payload, o.len, match_edit, cli);
+        } else if (o.opcode == OP_DOC) {
+            cli->doc_len = o.len;
+            if (cli->queries_count > 0) {
+                uint64_t due = cli->queries[cli->queries_first];
+                cli->queries_first = (cli->queries_first + 1) % PENDING_MAX;
+                cli->queries_count--;
+                uint64_t now = now_ns();
+                hist_record(&cli->query_latency, now > due ? now - due : 0);
+            }
+        } else if (o.opcode == OP_RESULT) {
+            cli->rejected++;
+            if (o.args[0] <= RESULT_UNAUTHORISED) cli->results[o.args[0]]++;
+        } else if (o.opcode == OP_RESYNC) {
+            cli->resyncs++;
+            cli->doc_len = o.len;
+            cli->version = o.version;
+        }
+        pthread_mutex_unlock(&cli->lock);
+    }
+    free(buffer);
+    fclose(cli->in);
+    return NULL;
+}
+
+// === connecting ===
+/**
+ * Connect with binary framing and read the handshake. Return SUCCESS with the listener
+ * ready to start, or UNSUCCESS.
+ */
+static int connect_client(sim_client *cli) {
+    char channel[CHANNEL_MAX];
+    snprintf(channel, sizeof(channel), "lg%d_%d", getpid(), cli->index);
+
+    char document[CHANNEL_MAX];
+    snprintf(document, sizeof(document), "lg%d", documents_n > 0 ? cli->index % documents_n : 0);
+
+    uint64_t started = now_ns();
+    int fd_s2c;
+    if (channel_connect(server_pid, channel, cli->user, documents_n > 0 ? document : NULL, True, 0,
+                        HANDSHAKE_TIMEOUT_MS, &cli->fd_c2s, &fd_s2c) != SUCCESS) {
+        return UNSUCCESS;
+    }
+    cli->in = fdopen(fd_s2c, "r");
+    if (!cli->in) {
+        close(fd_s2c);
+        close(cli->fd_c2s);
+        return UNSUCCESS;
+    }
+
+    // role line, version, length, content and a newline, then frames
+    char line[256];
+    if (!fgets(line, sizeof(line), cli->in) || strncmp(line, "Reject", 6) == 0 ||
+        !strstr(line, PROTOCOL_BINARY)) {
+        fclose(cli->in);
+        close(cli->fd_c2s);
+        return UNSUCCESS;
+    }
+    cli->writer = strncmp(line, "write", 5) == 0;
+    if (!fgets(line, sizeof(line), cli->in)) goto fail;
+    cli->version = strtoull(line, NULL, 10);
+    if (!fgets(line, sizeof(line), cli->in)) goto fail;
+    cli->doc_len = strtoull(line, NULL, 10);
+    for (uint64_t i = 0; i <= cli->doc_len; i++) {
+        if (fgetc(cli->in) == EOF) goto fail;
+    }
+
+    pthread_mutex_lock(&connect_lock);
+    hist_record(&connect_latency, now_ns() - started);
+    pthread_mutex_unlock(&connect_lock);
+    return SUCCESS;
+
+fail:
+    fclose(cli->in);
+    close(cli->fd_c2s);
+    return UNSUCCESS;
+}
+
+// === report ===
+static void report(sim_client *sims, double elapsed) {
+    histogram *edits = calloc(1, sizeof(histogram));
+    histogram *queries = calloc(1, sizeof(histogram));
+    if (!edits || !queries) return;
+    uint64_t sent = 0, broadcast = 0, rejected = 0, lost = 0, versions = 0, missed = 0, resyncs = 0;
+    uint64_t results[RESULT_UNAUTHORISED + 1] = {0};
+    int writers = 0, connected = 0;
+
+    for (int i = 0; i < clients_n; i++) {
+        sim_client *cli = &sims[i];
+        if (!cli->connected) continue;
+        connected++;
+        writers += cli->writer;
+        hist_merge(edits, &cli->edit_latency);
+        hist_merge(queries, &cli->query_latency);
+        sent += cli->sent;
+        broadcast += cli->broadcast;
+        rejected += cli->rejected;
+        lost += cli->lost + cli->count; // still pending at the end
+        versions += cli->versions;
+        missed += cli->missed;
+        resyncs += cli->resyncs;
+        for (int r = 0; r <= RESULT_UNAUTHORISED; r++) results[r] += cli->results[r];
+    }
+
+    printf("clients %d connected (%d writers, %d readers), %lu failed to connect\n", connected, writers,
+           connected - writers, connect_failed);
+    printf("ran %.1fs: sent %lu (%.0f/s), broadcast %lu (%.0f/s)\n", elapsed, sent, sent / elapsed, broadcast,
+           broadcast / elapsed);
+    printf("rejected %lu (%.2f%%):", rejected, sent ? 100.0 * rejected / sent : 0);
+    for (int r = 1; r <= RESULT_UNAUTHORISED; r++) {
+        if (results[r]) printf(" %s %lu", result_name(r), results[r]);
+    }
+    printf("\nlost %lu (never broadcast), versions %lu received, %lu missed, %lu resyncs\n", lost, versions, missed,
+           resyncs);
+    hist_print_header(stdout, "us");
+    hist_print(stdout, "connect", &connect_latency, 1000);
+    hist_print(stdout, "edit_to_broadcast", edits, 1000);
+    hist_print(stdout, "doc_query", queries, 1000);
+    free(edits);
+    free(queries);
+}
+
+static void handle_stop(int sig) {
+    (void)sig;
+    running = False;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:d:w:m:f:D:")) != -1) {
+        if (opt == 'D') {
+            documents_n = atoi(optarg);
+        } else if (opt == 'n') {
+            clients_n = atoi(optarg);
+        } else if (opt == 'r') {
+            rate = atof(optarg);
+        } else if (opt == 'd') {
+            duration = atof(optarg);
+        } else if (opt == 'w') {
+            writers_percent = atoi(optarg);
+        } else if (opt == 'm') {
+            if (parse_mix(optarg) != SUCCESS) optind = argc + 1;
+        } else if (opt == 'f') {
+            roles_file = optarg;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || clients_n <= 0 || rate <= 0 || duration <= 0) {
+        fprintf(stderr, "Usage: %s [-n clients] [-r actions_per_s] [-d seconds] [-w writers_percent]"
+                        " [-m type:60,delete:10,format:20,doc:10] [-f roles_file] [-D documents] <server_pid>\n",
+                argv[0]);
+        return UNSUCCESS;
+    }
+    server_pid = atoi(argv[optind]);
+
+    char users[USERS_MAX][64];
+    int roles[USERS_MAX];
+    int users_n = load_users(users, roles, USERS_MAX);
+    int writer_users[USERS_MAX], reader_users[USERS_MAX];
+    int writers_n = 0, readers_n = 0;
+    for (int i = 0; i < users_n; i++) {
+        if (roles[i]) {
+            writer_users[writers_n++] = i;
+        } else {
+            reader_users[readers_n++] = i;
+        }
+    }
+    if (users_n == 0) {
+        fprintf(stderr, "no users in %s\n", roles_file);
+        return UNSUCCESS;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_stop);
+
+    sim_client *sims = calloc(clients_n, sizeof(sim_client));
+    if (!sims) return UNSUCCESS;
+
+    // the first writers_percent of the clients take writer users in turn, the rest reader users
+    int writers_wanted = (clients_n * writers_percent + 50) / 100;
+    for (int i = 0; i < clients_n; i++) {
+        sim_client *cli = &sims[i];
+        cli->index = i;
+        cli->seed = (unsigned)(getpid() * 7919 + i);
+        pthread_mutex_init(&cli->lock, NULL);
+        if ((i < writers_wanted && writers_n > 0) || readers_n == 0) {
+            cli->user = users[writer_users[i % writers_n]];
+        } else {
+            cli->user = users[reader_users[(i - writers_wanted) % readers_n]];
+        }
+    }
+
+    // connect everyone first, so the load starts at once
+    uint64_t started = now_ns();
+    for (int i = 0; i < clients_n; i++) {
+        sims[i].connected = connect_client(&sims[i]) == SUCCESS;
+        if (!sims[i].connected) connect_failed++;
+    }
+    double connect_s = (double)(now_ns() - started) / NS_PER_SEC;
+    printf("connected %d clients in %.3fs (%.0f/s)\n", clients_n - (int)connect_failed, connect_s,
+           (clients_n - connect_failed) / (connect_s > 0 ? connect_s : 1));
+
+    started = now_ns();
+    for (int i = 0; i < clients_n; i++) {
+        if (!sims[i].connected) continue;
+        pthread_create(&sims[i].listener, NULL, listener_thread, &sims[i]);
+        pthread_create(&sims[i].sender, NULL, sender_thread, &sims[i]);
+    }
+
+    uint64_t stop = started + (uint64_t)(duration * NS_PER_SEC);
+    while (running && now_ns() < stop) usleep(10 * 1000);
+    running = False;
+    double elapsed = (double)(now_ns() - started) / NS_PER_SEC;
+
+    for (int i = 0; i < clients_n; i++) {
+        if (!sims[i].connected) continue;
+        pthread_join(sims[i].sender, NULL);
+        pthread_join(sims[i].listener, NULL);
+    }
+
+    report(sims, elapsed);
+    free(sims);
+    return SUCCESS;
+}
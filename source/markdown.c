@@ -1,4 +1,5 @@
 #include "../libs/markdown.h"
+#include "../libs/merkle.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -18,6 +19,8 @@
 #define DELETED_POSITION -2
 #define OUTDATED_VERSION -3
 
+void markdown_update_current_version(document* doc);
+
 // === My own function ===
 chunk* find_chunk_at(document *doc, size_t global_pos, size_t *local_pos) {
     // cur refers to current chunk
@@ -88,9 +91,8 @@ chunk* split_chunk(chunk *c, size_t pos) {
         new_chunk->type = NORMAL_TEXT;
     }
 
-    if (c->ready_to_delete == True){
-        new_chunk->ready_to_delete = True;
-    }
+    // the right part keeps the deletion mark of the left part
+    new_chunk->ready_to_delete = c->ready_to_delete;
     
     // realloc the left part. pos is the length of left part
     c->text = realloc(c->text, pos + 1);
@@ -142,6 +144,12 @@ document *markdown_init(void) {
     doc->head = NULL;
     doc->version = 0;
     doc->is_modify = NOT_MODIFIED;
+    doc->hashes = malloc(sizeof(merkle));
+    if (!doc->hashes) {
+        free(doc);
+        return NULL;
+    }
+    merkle_init(doc->hashes);
     
     // init a dynamic empty string
     doc->current_version = malloc(1);
@@ -155,8 +163,10 @@ document *markdown_init(void) {
 void markdown_free(document *doc) {
     if (!doc) return;
 
-    // free the current_text
+    // free the current_text and its hash tree
     free(doc->current_version);
+    merkle_free(doc->hashes);
+    free(doc->hashes);
     
     // free each chunk
     chunk *curr = doc->head;
@@ -170,16 +180,176 @@ void markdown_free(document *doc) {
     free(doc); // free the doc itself
 }
 
+/**
+ * The letter of a chunk type in a layout, 0 for plain text
+ */
+static char layout_letter(int type) {
+    if (type == NEWLINE) return 'n';
+    if (type == ORDERED_LIST) return 'o';
+    if (type == UNORDERED_LIST) return 'u';
+    return 0;
+}
+
+/**
+ * Read the decimal number at *p and move past it. Return False if there is none.
+ */
+static int layout_number(const char **p, size_t *value) {
+    if (**p < '0' || **p > '9') return False;
+    *value = 0;
+    while (**p >= '0' && **p <= '9') *value = *value * 10 + (size_t)(*(*p)++ - '0');
+    return True;
+}
+
+/**
+ * Append a chunk of the given type to the list that ends at *tail
+ */
+static int load_chunk(document *doc, chunk **tail, const char *text, size_t len, int type) {
+    chunk *c = create_chunk(text, len);
+    if (!c) return False;
+    c->type = type;
+    if (*tail) {
+        (*tail)->next = c;
+    } else {
+        doc->head = c;
+    }
+    *tail = c;
+    return True;
+}
+
+/**
+ * Make the chunks just loaded into doc its committed version
+ */
+static void load_commit(document *doc, uint64_t version) {
+    if (doc->head) {
+        free(doc->current_version);
+        markdown_update_current_version(doc);
+    }
+    if (doc->current_version) merkle_build(doc->hashes, doc->current_version, strlen(doc->current_version));
+    doc->version = version;
+}
+
+/**
+ * The text alone does not say how it was edited ("- " may be a list or typed text), so
+ * the chunks that are not plain text come from the layout, and the plain text between
+ * them is one chunk each. Commands then work on the copy as they did on the original.
+ */
+document *markdown_load(const char *text, size_t len, const char *layout, uint64_t version) {
+    document *doc = markdown_init();
+    if (!doc) return NULL;
+
+    chunk *tail = NULL;
+    size_t pos = 0;
+    int fits = True;
+    const char *p = layout ? layout : "";
+    while (*p && fits) {
+        size_t plain, length;
+        int type = NORMAL_TEXT;
+        fits = layout_number(&p, &plain);
+        if (fits && *p == layout_letter(NEWLINE)) type = NEWLINE;
+        if (fits && *p == layout_letter(ORDERED_LIST)) type = ORDERED_LIST;
+        if (fits && *p == layout_letter(UNORDERED_LIST)) type = UNORDERED_LIST;
+        if (type == NORMAL_TEXT) {
+            fits = False;
+            break;
+        }
+        p++;
+        fits = layout_number(&p, &length) && length > 0 && plain <= len - pos && length <= len - pos - plain &&
+               (*p == '\0' || *p++ == ' ');
+        if (!fits) break;
+
+        fits = (plain == 0 || load_chunk(doc, &tail, text + pos, plain, NORMAL_TEXT)) &&
+               load_chunk(doc, &tail, text + pos + plain, length, type);
+        pos += plain + length;
+    }
+    if (!fits || *p || (pos < len && !load_chunk(doc, &tail, text + pos, len - pos, NORMAL_TEXT))) {
+        markdown_free(doc); // out of memory, or a layout that does not fit the text
+        return NULL;
+    }
+    load_commit(doc, version);
+    return doc;
+}
+
+document *markdown_splice(const document *doc, size_t start, size_t end, const char *content, size_t len,
+                          uint64_t version) {
+    document *copy = markdown_init();
+    if (!copy) return NULL;
+
+    chunk *tail = NULL;
+    size_t pos = 0;
+    int fits = True;
+    int spliced = False;
+    for (const chunk *cur = doc->head; cur && fits; cur = cur->next) {
+        if (cur->ready_to_delete || cur->length == 0) continue;
+        size_t from = pos;
+        size_t to = pos + cur->length;
+        pos = to;
+
+        // a chunk the span cuts keeps the parts outside it as plain text
+        if (from < start) {
+            size_t kept = (to < start ? to : start) - from;
+            fits = load_chunk(copy, &tail, cur->text, kept, to <= start ? cur->type : NORMAL_TEXT);
+        }
+        if (fits && !spliced && to > start) {
+            fits = len == 0 || load_chunk(copy, &tail, content, len, NORMAL_TEXT);
+            spliced = True;
+        }
+        if (fits && to > end) {
+            size_t skip = from < end ? end - from : 0;
+            fits = load_chunk(copy, &tail, cur->text + skip, cur->length - skip, from >= end ? cur->type : NORMAL_TEXT);
+        }
+    }
+    if (!fits || (!spliced && len > 0 && !load_chunk(copy, &tail, content, len, NORMAL_TEXT))) {
+        markdown_free(copy);
+        return NULL;
+    }
+    load_commit(copy, version);
+    return copy;
+}
+
+char *markdown_layout(const document *doc) {
+    size_t cap = 64;
+    size_t len = 0;
+    char *layout = malloc(cap);
+    if (!layout) return NULL;
+    layout[0] = '\0';
+
+    size_t plain = 0; // plain text since the last chunk of another type
+    for (chunk *cur = doc ? doc->head : NULL; cur; cur = cur->next) {
+        char letter = layout_letter(cur->type);
+        if (!letter || cur->length == 0) {
+            plain += cur->length;
+            continue;
+        }
+        if (len + 48 > cap) {
+            cap *= 2;
+            char *bigger = realloc(layout, cap);
+            if (!bigger) {
+                free(layout);
+                return NULL;
+            }
+            layout = bigger;
+        }
+        len += sprintf(layout + len, "%s%zu%c%zu", len ? " " : "", plain, letter, cur->length);
+        plain = 0;
+    }
+    return layout;
+}
+
 // === Edit Commands ===
 int markdown_insert(document *doc, uint64_t version, size_t pos, const char *content) {
     if (!doc || !content) return INVALID_POS;
+    return markdown_insert_len(doc, version, pos, content, strlen(content));
+}
+
+int markdown_insert_len(document *doc, uint64_t version, size_t pos, const char *content, size_t len) {
+    if (!doc || !content) return INVALID_POS;
 
     // use my function to find chunk and its local position
     size_t local_pos = 0;
     chunk *target = find_chunk_at(doc, pos, &local_pos);
 
     // create a new chunk
-    chunk *new_chunk = create_chunk(content, strlen(content));
+    chunk *new_chunk = create_chunk(content, len);
 
     // if file is empty
     if (doc->head == NULL) {
@@ -517,7 +687,7 @@ char *markdown_flatten(const document *doc) {
 }
 
 void markdown_update_current_version(document* doc){
-    if (!doc || !doc->head) return;
+    if (!doc) return;
 
     // calculate the total len
     size_t total_len = 0;
@@ -529,6 +699,7 @@ void markdown_update_current_version(document* doc){
 
     // malloc memory. but I am not sure if the test function is going to free it?
     char *result = malloc(total_len + 1);
+    doc->current_version = result;
     if (!result) return;
 
     // write all chunk into malloc memory
@@ -542,8 +713,6 @@ void markdown_update_current_version(document* doc){
 
     // add a end mark to make it a string
     result[total_len] = '\0';
-
-    doc->current_version = result;
 }
 
 // === Versioning ===
@@ -574,9 +743,15 @@ void markdown_increment_version(document *doc) {
         cur = next;
     }
 
-    // update the version char
-    free(doc->current_version);
+    // update the version char, the hash tree only looks again at what changed
+    char *old = doc->current_version;
     markdown_update_current_version(doc);
+    if (old && doc->current_version) {
+        merkle_update(doc->hashes, old, strlen(old), doc->current_version, strlen(doc->current_version));
+    } else if (doc->current_version) {
+        merkle_build(doc->hashes, doc->current_version, strlen(doc->current_version));
+    }
+    free(old);
 
     // increment verison and reset the MODIFIED
     doc->version++;
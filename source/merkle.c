@@ -0,0 +1,200 @@
+#include "../libs/merkle.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCESS 0
+#define INVALID -1
+#define True 1
+#define False 0
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/**
+ * The random value the rolling hash adds for a byte (a splitmix64 step), so that every
+ * bit of a byte reaches the top bits the boundary test looks at
+ */
+static inline uint64_t gear(unsigned char byte) {
+    uint64_t z = (byte + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Where the block starting at start ends. The rolling hash starts over at every block, so
+ * a boundary only depends on the bytes of its own block.
+ */
+static size_t block_end(const char *text, size_t start, size_t len) {
+    uint64_t h = 0;
+    size_t end = start;
+    while (end < len) {
+        h = (h << 1) + gear((unsigned char)text[end]);
+        end++;
+        size_t n = end - start;
+        if (n >= MERKLE_BLOCK_MAX) break;
+        if (n >= MERKLE_BLOCK_MIN && (h & MERKLE_BLOCK_MASK) == 0) break;
+    }
+    return end;
+}
+
+uint64_t merkle_hash(const char *data, size_t len) {
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * The hash of two subtrees. An empty right side passes the left one up, so the root does
+ * not depend on how many leaf slots are spare.
+ */
+static uint64_t combine(uint64_t left, uint64_t right) {
+    if (right == 0) return left;
+    uint64_t pair[2] = {left, right};
+    return merkle_hash((const char *)pair, sizeof(pair));
+}
+
+void merkle_init(merkle *m) {
+    memset(m, 0, sizeof(merkle));
+}
+
+void merkle_free(merkle *m) {
+    free(m->blocks);
+    free(m->nodes);
+    memset(m, 0, sizeof(merkle));
+}
+
+/**
+ * Lay the tree out again over the current blocks
+ */
+static int rebuild_nodes(merkle *m) {
+    size_t width = 1;
+    while (width < m->count) width *= 2;
+    if (width != m->width) {
+        uint64_t *nodes = realloc(m->nodes, 2 * width * sizeof(uint64_t));
+        if (!nodes) return INVALID;
+        m->nodes = nodes;
+        m->width = width;
+    }
+    memset(m->nodes, 0, 2 * width * sizeof(uint64_t));
+    for (size_t i = 0; i < m->count; i++) m->nodes[width + i] = m->blocks[i].hash;
+    for (size_t i = width - 1; i >= 1; i--) m->nodes[i] = combine(m->nodes[2 * i], m->nodes[2 * i + 1]);
+    return SUCCESS;
+}
+
+/**
+ * A leaf changed, update the nodes on its path to the root
+ */
+static void update_path(merkle *m, size_t index) {
+    size_t i = m->width + index;
+    m->nodes[i] = m->blocks[index].hash;
+    for (i /= 2; i >= 1; i /= 2) m->nodes[i] = combine(m->nodes[2 * i], m->nodes[2 * i + 1]);
+}
+
+static int reserve_blocks(merkle *m, size_t count) {
+    if (count <= m->cap) return SUCCESS;
+    size_t cap = m->cap ? m->cap : 16;
+    while (cap < count) cap *= 2;
+    merkle_block *blocks = realloc(m->blocks, cap * sizeof(merkle_block));
+    if (!blocks) return INVALID;
+    m->blocks = blocks;
+    m->cap = cap;
+    return SUCCESS;
+}
+
+int merkle_build(merkle *m, const char *text, size_t len) {
+    m->count = 0;
+    for (size_t pos = 0; pos < len;) {
+        size_t end = block_end(text, pos, len);
+        if (reserve_blocks(m, m->count + 1) != SUCCESS) {
+            merkle_free(m);
+            return INVALID;
+        }
+        m->blocks[m->count++] = (merkle_block){pos, end - pos, merkle_hash(text + pos, end - pos)};
+        pos = end;
+    }
+    if (rebuild_nodes(m) != SUCCESS) {
+        merkle_free(m);
+        return INVALID;
+    }
+    return SUCCESS;
+}
+
+int merkle_update(merkle *m, const char *old, size_t old_len, const char *text, size_t len) {
+    if (m->count == 0 || !m->nodes) return merkle_build(m, text, len);
+
+    // what changed lies between the common prefix and the common suffix
+    size_t shorter = old_len < len ? old_len : len;
+    size_t prefix = 0;
+    while (prefix < shorter && old[prefix] == text[prefix]) prefix++;
+    if (prefix == shorter && old_len == len) return SUCCESS;
+    size_t suffix = 0;
+    while (suffix < shorter - prefix && old[old_len - 1 - suffix] == text[len - 1 - suffix]) suffix++;
+
+    // blocks that end inside the prefix keep their boundary; the last block ends with the
+    // text and not at a boundary, so it is cut again when the text grew after it
+    size_t lo = 0, hi = m->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (m->blocks[mid].pos + m->blocks[mid].len > prefix) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    size_t first = lo < m->count ? lo : m->count - 1;
+
+    // cut the new text until a boundary lands on an old block start inside the suffix,
+    // from there on the old blocks are the same bytes
+    long long delta = (long long)len - (long long)old_len;
+    size_t suffix_start = len - suffix;
+    size_t next_old = first; // first old block that may start the reused tail
+    size_t fresh_cap = 16, fresh_count = 0;
+    merkle_block *fresh = malloc(fresh_cap * sizeof(merkle_block));
+    if (!fresh) return merkle_build(m, text, len);
+    int resynced = False;
+    for (size_t pos = m->blocks[first].pos; pos < len && !resynced;) {
+        size_t end = block_end(text, pos, len);
+        if (fresh_count == fresh_cap) {
+            fresh_cap *= 2;
+            merkle_block *bigger = realloc(fresh, fresh_cap * sizeof(merkle_block));
+            if (!bigger) {
+                free(fresh);
+                return merkle_build(m, text, len);
+            }
+            fresh = bigger;
+        }
+        fresh[fresh_count++] = (merkle_block){pos, end - pos, merkle_hash(text + pos, end - pos)};
+        pos = end;
+
+        if (end >= suffix_start && end < len) {
+            size_t old_pos = (size_t)((long long)end - delta);
+            while (next_old < m->count && m->blocks[next_old].pos < old_pos) next_old++;
+            resynced = next_old < m->count && m->blocks[next_old].pos == old_pos;
+        }
+    }
+    size_t tail = resynced ? m->count - next_old : 0;
+
+    // splice: the prefix blocks, the fresh ones, then the tail moved by delta
+    size_t count = first + fresh_count + tail;
+    if (reserve_blocks(m, count) != SUCCESS) {
+        free(fresh);
+        return merkle_build(m, text, len);
+    }
+    memmove(m->blocks + first + fresh_count, m->blocks + next_old, tail * sizeof(merkle_block));
+    memcpy(m->blocks + first, fresh, fresh_count * sizeof(merkle_block));
+    free(fresh);
+    for (size_t i = first + fresh_count; i < count; i++) m->blocks[i].pos = (size_t)((long long)m->blocks[i].pos + delta);
+
+    // the same number of leaves only changes the paths of the fresh ones
+    int same_shape = count == m->count;
+    m->count = count;
+    if (!same_shape) return rebuild_nodes(m) == SUCCESS ? SUCCESS : merkle_build(m, text, len);
+    for (size_t i = first; i < first + fresh_count; i++) update_path(m, i);
+    return SUCCESS;
+}
+
+uint64_t merkle_root(const merkle *m) {
+    return m->nodes && m->count > 0 ? m->nodes[1] : 0;
+}
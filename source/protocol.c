@@ -0,0 +1,367 @@
+#include "../libs/protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define True 1
+#define SUCCESS 0
+#define INVALID -1
+#define FIFO_NAME_LEN 48
+#define PAYLOAD_NONE 0
+#define PAYLOAD_REST 1 // rest of the line, e.g. INSERT content
+#define PAYLOAD_WORD 2 // one word, e.g. LINK url
+
+/**
+ * How a text command looks: its keyword, numeric arguments and payload
+ */
+typedef struct op_spec {
+    const char *name;
+    int opcode;
+    int nargs;
+    int payload;
+} op_spec;
+
+/**
+ * Perfect hash of the keywords: (first char + 5 * (length + last char)) % SPEC_SLOTS puts
+ * every keyword in its own slot, so a lookup is one hash and one compare. Adding a keyword
+ * means checking that its slot is still free, and picking other weights when it is not.
+ */
+#define SPEC_SLOTS 64
+#define SPEC_HASH(word, len) (((unsigned char)(word)[0] + 5 * ((len) + (unsigned char)(word)[(len) - 1])) % SPEC_SLOTS)
+
+static const op_spec specs[SPEC_SLOTS] = {
+    [2] = {"PASTE", OP_PASTE, 2, PAYLOAD_NONE},
+    [10] = {"NEWLINE", OP_NEWLINE, 1, PAYLOAD_NONE},
+    [11] = {"INSERT", OP_INSERT, 1, PAYLOAD_REST},
+    [13] = {"BLOCKQUOTE", OP_BLOCKQUOTE, 1, PAYLOAD_NONE},
+    [14] = {"HEADING", OP_HEADING, 2, PAYLOAD_NONE},
+    [15] = {"DEL", OP_DEL, 2, PAYLOAD_NONE},
+    [19] = {"DOC?", OP_DOC, 0, PAYLOAD_NONE},
+    [23] = {"LINK", OP_LINK, 2, PAYLOAD_WORD},
+    [26] = {"DISCONNECT", OP_DISCONNECT, 0, PAYLOAD_NONE},
+    [28] = {"HASH?", OP_HASH, 0, PAYLOAD_NONE},
+    [29] = {"DATA", OP_DATA, 0, PAYLOAD_REST},
+    [30] = {"READLINES", OP_READLINES, 2, PAYLOAD_NONE},
+    [32] = {"BLOCKS?", OP_BLOCKS, 2, PAYLOAD_NONE},
+    [36] = {"PERM?", OP_PERM, 0, PAYLOAD_NONE},
+    [42] = {"BOLD", OP_BOLD, 2, PAYLOAD_NONE},
+    [43] = {"RANGE?", OP_RANGE, 2, PAYLOAD_NONE},
+    [44] = {"HORIZONTAL_RULE", OP_HORIZONTAL_RULE, 1, PAYLOAD_NONE},
+    [47] = {"ORDERED_LIST", OP_ORDERED_LIST, 1, PAYLOAD_NONE},
+    [48] = {"CODE", OP_CODE, 2, PAYLOAD_NONE},
+    [54] = {"ITALIC", OP_ITALIC, 2, PAYLOAD_NONE},
+    [58] = {"READ", OP_READ, 2, PAYLOAD_NONE},
+    [63] = {"UNORDERED_LIST", OP_UNORDERED_LIST, 1, PAYLOAD_NONE},
+};
+
+
+// === varints ===
+size_t varint_encode(uint64_t value, unsigned char *out) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+int varint_decode(const unsigned char *in, size_t avail, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < 10; i++) {
+        if (i >= avail) return 0; // need more bytes
+        result |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return (int)i + 1;
+        }
+    }
+    return INVALID;
+}
+
+// === frames ===
+size_t frame_header(const op *o, unsigned char *out) {
+    // encode the body header first, the body length goes in front of it
+    unsigned char body[FRAME_HEADER_MAX];
+    size_t n = 0;
+    body[n++] = (unsigned char)o->opcode;
+    n += varint_encode(o->version, body + n);
+    n += varint_encode(o->args[0], body + n);
+    n += varint_encode(o->args[1], body + n);
+    n += varint_encode(o->len, body + n);
+
+    size_t head = varint_encode(n + o->len, out);
+    memcpy(out + head, body, n);
+    return head + n;
+}
+
+long frame_decode(const unsigned char *in, size_t avail, op *o) {
+    uint64_t body_len;
+    int head = varint_decode(in, avail, &body_len);
+    if (head <= 0) return head;
+    if (body_len > FRAME_MAX || body_len == 0) return INVALID;
+    if (avail - head < body_len) return 0; // incomplete
+
+    const unsigned char *p = in + head;
+    const unsigned char *end = p + body_len;
+    uint64_t fields[4];
+
+    o->opcode = *p++;
+    for (int i = 0; i < 4; i++) {
+        int n = varint_decode(p, end - p, &fields[i]);
+        if (n <= 0) return INVALID;
+        p += n;
+    }
+    if (fields[3] != (uint64_t)(end - p)) return INVALID; // payload must fill the body
+
+    o->version = fields[0];
+    o->args[0] = fields[1];
+    o->args[1] = fields[2];
+    o->len = fields[3];
+    o->payload = (const char *)p;
+    return head + (long)body_len;
+}
+
+int frame_read(FILE *in, unsigned char **buffer, size_t *cap, op *o) {
+    // the body length comes first, read it byte by byte
+    unsigned char head[10];
+    uint64_t body_len = 0;
+    int head_len = 0;
+    while (True) {
+        int c = fgetc(in);
+        if (c == EOF || head_len == (int)sizeof(head)) return INVALID;
+        head[head_len++] = (unsigned char)c;
+        if ((c & 0x80) == 0) break;
+    }
+    if (varint_decode(head, head_len, &body_len) <= 0 || body_len > FRAME_MAX) return INVALID;
+
+    // grow the buffer to hold the whole frame
+    size_t total = head_len + body_len;
+    if (*cap < total) {
+        unsigned char *bigger = realloc(*buffer, total);
+        if (!bigger) return INVALID;
+        *buffer = bigger;
+        *cap = total;
+    }
+    memcpy(*buffer, head, head_len);
+    if (fread(*buffer + head_len, 1, body_len, in) != body_len) return INVALID;
+
+    return frame_decode(*buffer, total, o) > 0 ? SUCCESS : INVALID;
+}
+
+unsigned char *frame_build(const op *o, size_t *len) {
+    unsigned char *frame = malloc(FRAME_HEADER_MAX + o->len);
+    if (!frame) return NULL;
+    size_t head = frame_header(o, frame);
+    if (o->len > 0) memcpy(frame + head, o->payload, o->len);
+    *len = head + o->len;
+    return frame;
+}
+
+// === text form ===
+/**
+ * Read one unsigned number after optional spaces, the same input sscanf("%lu") takes
+ */
+static int parse_number(const char **cursor, uint64_t *value) {
+    const char *start = *cursor;
+    char *end;
+    *value = strtoull(start, &end, 10);
+    if (end == start) return INVALID;
+    *cursor = end;
+    return SUCCESS;
+}
+
+int op_parse_text(const char *line, op *o) {
+    memset(o, 0, sizeof(op));
+
+    // the keyword must match exactly, so DEL and DELX are different commands
+    size_t word = strcspn(line, " ");
+    if (word == 0) return PARSE_UNKNOWN;
+    const op_spec *spec = &specs[SPEC_HASH(line, word)];
+    if (!spec->name || strlen(spec->name) != word || memcmp(spec->name, line, word) != 0) {
+        return PARSE_UNKNOWN;
+    }
+
+    o->opcode = spec->opcode;
+
+    const char *cursor = line + word;
+    for (int i = 0; i < spec->nargs; i++) {
+        if (parse_number(&cursor, &o->args[i]) != SUCCESS) return PARSE_BAD_ARGS;
+    }
+
+    if (spec->payload != PAYLOAD_NONE) {
+        while (*cursor == ' ') cursor++;
+        size_t len = spec->payload == PAYLOAD_WORD ? strcspn(cursor, " ") : strlen(cursor);
+        if (len == 0) return PARSE_BAD_ARGS;
+        o->payload = cursor;
+        o->len = len;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Find the spec of an opcode, NULL if it has no text form
+ */
+static const op_spec *spec_of(int opcode) {
+    for (size_t i = 0; i < SPEC_SLOTS; i++) {
+        if (specs[i].name && specs[i].opcode == opcode) return &specs[i];
+    }
+    return NULL;
+}
+
+size_t op_format(const op *o, char *out, size_t cap) {
+    const op_spec *spec = spec_of(o->opcode);
+    char head[80];
+    int head_len;
+    if (!spec) {
+        head_len = snprintf(head, sizeof(head), "UNKNOWN");
+    } else if (spec->nargs == 2) {
+        head_len = snprintf(head, sizeof(head), "%s %lu %lu", spec->name, o->args[0], o->args[1]);
+    } else if (spec->nargs == 1) {
+        head_len = snprintf(head, sizeof(head), "%s %lu", spec->name, o->args[0]);
+    } else {
+        head_len = snprintf(head, sizeof(head), "%s", spec->name);
+    }
+
+    // copy as much as fits, but always count the full length
+    size_t n = 0;
+    for (int i = 0; i < head_len; i++, n++) {
+        if (n < cap) out[n] = head[i];
+    }
+    if (spec && spec->payload != PAYLOAD_NONE) {
+        if (n < cap) out[n] = ' ';
+        n++;
+        for (size_t i = 0; i < o->len; i++) {
+            char c = o->payload[i];
+            if (c == '\\' || c == '\n') {
+                if (n < cap) out[n] = '\\';
+                n++;
+                c = c == '\n' ? 'n' : c;
+            }
+            if (n < cap) out[n] = c;
+            n++;
+        }
+    }
+    if (cap > 0) out[n < cap ? n : cap - 1] = '\0';
+    return n;
+}
+
+size_t op_unescape(char *text, size_t len) {
+    size_t w = 0;
+    for (size_t r = 0; r < len; r++) {
+        if (text[r] == '\\' && r + 1 < len) {
+            r++;
+            text[w++] = text[r] == 'n' ? '\n' : text[r];
+        } else {
+            text[w++] = text[r];
+        }
+    }
+    return w;
+}
+
+const char *op_name(int opcode) {
+    const op_spec *spec = spec_of(opcode);
+    return spec ? spec->name : "UNKNOWN";
+}
+
+const char *result_name(int code) {
+    switch (code) {
+        case RESULT_SUCCESS: return "SUCCESS";
+        case RESULT_INVALID_POSITION: return "INVALID_POSITION";
+        case RESULT_DELETED_POSITION: return "DELETED_POSITION";
+        case RESULT_OUTDATED_VERSION: return "OUTDATED_VERSION";
+        case RESULT_UNAUTHORISED: return "UNAUTHORISED";
+        default: return "UNKNOWN";
+    }
+}
+
+// === connecting, client side ===
+/**
+ * Create the channel FIFOs and open our ends without waiting for the server. The read end
+ * of S2C opens at once when non-blocking; the write end of C2S needs a reader, so a
+ * short lived one is opened and closed again once the write end is held.
+ */
+static int open_channel(const char *fifo_c2s, const char *fifo_s2c, int *fd_c2s, int *fd_s2c) {
+    unlink(fifo_c2s);
+    unlink(fifo_s2c);
+    if (mkfifo(fifo_c2s, 0666) != 0 || mkfifo(fifo_s2c, 0666) != 0) return INVALID;
+
+    *fd_s2c = open(fifo_s2c, O_RDONLY | O_NONBLOCK);
+    int reader = open(fifo_c2s, O_RDONLY | O_NONBLOCK);
+    *fd_c2s = open(fifo_c2s, O_WRONLY | O_NONBLOCK);
+    if (reader >= 0) close(reader);
+    if (*fd_s2c < 0 || *fd_c2s < 0) return INVALID;
+
+    // the server opens its ends before it answers, plain blocking io from here on
+    fcntl(*fd_c2s, F_SETFL, fcntl(*fd_c2s, F_GETFL) & ~O_NONBLOCK);
+    return SUCCESS;
+}
+
+/**
+ * Write one CONNECT request to the rendezvous FIFO of the server. The line is shorter
+ * than PIPE_BUF, so requests of concurrent clients never interleave.
+ */
+static int send_connect(int server_pid, const char *channel, const char *username, const char *document, int binary,
+                        uint64_t resume) {
+    char rendezvous[FIFO_NAME_LEN];
+    snprintf(rendezvous, sizeof(rendezvous), FIFO_SERVER, server_pid);
+    int fd = open(rendezvous, O_WRONLY | O_NONBLOCK);
+    if (fd < 0) return INVALID;
+
+    char offer[48] = "";
+    if (resume) snprintf(offer, sizeof(offer), " %s %lu", PROTOCOL_RESUME, resume);
+    char joins[48] = "";
+    if (document) snprintf(joins, sizeof(joins), " %s %s", PROTOCOL_DOCUMENT, document);
+    char request[200];
+    int framing = binary & ~CONNECT_LAYOUT;
+    int len = snprintf(request, sizeof(request), "%s %s %s%s%s%s%s%s\n", PROTOCOL_CONNECT, channel, username,
+                       framing ? " " PROTOCOL_BINARY : "", framing == CONNECT_STANDBY ? " " PROTOCOL_STANDBY : "",
+                       binary & CONNECT_LAYOUT ? " " PROTOCOL_LAYOUT : "", offer, joins);
+    int result = len < (int)sizeof(request) && write(fd, request, len) == len ? SUCCESS : INVALID;
+    close(fd);
+    return result;
+}
+
+int channel_connect(int server_pid, const char *channel, const char *username, const char *document, int binary,
+                    uint64_t resume, int timeout_ms, int *fd_c2s, int *fd_s2c) {
+    char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
+    snprintf(fifo_c2s, sizeof(fifo_c2s), FIFO_C2S, channel);
+    snprintf(fifo_s2c, sizeof(fifo_s2c), FIFO_S2C, channel);
+    *fd_c2s = -1;
+    *fd_s2c = -1;
+
+    int result = SUCCESS;
+    if (open_channel(fifo_c2s, fifo_s2c, fd_c2s, fd_s2c) != SUCCESS) {
+        result = CONNECT_CHANNEL;
+    } else if (send_connect(server_pid, channel, username, document, binary, resume) != SUCCESS) {
+        result = CONNECT_REQUEST;
+    } else {
+        // a FIFO that never had a writer does not report a hangup, so this waits for the answer
+        struct pollfd answer = {.fd = *fd_s2c, .events = POLLIN};
+        int ready;
+        do {
+            ready = poll(&answer, 1, timeout_ms);
+        } while (ready < 0 && errno == EINTR);
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready <= 0) result = CONNECT_TIMEOUT;
+    }
+
+    // the server holds both ends by now (or never will), the names are not needed anymore
+    int saved = errno;
+    unlink(fifo_c2s);
+    unlink(fifo_s2c);
+    if (result != SUCCESS) {
+        if (*fd_c2s >= 0) close(*fd_c2s);
+        if (*fd_s2c >= 0) close(*fd_s2c);
+        *fd_c2s = -1;
+        *fd_s2c = -1;
+    } else {
+        fcntl(*fd_s2c, F_SETFL, fcntl(*fd_s2c, F_GETFL) & ~O_NONBLOCK);
+    }
+    errno = saved;
+    return result;
+}
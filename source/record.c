@@ -0,0 +1,55 @@
+#include "../libs/record.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCESS 0
+#define INVALID -1
+
+int record_open(recorder *r, const char *path) {
+    memset(r, 0, sizeof(recorder));
+    r->file = fopen(path, "wb");
+    if (!r->file) return INVALID;
+    if (fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), r->file) != strlen(RECORD_MAGIC)) {
+        fclose(r->file);
+        r->file = NULL;
+        return INVALID;
+    }
+    return SUCCESS;
+}
+
+void record_op(recorder *r, const op *o, uint64_t version, int result) {
+    if (!r->file) return;
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 256;
+        signed char *bigger = realloc(r->results, cap);
+        if (!bigger) return; // the edit is left out, the replay reports the gap
+        r->results = bigger;
+        r->cap = cap;
+    }
+    r->results[r->count++] = (signed char)result;
+
+    op recorded = *o;
+    recorded.version = version;
+    unsigned char head[FRAME_HEADER_MAX];
+    size_t n = frame_header(&recorded, head);
+    fwrite(head, 1, n, r->file);
+    if (o->len > 0) fwrite(o->payload, 1, o->len, r->file);
+}
+
+void record_tick(recorder *r, uint64_t version, int committed) {
+    if (!r->file || (r->count == 0 && !committed)) return;
+    op tick = {.opcode = RECORD_TICK, .version = version, .args = {committed ? 1 : 0, 0},
+               .payload = (const char *)r->results, .len = r->count};
+    unsigned char head[FRAME_HEADER_MAX];
+    size_t n = frame_header(&tick, head);
+    fwrite(head, 1, n, r->file);
+    if (r->count > 0) fwrite(r->results, 1, r->count, r->file);
+    fflush(r->file);
+    r->count = 0;
+}
+
+void record_close(recorder *r) {
+    if (r->file) fclose(r->file);
+    free(r->results);
+    memset(r, 0, sizeof(recorder));
+}
@@ -0,0 +1,210 @@
+// replay: apply a recording of the server (see libs/record.h) to markdown.c as fast as it goes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../libs/markdown.h"
+#include "../libs/protocol.h"
+#include "../libs/apply.h"
+#include "../libs/record.h"
+#include "../libs/stats.h"
+
+#define True 1
+#define False 0
+#define SUCCESS 0
+#define UNSUCCESS 1
+#define NS_PER_SEC 1000000000ULL
+
+/**
+ * What one pass over the recording measured
+ */
+typedef struct replay_stats {
+    histogram apply[OP_COUNT]; // one edit, by opcode
+    histogram commit; // markdown_increment_version
+    histogram tick; // every edit of a tick and its commit
+    uint64_t edits;
+    uint64_t ticks;
+    uint64_t commits;
+    uint64_t result_mismatches; // return code differs from the recorded one
+    uint64_t version_mismatches; // version after a tick differs from the recorded one
+    uint64_t first_mismatch_tick; // 1 based, 0 when everything matched
+} replay_stats;
+
+static unsigned char *load_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *len = size > 0 ? (size_t)size : 0;
+    return data;
+}
+
+/**
+ * Apply the whole recording to a fresh document, the way the timing thread did: the
+ * edits of a tick as version + 1, then a commit when the tick committed. Return the
+ * final document, or NULL when the recording is malformed or memory runs out.
+ */
+static document *replay(const unsigned char *data, size_t len, replay_stats *s) {
+    document *doc = markdown_init();
+    if (!doc) return NULL;
+    size_t magic = strlen(RECORD_MAGIC);
+    size_t pos = magic;
+
+    // results of the running tick, checked when its RECORD_TICK frame comes. A tick has
+    // as many edits as its clients sent, the buffer grows with it.
+    int *results = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t tick_start = stats_now_ns();
+
+    while (pos < len) {
+        op o;
+        long n = frame_decode(data + pos, len - pos, &o);
+        if (n <= 0) {
+            free(results);
+            markdown_free(doc);
+            return NULL;
+        }
+        pos += n;
+
+        if (o.opcode == RECORD_TICK) {
+            s->ticks++;
+            int mismatch = False;
+            for (size_t i = 0; i < count && i < o.len; i++) {
+                if (results[i] != (signed char)o.payload[i]) {
+                    s->result_mismatches++;
+                    mismatch = True;
+                }
+            }
+            // an edit without a recorded result, or a result without an edit
+            if (count != o.len) {
+                s->result_mismatches += count > o.len ? count - o.len : o.len - count;
+                mismatch = True;
+            }
+            if (o.args[0]) {
+                uint64_t started = stats_now_ns();
+                markdown_increment_version(doc);
+                hist_record(&s->commit, stats_now_ns() - started);
+                s->commits++;
+            }
+            if (doc->version != o.version) {
+                s->version_mismatches++;
+                mismatch = True;
+            }
+            if (mismatch && s->first_mismatch_tick == 0) s->first_mismatch_tick = s->ticks;
+            uint64_t now = stats_now_ns();
+            hist_record(&s->tick, now - tick_start);
+            tick_start = now;
+            count = 0;
+            continue;
+        }
+
+        uint64_t started = stats_now_ns();
+        int result = apply_op(doc, o.version, &o);
+        hist_record(&s->apply[apply_is_edit(o.opcode) ? o.opcode : OP_NONE], stats_now_ns() - started);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            int *bigger = realloc(results, cap * sizeof(*bigger));
+            if (!bigger) {
+                free(results);
+                markdown_free(doc);
+                return NULL;
+            }
+            results = bigger;
+        }
+        results[count++] = result;
+        s->edits++;
+    }
+    free(results);
+    return doc;
+}
+
+int main(int argc, char *argv[]) {
+    int passes = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            passes = atoi(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc || passes <= 0) {
+        fprintf(stderr, "Usage: %s [-n passes] <recording> [doc.md]\n", argv[0]);
+        return UNSUCCESS;
+    }
+    const char *expected_path = optind + 1 < argc ? argv[optind + 1] : "doc.md";
+
+    size_t len;
+    unsigned char *data = load_file(argv[optind], &len);
+    size_t magic = strlen(RECORD_MAGIC);
+    if (!data || len < magic || memcmp(data, RECORD_MAGIC, magic) != 0) {
+        fprintf(stderr, "not a recording: %s\n", argv[optind]);
+        free(data);
+        return UNSUCCESS;
+    }
+
+    // every pass starts from an empty document; the report covers all of them
+    replay_stats *s = calloc(1, sizeof(replay_stats));
+    if (!s) return UNSUCCESS;
+    char *text = NULL;
+    uint64_t started = stats_now_ns();
+    for (int p = 0; p < passes; p++) {
+        document *doc = replay(data, len, s);
+        if (!doc) {
+            fprintf(stderr, "malformed recording\n");
+            return UNSUCCESS;
+        }
+        if (p == passes - 1) text = markdown_flatten(doc);
+        markdown_free(doc);
+    }
+    double elapsed = (double)(stats_now_ns() - started) / NS_PER_SEC;
+
+    printf("%d pass%s: %lu edits, %lu ticks, %lu commits in %.3fs (%.0f edits/s)\n", passes,
+           passes == 1 ? "" : "es", s->edits, s->ticks, s->commits, elapsed, s->edits / (elapsed > 0 ? elapsed : 1));
+    hist_print_header(stdout, "us");
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (atomic_load(&s->apply[i].total) == 0) continue;
+        hist_print(stdout, i == OP_NONE ? "UNKNOWN" : op_name(i), &s->apply[i], 1000);
+    }
+    hist_print(stdout, "increment_version", &s->commit, 1000);
+    hist_print(stdout, "tick", &s->tick, 1000);
+
+    int result = SUCCESS;
+    if (s->result_mismatches || s->version_mismatches) {
+        printf("DIVERGED: %lu return codes and %lu versions differ, first in tick %lu\n",
+               s->result_mismatches / passes, s->version_mismatches / passes, s->first_mismatch_tick);
+        result = UNSUCCESS;
+    }
+
+    // the server saves doc.md at QUIT, after the last tick
+    size_t expected_len;
+    unsigned char *expected = load_file(expected_path, &expected_len);
+    if (!expected) {
+        printf("no %s to verify against\n", expected_path);
+    } else if (text && strlen(text) == expected_len && memcmp(text, expected, expected_len) == 0) {
+        printf("MATCH %s (%zu bytes)\n", expected_path, expected_len);
+    } else {
+        size_t at = 0;
+        size_t text_len = text ? strlen(text) : 0;
+        while (at < text_len && at < expected_len && text[at] == (char)expected[at]) at++;
+        printf("MISMATCH %s: %zu bytes replayed, %zu expected, first difference at byte %zu\n", expected_path,
+               text_len, expected_len, at);
+        result = UNSUCCESS;
+    }
+
+    free(expected);
+    free(text);
+    free(s);
+    free(data);
+    return result;
+}
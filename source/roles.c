@@ -0,0 +1,128 @@
+#include "../libs/roles.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * FNV-1a, the names are short so a simple byte hash is enough
+ */
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Read the whole file into one NUL terminated buffer
+ */
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+
+    size_t len = 0, cap = 4096;
+    char *text = malloc(cap);
+    while (text) {
+        len += fread(text + len, 1, cap - len - 1, file);
+        if (len < cap - 1) break;
+        cap *= 2;
+        char *bigger = realloc(text, cap);
+        if (!bigger) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        text = bigger;
+    }
+    if (text) text[len] = '\0';
+    fclose(file);
+    return text;
+}
+
+roles *roles_load(const char *path) {
+    char *text = read_file(path);
+    if (!text) return NULL;
+
+    // at most one user per line, keep the table at most half full
+    size_t lines = 1;
+    for (const char *p = text; *p; p++) {
+        if (*p == '\n') lines++;
+    }
+    size_t slots = 16;
+    while (slots < lines * 2) slots *= 2;
+
+    roles *table = malloc(sizeof(roles));
+    if (!table) {
+        free(text);
+        return NULL;
+    }
+    table->slots = calloc(slots, sizeof(role_entry));
+    if (!table->slots) {
+        free(table);
+        free(text);
+        return NULL;
+    }
+    table->mask = slots - 1;
+    table->count = 0;
+    table->text = text;
+
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *field = NULL;
+        char *user = strtok_r(line, " \t\r", &field);
+        char *role = strtok_r(NULL, " \t\r", &field);
+        char *rate = strtok_r(NULL, " \t\r", &field);
+        char *burst = rate ? strtok_r(NULL, " \t\r", &field) : NULL;
+        if (!user || !role || strlen(user) >= ROLE_USER_MAX) continue;
+
+        size_t i = hash_name(user) & table->mask;
+        while (table->slots[i].name && strcmp(table->slots[i].name, user) != 0) {
+            i = (i + 1) & table->mask;
+        }
+        if (table->slots[i].name) continue; // the first line of a user wins
+        table->slots[i].name = user;
+        table->slots[i].role = strcmp(role, "write") == 0 ? ROLE_WRITE : ROLE_READ;
+        table->slots[i].rate = rate ? strtod(rate, NULL) : 0;
+        if (table->slots[i].rate < 0) table->slots[i].rate = 0;
+        table->slots[i].burst = burst ? strtod(burst, NULL) : table->slots[i].rate; // a second's worth
+        if (table->slots[i].burst < 1) table->slots[i].burst = 1;
+        table->count++;
+    }
+    return table;
+}
+
+/**
+ * The slot of a user, NULL if the user is not in the table
+ */
+static const role_entry *find(const roles *table, const char *username) {
+    if (!table) return NULL;
+    size_t i = hash_name(username) & table->mask;
+    while (table->slots[i].name) {
+        if (strcmp(table->slots[i].name, username) == 0) return &table->slots[i];
+        i = (i + 1) & table->mask;
+    }
+    return NULL;
+}
+
+int roles_lookup(const roles *table, const char *username) {
+    const role_entry *entry = find(table, username);
+    return entry ? entry->role : ROLE_NONE;
+}
+
+int roles_limit(const roles *table, const char *username, double *rate, double *burst) {
+    const role_entry *entry = find(table, username);
+    if (!entry || entry->rate == 0) return 0;
+    *rate = entry->rate;
+    *burst = entry->burst;
+    return 1;
+}
+
+void roles_free(roles *table) {
+    if (!table) return;
+    free(table->slots);
+    free(table->text);
+    free(table);
+}
@@ -1,19 +1,33 @@
 // TODO: server code that manages the document and handles client instructions
-#include <stdio.h>
-
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
 #include "../libs/markdown.h" // Assuming this library exists
-
-#define FIFO_NAME_LEN 32
+#include "../libs/protocol.h"
+#include "../libs/history.h"
+#include "../libs/roles.h"
+#include "../libs/snapshot.h"
+#include "../libs/stats.h"
+#include "../libs/trace.h"
+#include "../libs/apply.h"
+#include "../libs/record.h"
+#include "../libs/merkle.h"
+
+#define FIFO_NAME_LEN 48
 #define True 1
 #define False 0
 #define Reject_INVALID 10
@@ -25,119 +39,433 @@
 #define OUTDATED_VERSION -3
 #define MODIFIED 1
 #define NOT_MODIFIED 0
+#define OUT_QUEUE_BYTES (64 * 1024) // default byte budget of one client output queue
+#define OUT_STALL_MS 5000 // default time a client queue may stay undrained
+#define SLOW_RESYNC 0 // drop the queue and send a fresh snapshot later
+#define SLOW_DISCONNECT 1 // close the client
+#define FLUSH_IOV 64 // queued messages one writev hands to the pipe at most
+#define RING_BYTES (64 * 1024) // initial size of a client input ring
+#define RING_MAX (FRAME_MAX + FRAME_HEADER_MAX) // a ring only grows to hold one whole frame
+#define POOL_SLAB 256 // commands allocated at once when the pool runs dry
+#define PASTE_MAX (FRAME_MAX / 2) // largest paste a client may open, its history entry still fits a frame
+#define PASTE_MORE 0 // the paste still misses pieces
+#define PASTE_DONE 1 // the paste arrived whole, it goes to the tick as one insert
+#define PASTE_BROKEN 2 // a piece did not fit, the paste was dropped
+#define PASTE_REFUSED 3 // the client may not write, no buffer was opened
+#define ROLES_FILE "roles.txt"
+#define USERNAME_LEN ROLE_USER_MAX // a name the roles file can hold fits whole
+#define HISTORY_ENTRIES 1024 // default retention by count
+#define HISTORY_BYTES (16 * 1024 * 1024) // default retention by size
+#define HISTORY_AGE 3600 // default retention by age, in seconds
+#define PUBLISH_DEPTH 2 // ticks the publisher may fall behind before the tick waits
+#define TICK_BUDGET 1024 // default commands one tick applies to a document, 0 is no limit
+#define STATS_PERIOD 10 // default seconds between two dumps to the stats file
+#define TRACE_FILE "trace.bin" // where TRACE and SIGUSR2 dump the trace rings
+#define WORKERS_MAX 64 // commit threads at most, each with its publisher
+#define DOCUMENTS_MAX 1024 // documents hosted at once
+#define BLOCKS_MAX 4096 // block lines in one BLOCKS? answer
+#define BLOCK_LINE_MAX 64 // "<pos> <len> <hash>\n"
+#define STANDBY_USER "standby" // the username a standby connects with, it needs a role in roles.txt
+#define STANDBY_QUEUE_BYTES (64 * 1024 * 1024) // output budget of a standby, over it the standby starts over
+#define STANDBY_TIMEOUT_MS 2000 // time a primary has to answer the CONNECT of a standby
+#define STANDBY_RETRY_MS 100 // pause before a standby connects again
+#define STANDBY_LOST 0 // the stream of the primary ended, the primary may be gone
+#define STANDBY_QUIT 1 // the primary quit or turned the standby away
 
 // Structure definitions (unchanged)
+/**
+ * Bytes queued for many clients at once, a version broadcast. Every queue holding it has
+ * a reference, the last one to let go frees it.
+ */
+typedef struct shared_msg {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} shared_msg;
+
+/**
+ * One pending message of a client output queue. off counts the bytes already written,
+ * so a message that was half written is never dropped.
+ */
+typedef struct out_msg {
+    struct out_msg* next;
+    size_t len;
+    size_t off;
+    shared_msg* shared; // the bytes when they are shared, NULL when data holds them
+    char data[];
+} out_msg;
+
+struct command;
+
+/**
+ * Input ring of one client. The reader pulls large blocks into it and frames commands in
+ * place; every command points into the ring until the tick releases it. Frames are kept
+ * contiguous: when a partial frame reaches the end of the buffer it is moved to the front
+ * (the buffer "wraps") once the front has been released.
+ */
+typedef struct in_ring {
+    char* buf;
+    size_t cap;
+    size_t head; // oldest byte still referenced by a command
+    size_t tail; // end of the received bytes
+    size_t scan; // start of the bytes not framed yet
+    int wrapped; // live data is [head, wrap_end) followed by [0, tail)
+    size_t wrap_end;
+    unsigned lap; // incremented on every wrap
+    struct command* inflight_head; // commands not released yet, in arrival order
+    struct command* inflight_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t space; // signalled when commands are released
+} in_ring;
+
 typedef struct client {
-    pid_t pid;
-    char role[8]; // "read" or "write"
+    char channel[CHANNEL_MAX]; // names the FIFO pair
+    char username[USERNAME_LEN];
+    unsigned id; // numbers the client in traces
+    atomic_int role; // ROLE_READ or ROLE_WRITE, changed by apply_roles while the reader checks it
     int fd_c2s;
-    int fd_s2c;
+    int fd_s2c; // non-blocking, only written by client_flush
     pthread_t thread;
     struct client* next;
     int online;
-    int handshake;
+    int binary; // negotiated binary framing at the handshake
+    int standby; // a standby server: gets the versions of every document, never a resync
+    int layout; // asked for LAYOUT: every copy of the document carries its chunk layout
+
+    // bounded output queue, drained by non-blocking writes
+    pthread_mutex_t out_lock;
+    out_msg* out_head;
+    out_msg* out_tail;
+    size_t out_bytes; // bytes queued and not written yet
+    struct timespec stall_since; // when the queue first failed to drain
+    int stalled;
+    int resync; // queue was dropped, a snapshot is owed
+    int kicked; // disconnected as a slow consumer
+    uint64_t bytes_written; // to fd_s2c since the handshake, under out_lock
+    int welcomed; // the handshake is queued, broadcasts before it are left out, under out_lock
+    uint64_t resume_from; // version the client holds already, 0 asks for the full document
+    struct hosted_doc* doc; // the document the client joined at the handshake
+
+    in_ring in; // commands read from fd_c2s
+
+    // commands waiting for a tick, drained round robin with the other clients of the
+    // document. Under the document's version_lock.
+    struct command* queue_head;
+    struct command* queue_tail;
+    atomic_size_t queue_depth; // read by STATS without the lock
+    int active; // linked into the document's active clients
+    struct client* next_active;
+    double rate; // token bucket: commands per second, 0 is no limit
+    double burst;
+    double tokens;
+    uint64_t refilled_ns;
+    atomic_ulong throttled; // ticks that ended with commands queued and the bucket empty
+
+    // the paste being received, only touched by the reader thread
+    char* paste; // NULL when no paste is open
+    size_t paste_len; // bytes announced by PASTE
+    size_t paste_got; // bytes gathered from DATA pieces
+    op paste_insert; // the insert the paste becomes
 } client;
 
+/**
+ * A lightweight descriptor of one framed command. It does not own any text: text and
+ * op.payload point into the sender's input ring. Descriptors are recycled from a pool.
+ */
 typedef struct command {
-    char text[256]; // fixed in length
     struct command* next;
     struct client* sender;
     int is_finish;
+    op op; // parsed at ingestion, from a text line or a binary frame
+    int parse_error; // known command with arguments that did not parse
+    int authorized; // sender's role allows it, checked when it was enqueued
+    unsigned roles_epoch; // roles_epoch the check was made against
+    int result; // return code of the apply, the publisher replies with it
+    uint64_t queued_ns; // when it was enqueued, for the stats
+    size_t start; // ring offset of the frame
+    unsigned lap; // ring lap the frame was read in
+    int released;
+    struct command* next_inflight; // order of the sender's ring
+    char* owned; // the gathered content of a paste, op.payload points into it
 } command;
 
 typedef struct version {
-    struct command* head;
     uint64_t num;
     struct version* next;
 } version;
 
+/**
+ * One entry of the dispatch table: the role a command needs and its handler
+ */
+typedef struct command_spec {
+    int role;
+    int (*apply)(struct client* cli, const op* o);
+} command_spec;
+
+/**
+ * An immutable committed version. Readers hold a reference while they use it, the last
+ * one to let go frees it, so a reader never blocks the tick and never sees a half
+ * applied version.
+ */
+typedef struct doc_view {
+    int refs;
+    uint64_t version;
+    uint64_t root; // root of the hash tree over text
+    merkle_block* blocks; // the leaves of the hash tree, for BLOCKS?
+    size_t blocks_count;
+    size_t* lines; // where each line starts, for READLINES
+    size_t lines_count;
+    char* layout; // the chunks that are not plain text, sent with every copy (markdown_layout)
+    size_t layout_len;
+    size_t len;
+    char text[]; // NUL terminated
+} doc_view;
+
+/**
+ * What a tick hands to the publisher: its commands, whose replies are still owed, and
+ * the version it committed. The commands keep their senders alive until released.
+ */
+typedef struct tick_output {
+    struct tick_output* next;
+    struct hosted_doc* doc;
+    command* commands;
+    uint64_t base; // document version the commands were applied to
+    doc_view* view; // the committed version, NULL when the tick changed nothing
+} tick_output;
+
+/**
+ * The latency histograms of one thread, in nanoseconds unless noted. Each thread only
+ * records into its own shard, STATS merges them.
+ */
+typedef struct stats_shard {
+    histogram apply[OP_COUNT]; // applying or answering one command, by opcode
+    histogram queued; // a command waiting for its tick
+    histogram tick; // the apply stage of a tick that had commands, version_lock held
+    histogram tick_commands; // commands a tick took from the queues, a count
+    histogram increment; // markdown_increment_version
+    histogram publish; // replies, broadcast and flush of one tick
+    histogram broadcast; // serializing and queueing one version
+    histogram replication; // a version committed on the primary until this standby applied it
+} stats_shard;
+
+typedef struct command_slab {
+    struct command_slab* next;
+    command items[POOL_SLAB];
+} command_slab;
+
+/**
+ * A named document and everything that is kept once per document: its command queues,
+ * history, committed view and snapshot region. Its worker is the only thread that
+ * applies to it.
+ */
+typedef struct hosted_doc {
+    char name[CHANNEL_MAX];
+    document* engine;
+    version* current_version; // the number of the next version, a single node
+    pthread_mutex_t version_lock;
+    client* active_head; // clients with queued commands, in round robin order
+    client* active_tail;
+    history history_store; // committed versions and their ops, bounded
+    history_builder tick_ops; // ops applied in the running tick
+    doc_view* latest_view; // the last committed version, under view_lock
+    snapshot_region published; // the last committed version, mapped by local readers
+    unsigned roles_applied; // roles_generation its clients were last brought in line with
+    unsigned roles_epoch; // incremented when apply_roles changes roles, under version_lock
+    int replica_stale; // on a standby: out of step with the primary, a fresh copy was asked for
+    struct worker* worker;
+    struct hosted_doc* next; // every document, newest first
+    struct hosted_doc* next_in_worker;
+} hosted_doc;
+
+/**
+ * One commit thread and its publisher. Every document belongs to one worker, whose tick
+ * goes over its documents one after the other; documents of different workers commit in
+ * parallel.
+ */
+typedef struct worker {
+    int id;
+    int interval; // ms between two ticks
+    hosted_doc* docs; // prepended under documents_lock, only removed at QUIT
+    int docs_count;
+    tick_output* outputs_head; // ticks waiting for the publisher, oldest first
+    tick_output* outputs_tail;
+    int outputs_pending; // reserved, queued or being published
+    pthread_mutex_t publish_lock;
+    pthread_cond_t publish_ready; // a tick was queued
+    pthread_cond_t publish_done; // a tick was published
+    stats_shard tick_stats; // recorded by the timing thread
+    stats_shard publish_stats; // recorded by the publisher
+} worker;
+
 
 // === static variable ===
 static int online = True;
-static document* doc = NULL;
 static client* clients = NULL; // the clients linked list
 static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
-static version* versions = NULL; // the version linked list
-static version* current_version = NULL; // used to store the current version
-static pthread_mutex_t version_lock = PTHREAD_MUTEX_INITIALIZER;
+static hosted_doc* documents = NULL; // every document, created when a client first names it
+static hosted_doc* default_doc = NULL; // joined by clients that name none
+static int documents_count = 0;
+static pthread_mutex_t documents_lock = PTHREAD_MUTEX_INITIALIZER;
+static worker* workers = NULL;
+static int workers_count = 0;
+static size_t history_entries = HISTORY_ENTRIES;
+static size_t history_bytes = HISTORY_BYTES;
+static long history_age = HISTORY_AGE;
+static command* command_pool = NULL; // free descriptors
+static command_slab* command_slabs = NULL; // every slab, freed at QUIT
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static roles* role_table = NULL; // replaced as a whole when roles.txt changes
+static unsigned roles_generation = 0; // incremented on every replacement
+static pthread_mutex_t roles_lock = PTHREAD_MUTEX_INITIALIZER;
+static char rendezvous[FIFO_NAME_LEN]; // FIFO_SERVER_<pid>, where clients connect
+static pthread_mutex_t view_lock = PTHREAD_MUTEX_INITIALIZER; // guards latest_view of every document and refs
+static stats_shard reader_stats; // shared by the reader threads, queries only
+static char* stats_file = NULL; // dumped every stats_period seconds when set
+static long stats_period = STATS_PERIOD;
+static unsigned next_client_id = 1; // only the acceptor takes ids
+static size_t tick_budget = TICK_BUDGET; // commands per document and tick
+static double role_rate[2] = {0, 0}; // token bucket of each role, indexed by ROLE_READ and ROLE_WRITE
+static double role_burst[2] = {0, 0};
+static recorder recording; // every applied edit and tick of the default document when -r is given
+static int follow_pid = 0; // -F: the primary this server stands by for, 0 on a primary
+static atomic_int following; // True until the primary is gone and this standby took over
+static atomic_ulong standby_applied; // versions applied from the primary
+static stats_shard standby_stats; // recorded by the main thread while following
+
+// slow consumer policy, set from the command line
+static size_t out_queue_bytes = OUT_QUEUE_BYTES;
+static long out_stall_ms = OUT_STALL_MS;
+static int slow_policy = SLOW_RESYNC;
 
 // === function declarations (For Linker) ===
 int modify_authorization(client* cli);
-void message(client* cli, int return_code);
-const char* get_user_role(const char* username);
-int create_fifos(pid_t pid, char* c2s, char* s2c);
-client* init_client(pid_t pid, int fd_c2s, int fd_s2c, const char* role);
-void handshake_disconnected_clients();
+void message(client* cli, int return_code, uint64_t version);
+int get_user_role(const char* username);
+void apply_roles(hosted_doc* d);
+int valid_channel(const char* channel);
+void channel_fifos(const char* channel, char* c2s, char* s2c);
+client* init_client(const char* channel, int fd_c2s, int fd_s2c, int role);
+void accept_client(char* request);
+hosted_doc* open_document(const char* name);
+void remove_client(client* cli);
+void free_client(client* cli);
+
+// Command ingestion declarations
+command* command_get();
+void command_put(command* com);
+void release_command(command* com);
+void enqueue_commands(command* first, command* last);
+int read_commands(client* cli);
+
+// Output queue declarations
+shared_msg* shared_create(const char* data, size_t len);
+void shared_release(shared_msg* shared);
+void out_free(out_msg* msg);
+int client_send(client* cli, const char* data, size_t len);
+int client_send_shared(client* cli, shared_msg* shared);
+int client_printf(client* cli, const char* fmt, ...);
+void client_flush(client* cli);
+void flush_clients(hosted_doc* d);
+
+// Committed view declarations
+doc_view* view_acquire(hosted_doc* d);
+void view_release(doc_view* view);
+int view_publish(hosted_doc* d, const document* doc);
+unsigned char* copy_frame(const client* cli, int opcode, const doc_view* view, size_t* len);
+
+// History declarations
+int result_code(int return_code);
+void broadcast_version(hosted_doc* d, uint64_t num, uint64_t root);
+void standby_resend(client* cli, const op* o);
+
+// Publisher declarations
+void publish_reserve(worker* w);
+void publish_tick(worker* w, hosted_doc* d, command* commands, uint64_t base, doc_view* view);
+void publish_drain(worker* w);
+
+// Stats declarations
+void stats_report(FILE* out);
 
 // Command handler declarations
-void handle_doc(client *cli);
-void handle_perm(client* cli);
-int handle_insert(char* text);
-int handle_delete(char *text);
-int handle_newline(char *text);
-int handle_heading(char *text);
-int handle_bold(char *text);
-int handle_italic(char *text);
-int handle_blockquote(char *text);
-int handle_ordered_list(char *text);
-int handle_unordered_list(char *text);
-int handle_code(char *text);
-int handle_horizontal_rule(char *text);
-int handle_link(char *text);
+const char* role_name(int role);
+int apply_command(command* com);
+int handle_doc(client* cli, const op* o);
+int handle_hash(client* cli, const op* o);
+int handle_blocks(client* cli, const op* o);
+int handle_range(client* cli, const op* o);
+int handle_readlines(client* cli, const op* o);
+int handle_perm(client* cli, const op* o);
+int handle_edit(client* cli, const op* o);
 
 // Thread function declarations
 void* console_thread(void* arg); 
 void* client_thread(void* c); 
 void* timing_thread(void* arg); 
+void* roles_thread(void* arg);
+void* publish_thread(void* arg);
+void* stats_thread(void* arg);
+void* trace_signal_thread(void* arg);
 
 
 // === helper function DEFINITIONS ===
 
 /**
- * This function is used to help getting the role of the client. If client is found in the
- * roles.txt, return the role, else, return NULL
+ * This function is used to help getting the role of the client. Return ROLE_READ,
+ * ROLE_WRITE, or ROLE_NONE if the user is not in roles.txt
  */
-const char* get_user_role(const char* username) {
-    FILE* file = fopen("roles.txt", "r");
-    if (!file) return NULL;
-
-    static char role[32]; // static to return
-    char line[128];
+int get_user_role(const char* username) {
+    pthread_mutex_lock(&roles_lock);
+    int role = roles_lookup(role_table, username);
+    pthread_mutex_unlock(&roles_lock);
+    return role;
+}
 
-    while (fgets(line, sizeof(line), file)) {
-        char* real_line = strtok(line, "\n");
-        if (!real_line) continue;
+const char* role_name(int role) {
+    return role == ROLE_WRITE ? "write" : "read";
+}
 
-        char* user_token = strtok(real_line, " ");
-        char* role_token = strtok(NULL, " ");
+/**
+ * Set the token bucket of a client from its line in roles.txt, or from the limit of its
+ * role. Tokens it holds are kept up to the new burst. Caller must hold roles_lock.
+ */
+static void client_limits(client* cli) {
+    double rate = role_rate[atomic_load(&cli->role) == ROLE_WRITE];
+    double burst = role_burst[atomic_load(&cli->role) == ROLE_WRITE];
+    roles_limit(role_table, cli->username, &rate, &burst);
+    if (cli->rate == 0) cli->tokens = burst; // a new limit starts full
+    cli->rate = rate;
+    cli->burst = burst;
+    if (cli->tokens > burst) cli->tokens = burst;
+}
 
-        if (user_token && role_token && strcmp(user_token, username) == 0) {
-            strncpy(role, role_token, sizeof(role));
-            fclose(file);
-            return role;
+// === Client initialization ===
+/**
+ * A channel id becomes part of a file name, so only letters, digits, '-' and '_' pass
+ */
+int valid_channel(const char* channel) {
+    size_t len = strlen(channel);
+    if (len == 0 || len >= CHANNEL_MAX) return False;
+    for (size_t i = 0; i < len; i++) {
+        char c = channel[i];
+        if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9') && c != '-' && c != '_') {
+            return False;
         }
     }
-
-    fclose(file);
-    return NULL;
+    return True;
 }
 
-// === Client initialization ===
 /**
- * Initialize the FIFO, rename the c2s and s2c according to requirement
+ * Name the FIFO pair of a channel
  */
-int create_fifos(pid_t pid, char* c2s, char* s2c) {
-    snprintf(c2s, FIFO_NAME_LEN, "FIFO_C2S_%d", pid);
-    snprintf(s2c, FIFO_NAME_LEN, "FIFO_S2C_%d", pid);
-    unlink(c2s);
-    unlink(s2c);
-    return mkfifo(c2s, 0666) == 0 && mkfifo(s2c, 0666) == 0;
+void channel_fifos(const char* channel, char* c2s, char* s2c) {
+    snprintf(c2s, FIFO_NAME_LEN, FIFO_C2S, channel);
+    snprintf(s2c, FIFO_NAME_LEN, FIFO_S2C, channel);
 }
 
 /**
  * Init the client struct basically
  */
-client* init_client(pid_t pid, int fd_c2s, int fd_s2c, const char* role) {
+client* init_client(const char* channel, int fd_c2s, int fd_s2c, int role) {
     client* new_client = malloc(sizeof(client));
     if (!new_client) return NULL;
 
@@ -146,638 +474,2737 @@ client* init_client(pid_t pid, int fd_c2s, int fd_s2c, const char* role) {
     new_client->fd_s2c = fd_s2c;
 
     // init other attributes
-    new_client->pid = pid;
+    strncpy(new_client->channel, channel, CHANNEL_MAX);
+    new_client->channel[CHANNEL_MAX - 1] = '\0';
     new_client->online = True;
-    new_client->handshake = False;
-    strncpy(new_client->role, role, sizeof(new_client->role));
-    new_client->role[sizeof(new_client->role) - 1] = '\0';
+    new_client->binary = False;
+    new_client->standby = False;
+    new_client->layout = False;
+    atomic_init(&new_client->role, role);
     new_client->next = NULL;
+
+    // empty output queue
+    pthread_mutex_init(&new_client->out_lock, NULL);
+    new_client->out_head = NULL;
+    new_client->out_tail = NULL;
+    new_client->out_bytes = 0;
+    new_client->stalled = False;
+    new_client->resync = False;
+    new_client->kicked = False;
+    new_client->bytes_written = 0;
+    new_client->welcomed = False;
+    new_client->resume_from = 0;
+    new_client->paste = NULL;
+
+    // nothing queued, a full bucket
+    new_client->queue_head = NULL;
+    new_client->queue_tail = NULL;
+    atomic_init(&new_client->queue_depth, 0);
+    new_client->active = False;
+    new_client->next_active = NULL;
+    new_client->rate = 0;
+    new_client->burst = 0;
+    new_client->tokens = 0;
+    new_client->refilled_ns = stats_now_ns();
+    atomic_init(&new_client->throttled, 0);
+
+    // empty input ring
+    in_ring* r = &new_client->in;
+    memset(r, 0, sizeof(in_ring));
+    r->buf = malloc(RING_BYTES);
+    if (!r->buf) {
+        free(new_client);
+        return NULL;
+    }
+    r->cap = RING_BYTES;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->space, NULL);
     return new_client;
 }
 
 /**
- * This function is used to traverse the clients list and remove all the offline client
+ * Free the output queue, the input ring and the client itself. Every command of the
+ * client must have been released already.
  */
-void handshake_disconnected_clients() {
-    pthread_mutex_lock(&clients_lock);
-
-    client* cur = clients;
-    client* prev = NULL;
+void free_client(client* cli) {
+    out_msg* msg = cli->out_head;
+    while (msg) {
+        out_msg* next = msg->next;
+        out_free(msg);
+        msg = next;
+    }
+    pthread_mutex_destroy(&cli->out_lock);
 
-    while (cur) {
-        if (cur->online == False) {
-            cur->handshake = True;
+    free(cli->paste);
+    free(cli->in.buf);
+    pthread_mutex_destroy(&cli->in.lock);
+    pthread_cond_destroy(&cli->in.space);
+    free(cli);
+}
 
-            // remove from the list
-            if (prev) {
-                prev->next = cur->next;
-            } else {
-                clients = cur->next;
-            }
-            
-            client* to_free = cur;
-            cur = cur->next;
-            free(to_free); // FIX: Free the client structure memory here.
-        } else {
-            prev = cur;
-            cur = cur->next;
-        }
+/**
+ * Take the client out of the clients list. Once it is out, no other thread can reach it.
+ */
+void remove_client(client* cli) {
+    pthread_mutex_lock(&clients_lock);
+    client** link = &clients;
+    while (*link && *link != cli) {
+        link = &(*link)->next;
     }
-
+    if (*link) *link = cli->next;
     pthread_mutex_unlock(&clients_lock);
 }
 
-// === handle command line function ===
-void handle_doc(client *cli) {
-    char *content = markdown_flatten(doc);
-    dprintf(cli->fd_s2c, "%s\n", content);
-    free(content);
+// === client output queue ===
+/**
+ * Milliseconds passed since the given monotonic time
+ */
+static long elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
 }
 
-void handle_perm(client* cli) {
-    dprintf(cli->fd_s2c, "%s\n", cli->role);
+/**
+ * Copy bytes into a shared message with one reference, the caller's
+ */
+shared_msg* shared_create(const char* data, size_t len) {
+    shared_msg* shared = malloc(sizeof(shared_msg) + len);
+    if (!shared) return NULL;
+    atomic_init(&shared->refs, 1);
+    shared->len = len;
+    memcpy(shared->data, data, len);
+    return shared;
 }
 
-int handle_insert(char* text) {
-    size_t pos;
-    char content[256];
-    if (sscanf(text, "INSERT %lu %[^\n]", &pos, content) != 2){
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_insert(doc, current_version->num, pos, content);
+void shared_release(shared_msg* shared) {
+    if (shared && atomic_fetch_sub(&shared->refs, 1) == 1) free(shared);
 }
 
-int handle_delete(char *text) {
-    size_t pos, len;
-    if (sscanf(text, "DEL %lu %lu", &pos, &len) != 2) {
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_delete(doc, current_version->num, pos, len);
+/**
+ * Free a queued message, letting go of the bytes it shares
+ */
+void out_free(out_msg* msg) {
+    shared_release(msg->shared);
+    free(msg);
 }
 
-int handle_newline(char *text) {
-    size_t pos;
-    if (sscanf(text, "NEWLINE %lu", &pos) != 1) {
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_newline(doc, current_version->num, pos);
+/**
+ * The bytes of a queued message
+ */
+static const char* out_bytes(const out_msg* msg) {
+    return msg->shared ? msg->shared->data : msg->data;
 }
 
-int handle_heading(char *text) {
-    int level;
-    size_t pos;
-    if (sscanf(text, "HEADING %d %lu", &level, &pos) != 2) {
-        return INVALID_CURSOR_POS;
+/**
+ * Link a message at the end of the queue. Caller must hold cli->out_lock.
+ */
+static void out_link(client* cli, out_msg* msg) {
+    msg->off = 0;
+    msg->next = NULL;
+    if (cli->out_tail) {
+        cli->out_tail->next = msg;
+    } else {
+        cli->out_head = msg;
     }
-    return markdown_heading(doc, current_version->num, level, pos);
+    cli->out_tail = msg;
+    cli->out_bytes += msg->len;
 }
 
-int handle_bold(char *text) {
-    size_t start, end;
-    if (sscanf(text, "BOLD %lu %lu", &start, &end) != 2) {
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_bold(doc, current_version->num, start, end);
+/**
+ * Append one message at the end of the queue without checking the budget.
+ * Caller must hold cli->out_lock.
+ */
+static int out_append(client* cli, const char* data, size_t len) {
+    out_msg* msg = malloc(sizeof(out_msg) + len);
+    if (!msg) return REJECTED;
+    memcpy(msg->data, data, len);
+    msg->len = len;
+    msg->shared = NULL;
+    out_link(cli, msg);
+    return SUCCESS;
 }
 
-int handle_italic(char *text) {
-    size_t start, end;
-    if (sscanf(text, "ITALIC %lu %lu", &start, &end) != 2) {
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_italic(doc, current_version->num, start, end);
+/**
+ * The same for shared bytes: the queue takes a reference instead of a copy.
+ * Caller must hold cli->out_lock.
+ */
+static int out_append_shared(client* cli, shared_msg* shared) {
+    out_msg* msg = malloc(sizeof(out_msg));
+    if (!msg) return REJECTED;
+    atomic_fetch_add(&shared->refs, 1);
+    msg->len = shared->len;
+    msg->shared = shared;
+    out_link(cli, msg);
+    return SUCCESS;
 }
 
-int handle_blockquote(char *text) {
-    size_t pos;
-    if (sscanf(text, "BLOCKQUOTE %lu", &pos) != 1) {
-        return INVALID_CURSOR_POS;
+/**
+ * Drop everything queued except a message that is already half written, so the
+ * client never sees a torn line. Caller must hold cli->out_lock.
+ */
+static void out_drop(client* cli) {
+    out_msg* keep = NULL;
+    out_msg* msg = cli->out_head;
+    if (msg && msg->off > 0) {
+        keep = msg;
+        msg = msg->next;
+        keep->next = NULL;
     }
-    return markdown_blockquote(doc, current_version->num, pos);
-}
-
-int handle_ordered_list(char *text) {
-    size_t pos;
-    if (sscanf(text, "ORDERED_LIST %lu", &pos) != 1) {
-        return INVALID_CURSOR_POS;
+    while (msg) {
+        out_msg* next = msg->next;
+        out_free(msg);
+        msg = next;
     }
-    return markdown_ordered_list(doc, current_version->num, pos);
+    cli->out_head = keep;
+    cli->out_tail = keep;
+    cli->out_bytes = keep ? keep->len - keep->off : 0;
 }
 
-int handle_unordered_list(char *text) {
-    size_t pos;
-    if (sscanf(text, "UNORDERED_LIST %lu", &pos) != 1) {
-        return INVALID_CURSOR_POS;
+/**
+ * Close the client as a slow consumer. The client thread is interrupted so it
+ * leaves its read loop and goes through the normal disconnect path; it only takes
+ * SIGUSR1 while it waits for input, so a kick that comes earlier stays pending.
+ * Caller must hold cli->out_lock.
+ */
+static void kick_client(client* cli) {
+    if (cli->kicked) return;
+    cli->kicked = True;
+    out_drop(cli);
+    if (cli->fd_s2c >= 0) {
+        close(cli->fd_s2c);
+        cli->fd_s2c = -1;
     }
-    return markdown_unordered_list(doc, current_version->num, pos);
+    pthread_kill(cli->thread, SIGUSR1);
 }
 
-int handle_code(char *text) {
-    size_t start, end;
-    if (sscanf(text, "CODE %lu %lu", &start, &end) != 2) {
-        return INVALID_CURSOR_POS;
+/**
+ * The client ran over its byte or time budget, apply the configured policy.
+ * Caller must hold cli->out_lock.
+ */
+static void slow_consumer(client* cli) {
+    if (slow_policy == SLOW_DISCONNECT || cli->standby) { // a standby starts over on its own
+        kick_client(cli);
+        return;
     }
-    return markdown_code(doc, current_version->num, start, end);
+    out_drop(cli);
+    cli->resync = True;
+    cli->stalled = False;
 }
 
-int handle_horizontal_rule(char *text) {
-    size_t pos;
-    if (sscanf(text, "HORIZONTAL_RULE %lu", &pos) != 1) {
-        return INVALID_CURSOR_POS;
+/**
+ * Queue a copy of data, or a reference to shared, within the byte budget
+ */
+static int client_queue(client* cli, const char* data, size_t len, shared_msg* shared) {
+    int result = REJECTED;
+    pthread_mutex_lock(&cli->out_lock);
+
+    // a dropped queue is replaced by a snapshot, anything before it is stale. Before the
+    // handshake the client gets a copy at least as new as what is sent now.
+    if (cli->welcomed && !cli->kicked && !cli->resync) {
+        if (cli->out_bytes + len > (cli->standby ? STANDBY_QUEUE_BYTES : out_queue_bytes)) {
+            slow_consumer(cli);
+        } else {
+            result = shared ? out_append_shared(cli, shared) : out_append(cli, data, len);
+        }
     }
-    return markdown_horizontal_rule(doc, current_version->num, pos);
-}
 
-int handle_link(char *text) {
-    size_t start, end;
-    char url[256];
-    if (sscanf(text, "LINK %lu %lu %255s", &start, &end, url) != 3) {
-        return INVALID_CURSOR_POS;
-    }
-    return markdown_link(doc, current_version->num, start, end, url);
+    pthread_mutex_unlock(&cli->out_lock);
+    return result;
 }
 
 /**
- * FIX: Restored modify_authorization definition
+ * Queue a message for the client. Never blocks on the pipe; the queue is drained by
+ * client_flush. Returns REJECTED when the message was dropped.
  */
-int modify_authorization(client* cli){
-    if (strncmp(cli->role, "write", 5) != 0){
-        char msg[50];
-        strcpy(msg, "UNAUTHORISED <INSERT> <write> <read>");
-        write(cli->fd_s2c, msg, strlen(msg));
-        return REJECTED;
-    }
-    return SUCCESS;
+int client_send(client* cli, const char* data, size_t len) {
+    return client_queue(cli, data, len, NULL);
 }
 
 /**
- * FIX: Restored message definition
+ * client_send for bytes many clients get, queued without a copy
  */
-void message(client* cli, int return_code){
-    char msg[50];
-    
-    if (return_code == INVALID_CURSOR_POS) {
-        strcpy(msg, "INVALID_POSITION\n");
-    } else if (return_code == DELETED_POSITION) {
-        strcpy(msg, "DELETED_POSITION\n");
-    } else if (return_code == OUTDATED_VERSION) {
-        strcpy(msg, "OUTDATED_VERSION\n");
-    } else if (return_code == SUCCESS) {
-        strcpy(msg, "SUCCESS\n");
-    }
-
-    write(cli->fd_s2c, msg, strlen(msg));
+int client_send_shared(client* cli, shared_msg* shared) {
+    return client_queue(cli, NULL, shared->len, shared);
 }
 
-
-// === Thread function DEFINITIONS ===
 /**
- * This is a client thread fucntion, used to recieve meassgae from client and write to the command list
+ * Send one binary frame as a single message, so it is queued or dropped as a whole
  */
-void* client_thread(void* c) {
-    client* cli = (client*)c; // get the client struct
-
-    // get the current content from doc and send message to client as required
-    char* content = markdown_flatten(doc);
-    size_t len = strlen(content);
-    dprintf(cli->fd_s2c, "%s\n", cli->role); // role
-    dprintf(cli->fd_s2c, "%lu\n", doc->version); // version
-    dprintf(cli->fd_s2c, "%lu\n", len); // len
-    write(cli->fd_s2c, content, len); // content
-    
-    // FIX: Send a newline separator to handle client fread/fgets transition
-    write(cli->fd_s2c, "\n", 1); 
-    
-    free(content);
-
-    // FIX: Add a short delay to ensure client receives initial document (WSL workaround)
-    usleep(100000); // Wait 100ms 
+int client_send_frame(client* cli, const op* o) {
+    size_t len;
+    unsigned char* frame = frame_build(o, &len);
+    if (!frame) return REJECTED;
+    int result = client_send(cli, (const char*)frame, len);
+    free(frame);
+    return result;
+}
 
-    FILE* in = fdopen(cli->fd_c2s, "r");
-    char line[256];
-    while (fgets(line, sizeof(line), in)) {
-        line[strcspn(line, "\n")] = '\0';
+/**
+ * printf style wrapper of client_send
+ */
+int client_printf(client* cli, const char* fmt, ...) {
+    char buffer[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    if (len < 0) return REJECTED;
+    if ((size_t)len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+    return client_send(cli, buffer, len);
+}
 
-        if (strcmp(line, "DISCONNECT") == 0) {
-            pthread_mutex_lock(&clients_lock);
-            cli->online = False; // Set flag for timing thread to clean up
-            pthread_mutex_unlock(&clients_lock);
-            
-            // continue waiting until timing thread deal with all message and give us a handshake
-            while (!cli->handshake){
-                usleep(10);
+/**
+ * Write as much of the queue as the pipe takes right now. The replies and the broadcast
+ * a tick queued go out in one writev, so a client costs one write per tick however many
+ * commands it sent. A queue that makes no progress for longer than the time budget is
+ * treated as a slow consumer.
+ */
+void client_flush(client* cli) {
+    pthread_mutex_lock(&cli->out_lock);
+
+    while (cli->out_head && cli->fd_s2c >= 0) {
+        struct iovec iov[FLUSH_IOV];
+        int count = 0;
+        size_t total = 0;
+        for (out_msg* msg = cli->out_head; msg && count < FLUSH_IOV; msg = msg->next, count++) {
+            iov[count].iov_base = (char*)out_bytes(msg) + msg->off;
+            iov[count].iov_len = msg->len - msg->off;
+            total += iov[count].iov_len;
+        }
+        ssize_t n = writev(cli->fd_s2c, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                kick_client(cli); // EPIPE: the reader is gone
             }
-
-            // close stream/fds
-            fclose(in); // Closes cli->fd_c2s
-            close(cli->fd_s2c);
-
-            // unlink fifos
-            char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
-            snprintf(fifo_c2s, FIFO_NAME_LEN, "FIFO_C2S_%d", cli->pid);
-            snprintf(fifo_s2c, FIFO_NAME_LEN, "FIFO_S2C_%d", cli->pid);
-            unlink(fifo_c2s);
-            unlink(fifo_s2c);
-
-            return NULL;
+            break;
         }
-        
-        // create a new command
-        command* com = malloc(sizeof(command));
-        if (!com) continue; // handle malloc failure
-        
-        strncpy(com->text, line, sizeof(com->text));
-        com->text[sizeof(com->text) - 1] = '\0';
-        com->sender = cli;
-        com->next = NULL;
-        com->is_finish = False;
 
-        // get the lock for version and add one command at the end
-        pthread_mutex_lock(&version_lock);
-        if (!current_version->head) {
-            current_version->head = com;
-        } else {
-            command* cur = current_version->head;
-            while (cur->next) {
-                cur = cur->next;
+        cli->out_bytes -= n;
+        cli->bytes_written += n;
+        trace_event(TRACE_WRITE, cli->id, (uint32_t)n);
+        cli->stalled = False;
+
+        // let go of the messages written in full, the last one may be half written. An
+        // empty message (a resume handshake has no content) is written by any writev.
+        size_t written = n;
+        while (cli->out_head) {
+            out_msg* msg = cli->out_head;
+            size_t rest = msg->len - msg->off;
+            if (written < rest) {
+                msg->off += written;
+                break;
             }
-            cur->next = com;
+            written -= rest;
+            cli->out_head = msg->next;
+            if (!cli->out_head) cli->out_tail = NULL;
+            out_free(msg);
         }
-        pthread_mutex_unlock(&version_lock);
+        if ((size_t)n < total) break; // the pipe is full
     }
 
-    // Handle case where client pipe is closed unexpectedly (e.g. client close(fd_c2s))
-    pthread_mutex_lock(&clients_lock);
-    cli->online = False;
-    pthread_mutex_unlock(&clients_lock);
-    // Wait for cleanup by timing thread
-    while (!cli->handshake){
-        usleep(10);
+    // pipe is full, start or check the time budget
+    if (cli->out_head && !cli->kicked) {
+        if (!cli->stalled) {
+            cli->stalled = True;
+            clock_gettime(CLOCK_MONOTONIC, &cli->stall_since);
+        } else if (elapsed_ms(&cli->stall_since) > out_stall_ms) {
+            slow_consumer(cli);
+        }
     }
-    // close and unlink
-    if (in) fclose(in); 
-    if (cli->fd_s2c >= 0) close(cli->fd_s2c);
-    
-    char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
-    snprintf(fifo_c2s, FIFO_NAME_LEN, "FIFO_C2S_%d", cli->pid);
-    snprintf(fifo_s2c, FIFO_NAME_LEN, "FIFO_S2C_%d", cli->pid);
-    unlink(fifo_c2s);
-    unlink(fifo_s2c);
-    
-    return NULL;
+
+    pthread_mutex_unlock(&cli->out_lock);
 }
 
 /**
- * This is a timing thread fucntion. Each time interval, deal with all the command and boardcast lastest version
+ * Flush every online client of a document, and the standbys, which follow every
+ * document. Clients whose queue was dropped get a snapshot of the current document once
+ * the rest of their queue has drained:
+ * RESYNC\n<version>\n<len>\n<content>\n[<layout>\n]
+ * The snapshot is the last committed view, the document itself belongs to the tick.
  */
-void* timing_thread(void* arg) {
-    int interval = *(int*)arg;
-    free(arg);
-
-    while (True) {
-        usleep(interval * 1000);
-        
-        pthread_mutex_lock(&version_lock); // acquire the lock for the command line
-
-        command* head = current_version->head;
-        command* cur = head;
-        
-        // Deal with all the command
-        while(cur){
-            if (cur->is_finish == True){
-                cur = cur->next;
-                continue;
-            }
-            
-            // --- Command Processing Block ---
-            int result = SUCCESS;
-            
-            if (strncmp(cur->text, "INSERT", 6) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED){
-                    result = REJECTED;
-                } else {
-                    result = handle_insert(cur->text);
-                }
-            } else if (strncmp(cur->text, "DEL", 3) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_delete(cur->text);
-                }
-            } else if (strncmp(cur->text, "NEWLINE", 7) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_newline(cur->text);
-                }
-            } else if (strncmp(cur->text, "HEADING", 7) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_heading(cur->text);
-                }
-            } else if (strncmp(cur->text, "BOLD", 4) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_bold(cur->text);
-                }
-            } else if (strncmp(cur->text, "ITALIC", 6) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_italic(cur->text);
-                }
-            } else if (strncmp(cur->text, "BLOCKQUOTE", 10) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_blockquote(cur->text);
-                }
-            } else if (strncmp(cur->text, "ORDERED_LIST", 12) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_ordered_list(cur->text);
-                }
-            } else if (strncmp(cur->text, "UNORDERED_LIST", 14) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_unordered_list(cur->text);
-                }
-            } else if (strncmp(cur->text, "CODE", 4) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_code(cur->text);
-                }
-            } else if (strncmp(cur->text, "HORIZONTAL_RULE", 15) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_horizontal_rule(cur->text);
-                }
-            } else if (strncmp(cur->text, "LINK", 4) == 0) {
-                if (modify_authorization(cur->sender) == REJECTED) {
-                    result = REJECTED;
-                } else {
-                    result = handle_link(cur->text);
-                }
-            } else if (strncmp(cur->text, "DOC?", 4) == 0){
-                handle_doc(cur->sender);
-                result = SUCCESS; // Handled, not an error
-            } else if (strcmp(cur->text, "PERM?") == 0) {
-                handle_perm(cur->sender);
-                result = SUCCESS; // Handled, not an error
-            }
+void flush_clients(hosted_doc* d) {
+    doc_view* view = view_acquire(d);
+    pthread_mutex_lock(&clients_lock);
 
-            // Send standard response for modification commands
-            if (result != SUCCESS && result != REJECTED && 
-                strncmp(cur->text, "DOC?", 4) != 0 && strcmp(cur->text, "PERM?") != 0) {
-                message(cur->sender, result); 
-            }
-            
-            // Mark as finish
-            cur->is_finish = True;
-            cur = cur->next; 
-        } // End of command processing loop
-
-        // --- Memory Cleanup for Commands ---
-        cur = head;
-        command* next_com = NULL;
-        command* new_head = NULL;
-        
-        // Find the new head (the first command that hasn't finished yet)
-        while (cur && cur->is_finish == True) {
-            next_com = cur->next;
-            free(cur);
-            cur = next_com;
-        }
-        new_head = cur;
-        
-        // Re-link the remaining commands
-        if (new_head) {
-            command* prev_clean = new_head;
-            cur = new_head->next;
-            while (cur) {
-                if (cur->is_finish == True) {
-                    next_com = cur->next;
-                    prev_clean->next = next_com; // Unlink and bypass
-                    free(cur);
-                    cur = next_com;
-                } else {
-                    prev_clean = cur;
-                    cur = cur->next;
-                }
+    for (client* cli = clients; cli; cli = cli->next) {
+        if (cli->doc != d && !cli->standby) continue;
+        pthread_mutex_lock(&cli->out_lock);
+        if (cli->resync && !cli->out_head && !cli->kicked && cli->binary) {
+            size_t len;
+            unsigned char* frame = copy_frame(cli, OP_RESYNC, view, &len);
+            if (frame) out_append(cli, (const char*)frame, len);
+            free(frame);
+            cli->resync = False;
+        } else if (cli->resync && !cli->out_head && !cli->kicked) {
+            char header[64];
+            int header_len = snprintf(header, sizeof(header), "RESYNC\n%lu\n%lu\n", view->version, view->len);
+            out_append(cli, header, header_len);
+            out_append(cli, view->text, view->len);
+            out_append(cli, "\n", 1);
+            if (cli->layout) {
+                out_append(cli, view->layout, view->layout_len);
+                out_append(cli, "\n", 1);
             }
+            cli->resync = False;
         }
-        current_version->head = new_head;
-        // --- End of Cleanup ---
-        
-        // set the handshake for offline client
-        handshake_disconnected_clients();
-
-        // increment the version
-        if (doc->is_modify == MODIFIED) {
-            markdown_increment_version(doc);
-            version* ver = malloc(sizeof(version));
-            if (!ver) { /* Handle malloc error for version */ }
-            ver->head = NULL;
-            ver->next = NULL;
-            ver->num = current_version->num + 1;
-            current_version->next = ver;
-            current_version = ver;
-        }
+        pthread_mutex_unlock(&cli->out_lock);
 
-        pthread_mutex_unlock(&version_lock);
+        client_flush(cli);
     }
 
-    return NULL;
+    pthread_mutex_unlock(&clients_lock);
+    view_release(view);
 }
 
-
-// === console thread ===
+// === committed views ===
 /**
- * This function is used to keep listen the quit command and exit the program gracefully
+ * Take a reference to the last committed version of a document
  */
-void* console_thread(void* arg) {
-    char line[64];
-    while (fgets(line, sizeof(line), stdin)) {
-        line[strcspn(line, "\n")] = '\0';
+doc_view* view_acquire(hosted_doc* d) {
+    pthread_mutex_lock(&view_lock);
+    doc_view* view = d->latest_view;
+    view->refs++;
+    pthread_mutex_unlock(&view_lock);
+    return view;
+}
 
-        if (strcmp(line, "QUIT") == 0) {
-            // determine if there is any client online
-            pthread_mutex_lock(&clients_lock);
-            int count = 0;
-            client* c = clients;
-            while (c) {
-                count++;
-                c = c->next;
-            }
+void view_release(doc_view* view) {
+    pthread_mutex_lock(&view_lock);
+    int last = --view->refs == 0;
+    pthread_mutex_unlock(&view_lock);
+    if (last) {
+        free(view->blocks);
+        free(view->lines);
+        free(view->layout);
+        free(view);
+    }
+}
 
-            // stop the server in the critical section
-            if (count == 0){
-                online = False;
-            }
+/**
+ * Replace the last committed version with a copy of doc. Readers that hold the old one
+ * keep it until they release it. Only called by the document's timing thread (and
+ * open_document before).
+ */
+int view_publish(hosted_doc* d, const document* doc) {
+    const char* text = doc->current_version;
+    const merkle* hashes = doc->hashes;
+    size_t len = strlen(text);
+    doc_view* view = malloc(sizeof(doc_view) + len + 1);
+    if (!view) return REJECTED;
+    view->refs = 1; // the reference of latest_view
+    view->version = doc->version;
+    view->len = len;
+    memcpy(view->text, text, len + 1);
+    view->layout = markdown_layout(doc);
+    if (!view->layout) {
+        free(view);
+        return REJECTED;
+    }
+    view->layout_len = strlen(view->layout);
+    view->root = merkle_root(hashes);
+    view->blocks_count = hashes->count;
+    view->blocks = NULL;
+    if (hashes->count > 0) {
+        view->blocks = malloc(hashes->count * sizeof(merkle_block));
+        if (!view->blocks) {
+            free(view->layout);
+            free(view);
+            return REJECTED;
+        }
+        memcpy(view->blocks, hashes->blocks, hashes->count * sizeof(merkle_block));
+    }
 
-            pthread_mutex_unlock(&clients_lock);
-            
-            if (count > 0) {
-                printf("QUIT rejected, %d clients still connected.\n", count);
-                continue;
+    // index the lines while the text is hot, a READLINES is then two lookups
+    size_t lines_cap = 64;
+    view->lines = malloc(lines_cap * sizeof(size_t));
+    view->lines_count = 0;
+    for (const char* line = view->text; view->lines; ) {
+        if (view->lines_count == lines_cap) {
+            lines_cap *= 2;
+            size_t* lines = realloc(view->lines, lines_cap * sizeof(size_t));
+            if (!lines) {
+                free(view->lines);
+                view->lines = NULL;
+                break;
             }
+            view->lines = lines;
+        }
+        view->lines[view->lines_count++] = (size_t)(line - view->text);
+        line = memchr(line, '\n', view->text + len - line);
+        if (!line) break;
+        line++;
+    }
+    if (!view->lines) {
+        free(view->blocks);
+        free(view->layout);
+        free(view);
+        return REJECTED;
+    }
 
-            // clean all pipes
-            system("rm -f FIFO_C2S_* FIFO_S2C_*");
+    pthread_mutex_lock(&view_lock);
+    doc_view* old = d->latest_view;
+    d->latest_view = view;
+    pthread_mutex_unlock(&view_lock);
+    if (old) view_release(old);
+    return SUCCESS;
+}
 
-            // iterate to free all version and commands
-            pthread_mutex_lock(&version_lock);
-            version* ver = versions;
-            while (ver) {
-                command* cmd = ver->head;
-                while (cmd) {
-                    command* to_free_cmd = cmd;
-                    cmd = cmd->next;
-                    free(to_free_cmd);
-                }
-                version* to_free_ver = ver;
-                ver = ver->next;
-                free(to_free_ver);
-            }
-            pthread_mutex_unlock(&version_lock);
-
-            // save the doc.md
-            char* content = markdown_flatten(doc);
-            FILE* f = fopen("doc.md", "w");
-            if (f) {
-                fwrite(content, 1, strlen(content), f);
-                fclose(f);
-            }
-            free(content);
+/**
+ * The frame of a full copy of a view: its text, and its layout after it (arg1 the
+ * layout's length) for a client that asked for LAYOUT. Return it malloc'd, or NULL.
+ */
+unsigned char* copy_frame(const client* cli, int opcode, const doc_view* view, size_t* len) {
+    size_t layout_len = cli->layout ? view->layout_len : 0;
+    char* payload = malloc(view->len + layout_len + 1);
+    if (!payload) return NULL;
+    memcpy(payload, view->text, view->len);
+    memcpy(payload + view->len, view->layout, layout_len);
+    op o = {.opcode = opcode, .version = view->version, .args = {0, layout_len}, .payload = payload,
+            .len = view->len + layout_len};
+    unsigned char* frame = frame_build(&o, len);
+    free(payload);
+    return frame;
+}
 
-            markdown_free(doc);
-            exit(0);
-        }
+// === handle command line function ===
+/**
+ * Queries are answered by the client's reader thread as soon as they are read, from the
+ * last committed version: a query sees the last version committed at or after the time
+ * it arrives, never an edit of a tick that is still running.
+ */
+int handle_doc(client *cli, const op* o) {
+    (void)o;
+    doc_view* view = view_acquire(cli->doc);
+    if (cli->binary) {
+        size_t len;
+        unsigned char* frame = copy_frame(cli, OP_DOC, view, &len);
+        if (frame) client_send(cli, (const char*)frame, len);
+        free(frame);
+        view_release(view);
+        return SUCCESS;
     }
-    return NULL;
+    char* content = malloc(view->len + 1);
+    if (content) {
+        memcpy(content, view->text, view->len);
+        content[view->len] = '\n'; // send the terminating newline in the same message
+        client_send(cli, content, view->len + 1);
+        free(content);
+    }
+    view_release(view);
+    return SUCCESS;
 }
 
+int handle_perm(client* cli, const op* o) {
+    (void)o;
+    const char* role = role_name(atomic_load(&cli->role));
+    if (cli->binary) {
+        doc_view* view = view_acquire(cli->doc);
+        op reply = {.opcode = OP_PERM, .version = view->version, .payload = role, .len = strlen(role)};
+        view_release(view);
+        client_send_frame(cli, &reply);
+        return SUCCESS;
+    }
+    client_printf(cli, "%s\n", role);
+    return SUCCESS;
+}
+
+/**
+ * The root of the hash tree, so a client can check its replica with one small answer:
+ * HASH <version> <root> <blocks>
+ */
+int handle_hash(client* cli, const op* o) {
+    (void)o;
+    doc_view* view = view_acquire(cli->doc);
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%016lx %zu", view->root, view->blocks_count);
+    if (cli->binary) {
+        op reply = {.opcode = OP_HASH, .version = view->version, .payload = line, .len = (size_t)len};
+        client_send_frame(cli, &reply);
+    } else {
+        client_printf(cli, "HASH %lu %s\n", view->version, line);
+    }
+    view_release(view);
+    return SUCCESS;
+}
+
+/**
+ * The leaves of the hash tree from block arg0 on, at most arg1 and BLOCKS_MAX of them:
+ * BLOCKS <version> <first> <count> and then one "<pos> <len> <hash>" line per block
+ */
+int handle_blocks(client* cli, const op* o) {
+    doc_view* view = view_acquire(cli->doc);
+    size_t first = o->args[0] < view->blocks_count ? o->args[0] : view->blocks_count;
+    size_t count = view->blocks_count - first;
+    if (count > o->args[1]) count = o->args[1];
+    if (count > BLOCKS_MAX) count = BLOCKS_MAX;
+
+    char* lines = malloc(count * BLOCK_LINE_MAX + 64);
+    if (!lines) {
+        view_release(view);
+        return SUCCESS;
+    }
+    size_t len = 0;
+    if (!cli->binary) len += sprintf(lines, "BLOCKS %lu %zu %zu\n", view->version, first, count);
+    for (size_t i = first; i < first + count; i++) {
+        const merkle_block* b = &view->blocks[i];
+        len += sprintf(lines + len, "%zu %zu %016lx\n", b->pos, b->len, b->hash);
+    }
+    if (cli->binary) {
+        op reply = {.opcode = OP_BLOCKS, .version = view->version, .args = {first, count}, .payload = lines, .len = len};
+        client_send_frame(cli, &reply);
+    } else {
+        client_send(cli, lines, len);
+    }
+    free(lines);
+    view_release(view);
+    return SUCCESS;
+}
+
+/**
+ * Send a slice of the committed text. The text answer is the header line, the bytes and a
+ * newline, in one message like DOC?; the binary one is the reply frame.
+ */
+static void send_slice(client* cli, const op* reply, const char* header) {
+    if (cli->binary) {
+        client_send_frame(cli, reply);
+        return;
+    }
+    size_t header_len = strlen(header);
+    char* content = malloc(header_len + reply->len + 2);
+    if (!content) return;
+    memcpy(content, header, header_len);
+    content[header_len] = '\n';
+    memcpy(content + header_len + 1, reply->payload, reply->len);
+    content[header_len + 1 + reply->len] = '\n';
+    client_send(cli, content, header_len + reply->len + 2);
+    free(content);
+}
+
+/**
+ * The bytes of a range, cut to the document. RANGE? belongs to VERIFY and READ is the same
+ * for editors: RANGE <version> <pos> <len> or READ <version> <pos> <len>, then the bytes.
+ */
+int handle_range(client* cli, const op* o) {
+    doc_view* view = view_acquire(cli->doc);
+    size_t pos = o->args[0] < view->len ? o->args[0] : view->len;
+    size_t len = view->len - pos;
+    if (len > o->args[1]) len = o->args[1];
+    op reply = {.opcode = o->opcode, .version = view->version, .args = {pos, len}, .payload = view->text + pos, .len = len};
+    char header[80];
+    snprintf(header, sizeof(header), "%s %lu %zu %zu", o->opcode == OP_READ ? "READ" : "RANGE", view->version, pos, len);
+    send_slice(cli, &reply, header);
+    view_release(view);
+    return SUCCESS;
+}
+
+/**
+ * Lines first to first + count - 1, cut to the document, without the last newline:
+ * READLINES <version> <first> <count> <len>, then the bytes
+ */
+int handle_readlines(client* cli, const op* o) {
+    doc_view* view = view_acquire(cli->doc);
+    size_t first = o->args[0] < view->lines_count ? o->args[0] : view->lines_count;
+    size_t count = view->lines_count - first;
+    if (count > o->args[1]) count = o->args[1];
+    size_t start = first < view->lines_count ? view->lines[first] : view->len;
+    size_t end = start;
+    if (count > 0) end = first + count < view->lines_count ? view->lines[first + count] - 1 : view->len;
+    op reply = {.opcode = OP_READLINES, .version = view->version, .args = {first, count}, .payload = view->text + start, .len = end - start};
+    char header[96];
+    snprintf(header, sizeof(header), "READLINES %lu %zu %zu %zu", view->version, first, count, end - start);
+    send_slice(cli, &reply, header);
+    view_release(view);
+    return SUCCESS;
+}
+
+/**
+ * Every edit goes through the shared dispatch of apply.h, the replay tool uses the same
+ */
+int handle_edit(client* cli, const op* o) {
+    return apply_op(cli->doc->engine, cli->doc->current_version->num, o);
+}
+
+/**
+ * The dispatch table, indexed by opcode. Each command carries its permission
+ * requirement, so the apply loop checks it in one place.
+ */
+static const command_spec command_table[OP_COUNT] = {
+    [OP_INSERT] = {ROLE_WRITE, handle_edit},
+    [OP_DEL] = {ROLE_WRITE, handle_edit},
+    [OP_NEWLINE] = {ROLE_WRITE, handle_edit},
+    [OP_HEADING] = {ROLE_WRITE, handle_edit},
+    [OP_BOLD] = {ROLE_WRITE, handle_edit},
+    [OP_ITALIC] = {ROLE_WRITE, handle_edit},
+    [OP_BLOCKQUOTE] = {ROLE_WRITE, handle_edit},
+    [OP_ORDERED_LIST] = {ROLE_WRITE, handle_edit},
+    [OP_UNORDERED_LIST] = {ROLE_WRITE, handle_edit},
+    [OP_CODE] = {ROLE_WRITE, handle_edit},
+    [OP_HORIZONTAL_RULE] = {ROLE_WRITE, handle_edit},
+    [OP_LINK] = {ROLE_WRITE, handle_edit},
+    [OP_DOC] = {ROLE_READ, handle_doc},
+    [OP_PERM] = {ROLE_READ, handle_perm},
+    [OP_HASH] = {ROLE_READ, handle_hash},
+    [OP_BLOCKS] = {ROLE_READ, handle_blocks},
+    [OP_RANGE] = {ROLE_READ, handle_range},
+    [OP_READ] = {ROLE_READ, handle_range},
+    [OP_READLINES] = {ROLE_READ, handle_readlines},
+};
+
+/**
+ * FIX: Restored modify_authorization definition. Only checks, the publisher sends the
+ * UNAUTHORISED reply.
+ */
+int modify_authorization(client* cli){
+    if (atomic_load(&cli->role) != ROLE_WRITE){
+        return REJECTED;
+    }
+    return SUCCESS;
+}
+
+/**
+ * FIX: Restored message definition. version is the document version the command was
+ * applied to.
+ */
+void message(client* cli, int return_code, uint64_t version){
+    char msg[50];
+
+    // the result codes of the wire protocol are the negated return codes
+    if (cli->binary) {
+        uint64_t code = return_code == REJECTED ? RESULT_UNAUTHORISED : (uint64_t)-return_code;
+        op o = {.opcode = OP_RESULT, .version = version, .args = {code, 0}};
+        client_send_frame(cli, &o);
+        return;
+    }
+    
+    if (return_code == REJECTED) {
+        strcpy(msg, "UNAUTHORISED <INSERT> <write> <read>\n");
+    } else if (return_code == INVALID_CURSOR_POS) {
+        strcpy(msg, "INVALID_POSITION\n");
+    } else if (return_code == DELETED_POSITION) {
+        strcpy(msg, "DELETED_POSITION\n");
+    } else if (return_code == OUTDATED_VERSION) {
+        strcpy(msg, "OUTDATED_VERSION\n");
+    } else if (return_code == SUCCESS) {
+        strcpy(msg, "SUCCESS\n");
+    }
+
+    client_send(cli, msg, strlen(msg));
+}
+
+
+/**
+ * Apply one pre-parsed command: look it up by opcode, check the permission it needs,
+ * then run its handler.
+ */
+int apply_command(command* com) {
+    const command_spec* spec = com->op.opcode > OP_NONE && com->op.opcode < OP_COUNT
+                               ? &command_table[com->op.opcode] : NULL;
+    if (!spec || !spec->apply) {
+        return INVALID_CURSOR_POS;
+    }
+    if (spec->role == ROLE_WRITE) {
+        // checked by the reader thread, unless apply_roles changed roles since
+        int authorized = com->roles_epoch == com->sender->doc->roles_epoch ? com->authorized
+                                                         : modify_authorization(com->sender) == SUCCESS;
+        if (!authorized) return REJECTED;
+    }
+    if (com->parse_error != SUCCESS) {
+        return com->parse_error;
+    }
+    return spec->apply(com->sender, &com->op);
+}
+
+// === command ingestion ===
+/**
+ * Take a descriptor from the pool, allocating a whole slab when it is empty
+ */
+command* command_get() {
+    pthread_mutex_lock(&pool_lock);
+    if (!command_pool) {
+        command_slab* slab = malloc(sizeof(command_slab));
+        if (!slab) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        slab->next = command_slabs;
+        command_slabs = slab;
+        for (int i = 0; i < POOL_SLAB; i++) {
+            slab->items[i].next = command_pool;
+            command_pool = &slab->items[i];
+        }
+    }
+    command* com = command_pool;
+    command_pool = com->next;
+    pthread_mutex_unlock(&pool_lock);
+    return com;
+}
+
+void command_put(command* com) {
+    pthread_mutex_lock(&pool_lock);
+    com->next = command_pool;
+    command_pool = com;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * The tick is done with the command. Ring space is given back in arrival order, so the
+ * ring head only moves past a command once every older command is released too.
+ */
+void release_command(command* com) {
+    in_ring* r = &com->sender->in;
+    free(com->owned);
+    com->owned = NULL;
+    pthread_mutex_lock(&r->lock);
+    com->released = True;
+
+    while (r->inflight_head && r->inflight_head->released) {
+        command* done = r->inflight_head;
+        r->inflight_head = done->next_inflight;
+        if (!r->inflight_head) r->inflight_tail = NULL;
+        command_put(done);
+    }
+
+    // the oldest live byte is the oldest unreleased command, or the unframed bytes
+    if (r->wrapped && (!r->inflight_head || r->inflight_head->lap == r->lap)) {
+        r->wrapped = False;
+    }
+    r->head = r->inflight_head ? r->inflight_head->start : r->scan;
+
+    pthread_cond_signal(&r->space);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Append a batch of commands at the end of the sender's queue, and the sender to the
+ * active clients of its document if it was idle. Roles only change under the document's
+ * version_lock, so the batch is authorized here, on the reader thread.
+ */
+void enqueue_commands(command* first, command* last) {
+    uint64_t now = stats_now_ns();
+    uint32_t count = 0;
+    client* cli = first->sender;
+    hosted_doc* d = cli->doc;
+
+    // get the lock for the queues and add the batch at the end
+    pthread_mutex_lock(&d->version_lock);
+    for (command* com = first; com; com = com->next) {
+        com->authorized = modify_authorization(com->sender) == SUCCESS;
+        com->roles_epoch = d->roles_epoch;
+        com->queued_ns = now;
+        count++;
+    }
+    trace_event(TRACE_ENQUEUE, cli->id, count);
+    if (!cli->queue_head) {
+        cli->queue_head = first;
+    } else {
+        cli->queue_tail->next = first;
+    }
+    cli->queue_tail = last;
+    atomic_fetch_add(&cli->queue_depth, count);
+    if (!cli->active) {
+        cli->active = True;
+        cli->next_active = NULL;
+        if (d->active_tail) {
+            d->active_tail->next_active = cli;
+        } else {
+            d->active_head = cli;
+        }
+        d->active_tail = cli;
+    }
+    pthread_mutex_unlock(&d->version_lock);
+}
+
+/**
+ * Find free ring space to read into. Wraps or grows the ring when the end is reached,
+ * and waits for the tick to release commands when the ring is full.
+ * Return SUCCESS, or REJECTED when the client was kicked or sent a frame over RING_MAX.
+ */
+static int ring_reserve(client* cli, char** space, size_t* len) {
+    in_ring* r = &cli->in;
+    pthread_mutex_lock(&r->lock);
+
+    while (!cli->kicked) {
+        if (r->wrapped && r->tail < r->head) {
+            *space = r->buf + r->tail;
+            *len = r->head - r->tail;
+            pthread_mutex_unlock(&r->lock);
+            return SUCCESS;
+        }
+        if (!r->wrapped && r->tail < r->cap) {
+            *space = r->buf + r->tail;
+            *len = r->cap - r->tail;
+            pthread_mutex_unlock(&r->lock);
+            return SUCCESS;
+        }
+
+        size_t partial = r->tail - r->scan;
+        if (!r->wrapped && r->head == r->scan && r->scan > 0) {
+            // nothing live before the partial frame, restart at the front
+            memmove(r->buf, r->buf + r->scan, partial);
+            r->head = r->scan = 0;
+            r->tail = partial;
+            continue;
+        }
+        if (!r->wrapped && r->head == 0 && r->scan == 0) {
+            // one frame fills the whole ring, nothing points into it: grow
+            size_t cap = r->cap * 2 > RING_MAX ? RING_MAX : r->cap * 2;
+            char* bigger = cap > r->cap ? realloc(r->buf, cap) : NULL;
+            if (!bigger) break;
+            r->buf = bigger;
+            r->cap = cap;
+            continue;
+        }
+        if (!r->wrapped && r->head > partial) {
+            // the front is released, move the partial frame there
+            memcpy(r->buf, r->buf + r->scan, partial);
+            r->wrap_end = r->scan;
+            r->wrapped = True;
+            r->lap++;
+            r->scan = 0;
+            r->tail = partial;
+            continue;
+        }
+
+        // full, wait for the tick
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100 * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&r->space, &r->lock, &until);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return REJECTED;
+}
+
+/**
+ * Take a PASTE or DATA command of the client. PASTE opens a buffer for the announced
+ * length and every DATA piece is copied into it, so the ring space of a piece is given
+ * back at once and a paste may be larger than the ring. Once the last byte is in, o
+ * becomes one INSERT of the whole content and *owned the buffer it points into. A client
+ * that may not write never gets a buffer: its PASTE is refused and its pieces dropped.
+ */
+static int paste_take(client* cli, op* o, int parsed, char** owned) {
+    if (o->opcode == OP_PASTE) {
+        free(cli->paste); // a paste that was never finished is given up
+        cli->paste = NULL;
+        if (modify_authorization(cli) != SUCCESS) return PASTE_REFUSED;
+        if (parsed != SUCCESS || o->args[1] == 0 || o->args[1] > PASTE_MAX) return PASTE_BROKEN;
+        cli->paste = malloc(o->args[1]);
+        if (!cli->paste) return PASTE_BROKEN;
+        cli->paste_len = o->args[1];
+        cli->paste_got = 0;
+        cli->paste_insert = (op){.opcode = OP_INSERT, .version = o->version, .args = {o->args[0], 0}};
+        return PASTE_MORE;
+    }
+
+    // the PASTE of these pieces was already answered UNAUTHORISED
+    if (!cli->paste && modify_authorization(cli) != SUCCESS) return PASTE_MORE;
+
+    // text pieces are escaped to stay on one line, undo it in the ring
+    size_t len = o->len;
+    if (parsed == SUCCESS && !cli->binary) len = op_unescape((char*)o->payload, o->len);
+    if (!cli->paste || parsed != SUCCESS || len > cli->paste_len - cli->paste_got) {
+        free(cli->paste);
+        cli->paste = NULL;
+        return PASTE_BROKEN;
+    }
+    memcpy(cli->paste + cli->paste_got, o->payload, len);
+    cli->paste_got += len;
+    if (cli->paste_got < cli->paste_len) return PASTE_MORE;
+
+    *o = cli->paste_insert;
+    o->payload = cli->paste;
+    o->len = cli->paste_len;
+    *owned = cli->paste;
+    cli->paste = NULL;
+    return PASTE_DONE;
+}
+
+/**
+ * Frame every complete command in [scan, tail). Text commands are NUL terminated in
+ * place of their newline, binary frames are decoded in place. Return True when the
+ * client asked to disconnect or sent a malformed frame.
+ */
+static int frame_commands(client* cli, command** first, command** last) {
+    in_ring* r = &cli->in;
+    size_t scan = r->scan; // only this thread moves scan and tail
+    int stop = False;
+    int answered = False;
+
+    while (scan < r->tail && !stop) {
+        char* p = r->buf + scan;
+        size_t avail = r->tail - scan;
+        size_t frame_len;
+        op o;
+
+        // parse once here, the tick only dispatches on the opcode
+        int parsed = SUCCESS;
+        if (cli->binary) {
+            long n = frame_decode((const unsigned char*)p, avail, &o);
+            if (n < 0) stop = True;
+            if (n <= 0) break;
+            frame_len = n;
+        } else {
+            char* newline = memchr(p, '\n', avail);
+            if (!newline) break;
+            *newline = '\0';
+            frame_len = newline - p + 1;
+            parsed = op_parse_text(p, &o);
+        }
+
+        size_t start = scan;
+        scan += frame_len;
+        if (o.opcode == OP_DISCONNECT) stop = True;
+        if (stop || parsed == PARSE_UNKNOWN) continue; // nothing to apply
+
+        // a paste reaches the tick once, whole
+        char* owned = NULL;
+        if (o.opcode == OP_PASTE || o.opcode == OP_DATA) {
+            int taken = paste_take(cli, &o, parsed, &owned);
+            if (taken == PASTE_MORE) continue;
+            if (taken == PASTE_REFUSED) {
+                message(cli, REJECTED, o.version);
+                answered = True;
+                continue;
+            }
+            if (taken == PASTE_BROKEN) {
+                o.payload = NULL;
+                o.len = 0;
+                parsed = PARSE_BAD_ARGS;
+            }
+        }
+
+        // a standby that fell out of step with a document asks for it again
+        if (cli->standby && o.opcode == OP_REPLICA_DOC) {
+            standby_resend(cli, &o);
+            answered = True;
+            continue;
+        }
+
+        // queries do not wait for the tick, they are answered from the last committed version
+        if (parsed == SUCCESS && o.opcode > OP_NONE && o.opcode < OP_COUNT &&
+            command_table[o.opcode].role == ROLE_READ) {
+            uint64_t started = stats_now_ns();
+            trace_event(TRACE_QUERY, cli->id, o.opcode);
+            command_table[o.opcode].apply(cli, &o);
+            hist_record(&reader_stats.apply[o.opcode], stats_now_ns() - started);
+            answered = True;
+            continue;
+        }
+
+        command* com = command_get();
+        if (!com) {
+            free(owned);
+            continue; // handle malloc failure
+        }
+        com->op = o;
+        com->owned = owned;
+        com->parse_error = parsed == SUCCESS ? SUCCESS : INVALID_CURSOR_POS;
+        com->sender = cli;
+        com->next = NULL;
+        com->is_finish = False;
+        com->start = start;
+        com->released = False;
+        com->next_inflight = NULL;
+
+        if (*last) {
+            (*last)->next = com;
+        } else {
+            *first = com;
+        }
+        *last = com;
+    }
+
+    // publish the batch to the release side
+    pthread_mutex_lock(&r->lock);
+    for (command* com = *first; com; com = com->next) {
+        com->lap = r->lap;
+        if (r->inflight_tail) {
+            r->inflight_tail->next_inflight = com;
+        } else {
+            r->inflight_head = com;
+        }
+        r->inflight_tail = com;
+    }
+    r->scan = scan;
+    if (!r->inflight_head && !r->wrapped) r->head = scan;
+    pthread_mutex_unlock(&r->lock);
+
+    if (answered) client_flush(cli);
+    return stop;
+}
+
+/**
+ * Read the client's commands in large blocks until DISCONNECT, EOF or a kick. A burst of
+ * small edits costs a few reads, and each batch goes into the command list at once.
+ */
+int read_commands(client* cli) {
+    in_ring* r = &cli->in;
+
+    // the kick signal is blocked except inside ppoll, so one sent between the check of
+    // kicked and the wait is not lost: it ends the wait at once
+    sigset_t kick_set, waiting;
+    sigemptyset(&kick_set);
+    sigaddset(&kick_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &kick_set, &waiting);
+    sigdelset(&waiting, SIGUSR1);
+
+    while (True) {
+        pthread_mutex_lock(&cli->out_lock);
+        int kicked = cli->kicked;
+        pthread_mutex_unlock(&cli->out_lock);
+        if (kicked) break;
+
+        char* space;
+        size_t len;
+        if (ring_reserve(cli, &space, &len) != SUCCESS) break;
+
+        struct pollfd readable = {.fd = cli->fd_c2s, .events = POLLIN};
+        if (ppoll(&readable, 1, NULL, &waiting) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        ssize_t n = read(cli->fd_c2s, space, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        pthread_mutex_lock(&r->lock);
+        r->tail += n;
+        pthread_mutex_unlock(&r->lock);
+
+        command* first = NULL;
+        command* last = NULL;
+        int stop = frame_commands(cli, &first, &last);
+        if (first) enqueue_commands(first, last);
+        if (stop) break;
+    }
+    return SUCCESS;
+}
+
+// === history and broadcast ===
+/**
+ * Map a handler return code to the result code kept in the history
+ */
+int result_code(int return_code) {
+    if (return_code == REJECTED) return RESULT_UNAUTHORISED;
+    if (return_code < 0) return -return_code;
+    return RESULT_SUCCESS;
+}
+
+/**
+ * Growable text buffer for the broadcast of one version
+ */
+typedef struct text_buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+} text_buffer;
+
+static void text_reserve(text_buffer* t, size_t extra) {
+    if (t->len + extra + 1 <= t->cap) return;
+    size_t cap = t->cap ? t->cap : 256;
+    while (cap < t->len + extra + 1) cap *= 2;
+    char* bigger = realloc(t->data, cap);
+    if (!bigger) return;
+    t->data = bigger;
+    t->cap = cap;
+}
+
+/**
+ * One EDIT line per op: EDIT <user> <command> SUCCESS | Reject <reason>
+ */
+static void format_edit(const char* user, const op* o, int result, void* arg) {
+    text_buffer* t = (text_buffer*)arg;
+    size_t len = op_format(o, NULL, 0);
+    text_reserve(t, len + strlen(user) + 48);
+    if (t->len + len + strlen(user) + 48 > t->cap) return; // out of memory, skip the line
+
+    t->len += snprintf(t->data + t->len, t->cap - t->len, "EDIT %s ", user);
+    op_format(o, t->data + t->len, t->cap - t->len);
+    t->len += len;
+    if (result == RESULT_SUCCESS) {
+        t->len += snprintf(t->data + t->len, t->cap - t->len, " SUCCESS\n");
+    } else {
+        t->len += snprintf(t->data + t->len, t->cap - t->len, " Reject %s\n", result_name(result));
+    }
+}
+
+/**
+ * The broadcast of version num in the framing of a client: VERSION, its EDIT lines and END,
+ * or an OP_VERSION frame. Return a malloc'd message, or NULL when out of memory.
+ */
+static char* version_message(uint64_t num, const history_entry* e, int binary, size_t* len) {
+    if (binary) {
+        op frame = {.opcode = OP_VERSION, .version = num, .payload = (const char*)e->data, .len = e->len};
+        return (char*)frame_build(&frame, len);
+    }
+    text_buffer t = {NULL, 0, 0};
+    text_reserve(&t, 64);
+    if (!t.data) return NULL;
+    t.len = snprintf(t.data, t.cap, "VERSION %lu\n", num);
+    history_decode(e->data, e->len, format_edit, &t);
+    text_reserve(&t, 8);
+    t.len += snprintf(t.data + t.len, t.cap - t.len, "END\n");
+    *len = t.len;
+    return t.data;
+}
+
+/**
+ * A frame for a standby: the document name ahead of body in the payload, so one stream
+ * carries every document, and the merkle root between them for a version (root not NULL).
+ * arg1 is the commit time of a version, the layout length of a copy. Return a malloc'd
+ * frame, or NULL when out of memory.
+ */
+static char* replica_message(int opcode, const char* name, uint64_t version, uint64_t arg1, const uint64_t* root,
+                             const char* body, size_t body_len, size_t* len) {
+    size_t name_len = strlen(name);
+    size_t root_len = root ? REPLICA_ROOT_BYTES : 0;
+    char* payload = malloc(name_len + root_len + body_len + 1);
+    if (!payload) return NULL;
+    memcpy(payload, name, name_len);
+    for (size_t i = 0; i < root_len; i++) payload[name_len + i] = (char)(*root >> (8 * i));
+    memcpy(payload + name_len + root_len, body, body_len);
+    op frame = {.opcode = opcode, .version = version, .args = {name_len, arg1}, .payload = payload,
+                .len = name_len + root_len + body_len};
+    char* message = (char*)frame_build(&frame, len);
+    free(payload);
+    return message;
+}
+
+/**
+ * The OP_REPLICA_DOC frame of a committed view: its text, then its layout (arg1 long)
+ */
+static char* replica_copy(const hosted_doc* d, const doc_view* view, size_t* len) {
+    char* body = malloc(view->len + view->layout_len + 1);
+    if (!body) return NULL;
+    memcpy(body, view->text, view->len);
+    memcpy(body + view->len, view->layout, view->layout_len);
+    char* frame = replica_message(OP_REPLICA_DOC, d->name, view->version, view->layout_len, NULL, body,
+                                  view->len + view->layout_len, len);
+    free(body);
+    return frame;
+}
+
+/**
+ * A client that can not be sent a version gets a copy of the document instead, once its
+ * queue has drained. A standby is closed, it starts over from every document.
+ * Caller must hold clients_lock.
+ */
+static void missed_version(client* cli) {
+    pthread_mutex_lock(&cli->out_lock);
+    if (cli->standby && cli->welcomed) {
+        kick_client(cli);
+    } else if (cli->welcomed && !cli->kicked) {
+        cli->resync = True;
+    }
+    pthread_mutex_unlock(&cli->out_lock);
+}
+
+/**
+ * Send a committed version to every client. Text clients get
+ * VERSION <num>\nEDIT ...\nEND\n, binary clients get the history entry as it is stored.
+ */
+void broadcast_version(hosted_doc* d, uint64_t num, uint64_t root) {
+    // a version the history could not keep reaches the clients as a copy
+    history_entry e;
+    if (history_get(&d->history_store, num, &e) != SUCCESS) {
+        pthread_mutex_lock(&clients_lock);
+        for (client* cli = clients; cli; cli = cli->next) {
+            if (cli->doc == d || cli->standby) missed_version(cli);
+        }
+        pthread_mutex_unlock(&clients_lock);
+        return;
+    }
+
+    // serialized once per framing, every queue references the same bytes
+    size_t text_len = 0, frame_len = 0;
+    char* text_data = version_message(num, &e, False, &text_len);
+    char* frame_data = version_message(num, &e, True, &frame_len);
+    shared_msg* text = text_data ? shared_create(text_data, text_len) : NULL;
+    shared_msg* frame = frame_data ? shared_create(frame_data, frame_len) : NULL;
+    free(text_data);
+    free(frame_data);
+    shared_msg* replica = NULL; // built for the first standby
+
+    uint32_t sent = 0;
+    pthread_mutex_lock(&clients_lock);
+    for (client* cli = clients; cli; cli = cli->next) {
+        if (cli->standby) {
+            if (!replica) {
+                size_t replica_len = 0;
+                char* replica_data = replica_message(OP_REPLICA_VERSION, d->name, num, e.time_ns, &root,
+                                                     (const char*)e.data, e.len, &replica_len);
+                replica = replica_data ? shared_create(replica_data, replica_len) : NULL;
+                free(replica_data);
+            }
+            // over its budget a standby is closed by client_queue. One that would miss a
+            // version is closed as well, it starts over instead of diverging.
+            if (replica) {
+                client_send_shared(cli, replica);
+            } else {
+                missed_version(cli);
+            }
+            continue;
+        }
+        if (cli->doc != d) continue;
+        if (cli->binary && frame) {
+            client_send_shared(cli, frame);
+            sent++;
+        } else if (!cli->binary && text) {
+            client_send_shared(cli, text);
+            sent++;
+        } else {
+            missed_version(cli);
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+    trace_event(TRACE_BROADCAST, num, sent);
+
+    shared_release(replica);
+    shared_release(frame);
+    shared_release(text);
+    free(e.data);
+}
+
+/**
+ * The broadcasts of the versions after from up to to, in the framing of cli. Return NULL
+ * when the history no longer holds one of them, or when they would take more than limit
+ * bytes (the full copy is cheaper then).
+ */
+char* catch_up(client* cli, uint64_t from, uint64_t to, size_t limit, size_t* len) {
+    if (from > to) return NULL; // not a version of this document
+    uint64_t oldest, newest;
+    history* store = &cli->doc->history_store;
+    history_range(store, &oldest, &newest);
+    if (from < to && (from + 1 < oldest || to > newest)) return NULL;
+
+    text_buffer t = {NULL, 0, 0};
+    text_reserve(&t, 0);
+    for (uint64_t v = from + 1; t.data && v <= to; v++) {
+        history_entry e;
+        if (history_get(store, v, &e) != SUCCESS) {
+            free(t.data);
+            return NULL;
+        }
+        size_t message_len = 0;
+        char* message = version_message(v, &e, cli->binary, &message_len);
+        free(e.data);
+        text_reserve(&t, message_len);
+        if (!message || t.len + message_len > limit || t.len + message_len + 1 > t.cap) {
+            free(message);
+            free(t.data);
+            return NULL;
+        }
+        memcpy(t.data + t.len, message, message_len);
+        t.len += message_len;
+        free(message);
+    }
+    *len = t.len;
+    return t.data;
+}
+
+// === publisher ===
+/**
+ * Everything a tick leaves behind: reply to its failed commands, release them, publish
+ * the committed version and fan it out, then drain the output queues. It runs on the
+ * publisher thread while the next tick applies.
+ */
+static void publish_output(worker* w, tick_output* out) {
+    uint64_t started = stats_now_ns();
+    command* cur = out->commands;
+    while (cur) {
+        command* next_com = cur->next;
+        // queries answer themselves, failed edits get a message
+        if (cur->result != SUCCESS) message(cur->sender, cur->result, out->base);
+        release_command(cur);
+        cur = next_com;
+    }
+
+    // publish before the broadcast, so a client told about a version can read it
+    hosted_doc* d = out->doc;
+    if (out->view) {
+        if (d->published.header) {
+            snapshot_publish(&d->published, out->view->version, out->view->text, out->view->len);
+        }
+        uint64_t serialized = stats_now_ns();
+        broadcast_version(d, out->view->version, out->view->root);
+        hist_record(&w->publish_stats.broadcast, stats_now_ns() - serialized);
+        view_release(out->view);
+    }
+
+    // never blocks on a pipe
+    flush_clients(d);
+    hist_record(&w->publish_stats.publish, stats_now_ns() - started);
+}
+
+/**
+ * Wait for a free slot of the worker's publisher and hold it. The tick calls this under
+ * the document's version_lock, so a tick that committed is always counted by
+ * publish_drain.
+ */
+void publish_reserve(worker* w) {
+    pthread_mutex_lock(&w->publish_lock);
+    while (w->outputs_pending >= PUBLISH_DEPTH) {
+        pthread_cond_wait(&w->publish_done, &w->publish_lock);
+    }
+    w->outputs_pending++;
+    pthread_mutex_unlock(&w->publish_lock);
+}
+
+/**
+ * Hand a tick to the publisher, in the slot publish_reserve held. Ticks are published
+ * in order. Without memory for the hand over the tick is published right here.
+ */
+void publish_tick(worker* w, hosted_doc* d, command* commands, uint64_t base, doc_view* view) {
+    tick_output* out = malloc(sizeof(tick_output));
+    if (!out) {
+        tick_output local = {NULL, d, commands, base, view};
+        publish_output(w, &local);
+        pthread_mutex_lock(&w->publish_lock);
+        w->outputs_pending--;
+        pthread_cond_broadcast(&w->publish_done);
+        pthread_mutex_unlock(&w->publish_lock);
+        return;
+    }
+    out->next = NULL;
+    out->doc = d;
+    out->commands = commands;
+    out->base = base;
+    out->view = view;
+
+    pthread_mutex_lock(&w->publish_lock);
+    if (w->outputs_tail) {
+        w->outputs_tail->next = out;
+    } else {
+        w->outputs_head = out;
+    }
+    w->outputs_tail = out;
+    pthread_cond_signal(&w->publish_ready);
+    pthread_mutex_unlock(&w->publish_lock);
+}
+
+/**
+ * Wait until every tick the worker reserved has been published
+ */
+void publish_drain(worker* w) {
+    pthread_mutex_lock(&w->publish_lock);
+    while (w->outputs_pending > 0) {
+        pthread_cond_wait(&w->publish_done, &w->publish_lock);
+    }
+    pthread_mutex_unlock(&w->publish_lock);
+}
+
+// === stats ===
+/**
+ * Print every histogram, the threads' shards merged, and the bytes written to each
+ * client. Latencies are in microseconds.
+ */
+void stats_report(FILE* out) {
+    stats_shard* all = calloc(1, sizeof(stats_shard));
+    if (!all) return;
+    int backlog = 0;
+    for (int s = 0; s < 2 * workers_count + 1; s++) {
+        stats_shard* shard = s == 2 * workers_count ? &reader_stats
+                           : s % 2 ? &workers[s / 2].publish_stats : &workers[s / 2].tick_stats;
+        for (int i = 0; i < OP_COUNT; i++) hist_merge(&all->apply[i], &shard->apply[i]);
+        hist_merge(&all->queued, &shard->queued);
+        hist_merge(&all->tick, &shard->tick);
+        hist_merge(&all->tick_commands, &shard->tick_commands);
+        hist_merge(&all->increment, &shard->increment);
+        hist_merge(&all->publish, &shard->publish);
+        hist_merge(&all->broadcast, &shard->broadcast);
+    }
+    for (int i = 0; i < workers_count; i++) {
+        pthread_mutex_lock(&workers[i].publish_lock);
+        backlog += workers[i].outputs_pending;
+        pthread_mutex_unlock(&workers[i].publish_lock);
+    }
+
+    fprintf(out, "STATS publisher backlog %d\n", backlog);
+    if (follow_pid) {
+        fprintf(out, "standby of %d %s applied %lu\n", follow_pid,
+                atomic_load(&following) ? "following" : "took over", atomic_load(&standby_applied));
+    }
+    hist_print_header(out, "us");
+    hist_print(out, "tick", &all->tick, 1000);
+    hist_print(out, "queued", &all->queued, 1000);
+    hist_print(out, "increment_version", &all->increment, 1000);
+    hist_print(out, "publish", &all->publish, 1000);
+    hist_print(out, "broadcast", &all->broadcast, 1000);
+    if (follow_pid) hist_print(out, "replication", &standby_stats.replication, 1000);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (atomic_load(&all->apply[i].total) == 0) continue;
+        hist_print(out, i == OP_NONE ? "UNKNOWN" : op_name(i), &all->apply[i], 1000);
+    }
+    hist_print_header(out, "commands");
+    hist_print(out, "tick_commands", &all->tick_commands, 1);
+
+    pthread_mutex_lock(&documents_lock);
+    for (hosted_doc* d = documents; d; d = d->next) {
+        doc_view* view = view_acquire(d);
+        fprintf(out, "document %s version %lu length %zu worker %d\n", d->name, view->version, view->len,
+                d->worker->id);
+        view_release(view);
+    }
+    pthread_mutex_unlock(&documents_lock);
+
+    pthread_mutex_lock(&clients_lock);
+    for (client* cli = clients; cli; cli = cli->next) {
+        pthread_mutex_lock(&cli->out_lock);
+        fprintf(out, "client %s %s %s written %lu queued %zu pending %zu throttled %lu\n", cli->username,
+                cli->channel, cli->doc->name, cli->bytes_written, cli->out_bytes, atomic_load(&cli->queue_depth),
+                atomic_load(&cli->throttled));
+        pthread_mutex_unlock(&cli->out_lock);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    fprintf(out, "END\n");
+    fflush(out);
+    free(all);
+}
+
+/**
+ * Append a report to the stats file every stats_period seconds
+ */
+void* stats_thread(void* arg) {
+    (void)arg;
+    while (True) {
+        sleep(stats_period);
+        FILE* f = fopen(stats_file, "a");
+        if (!f) {
+            perror("stats file");
+            continue;
+        }
+        fprintf(f, "TIME %ld\n", (long)time(NULL));
+        stats_report(f);
+        fclose(f);
+    }
+    return NULL;
+}
+
+/**
+ * Dump the trace rings to TRACE_FILE on every SIGUSR2. The signal is blocked in every
+ * other thread, so the dump runs here and not in a signal handler.
+ */
+void* trace_signal_thread(void* arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    while (True) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        if (trace_dump(TRACE_FILE) != SUCCESS) perror("trace dump");
+    }
+    return NULL;
+}
+
+// === documents ===
+/**
+ * Host a new document, empty at version 0, on the worker with the fewest documents.
+ * Caller must hold documents_lock.
+ */
+static hosted_doc* create_document(const char* name) {
+    hosted_doc* d = calloc(1, sizeof(hosted_doc));
+    if (!d) return NULL;
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->engine = markdown_init();
+    d->current_version = calloc(1, sizeof(version));
+    if (!d->engine || !d->current_version ||
+        history_init(&d->history_store, history_entries, history_bytes, history_age) != SUCCESS) {
+        markdown_free(d->engine);
+        free(d->current_version);
+        free(d);
+        return NULL;
+    }
+    d->current_version->num = 1;
+    pthread_mutex_init(&d->version_lock, NULL);
+
+    // version 0 for queries and handshakes until the first commit
+    if (view_publish(d, d->engine) != SUCCESS) {
+        history_free(&d->history_store);
+        markdown_free(d->engine);
+        free(d->current_version);
+        free(d);
+        return NULL;
+    }
+
+    // the snapshot region is optional, readers fall back to DOC?
+    char region[64];
+    if (strcmp(name, DOCUMENT_DEFAULT) == 0) {
+        snprintf(region, sizeof(region), SNAPSHOT_NAME, getpid());
+    } else {
+        snprintf(region, sizeof(region), SNAPSHOT_DOCUMENT_NAME, getpid(), name);
+    }
+    if (snapshot_create(&d->published, region) != SUCCESS) {
+        perror("snapshot region");
+    }
+
+    worker* w = &workers[0];
+    for (int i = 1; i < workers_count; i++) {
+        if (workers[i].docs_count < w->docs_count) w = &workers[i];
+    }
+    d->worker = w;
+    d->next_in_worker = w->docs;
+    w->docs = d;
+    w->docs_count++;
+    d->next = documents;
+    documents = d;
+    documents_count++;
+    return d;
+}
+
+/**
+ * Find a document by name, hosting it on first use. Return NULL for a name that is not
+ * valid (the rules of a channel id), over DOCUMENTS_MAX, or out of memory.
+ */
+hosted_doc* open_document(const char* name) {
+    if (!valid_channel(name)) return NULL;
+    pthread_mutex_lock(&documents_lock);
+    hosted_doc* d = documents;
+    while (d && strcmp(d->name, name) != 0) d = d->next;
+    if (!d && documents_count < DOCUMENTS_MAX) d = create_document(name);
+    pthread_mutex_unlock(&documents_lock);
+    return d;
+}
+
+// === connection acceptor ===
+/**
+ * Handle one rendezvous request: CONNECT <channel> <username> [BINARY] [STANDBY] [LAYOUT]
+ * [RESUME <version>] [DOC <name>]. The client created the channel FIFOs and holds its
+ * ends open before asking, so every open here is non-blocking and a vanished or slow
+ * client never holds up the next request.
+ */
+void accept_client(char* request) {
+    char* save = NULL;
+    char* keyword = strtok_r(request, " ", &save);
+    char* channel = strtok_r(NULL, " ", &save);
+    char* username = strtok_r(NULL, " ", &save);
+    if (!keyword || strcmp(keyword, PROTOCOL_CONNECT) != 0 || !channel || !username || !valid_channel(channel)) {
+        return;
+    }
+    int binary = False; // binary framing after the handshake
+    int standby = False; // a standby server, it follows every document
+    int layout = False; // every copy of the document comes with its chunk layout
+    uint64_t resume_from = 0; // the version the client has cached
+    const char* name = DOCUMENT_DEFAULT;
+    for (char* word = strtok_r(NULL, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+        if (strcmp(word, PROTOCOL_BINARY) == 0) {
+            binary = True;
+        } else if (strcmp(word, PROTOCOL_STANDBY) == 0) {
+            standby = True;
+        } else if (strcmp(word, PROTOCOL_LAYOUT) == 0) {
+            layout = True;
+        } else if (strcmp(word, PROTOCOL_RESUME) == 0) {
+            char* num = strtok_r(NULL, " ", &save);
+            if (num) resume_from = strtoull(num, NULL, 10);
+        } else if (strcmp(word, PROTOCOL_DOCUMENT) == 0) {
+            char* named = strtok_r(NULL, " ", &save);
+            if (named) name = named;
+        }
+    }
+    if (standby) name = DOCUMENT_DEFAULT; // it follows them all, it is listed with the default one
+
+    char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
+    channel_fifos(channel, fifo_c2s, fifo_s2c);
+
+    // fails with ENXIO when the client is gone already
+    int fd_s2c = open(fifo_s2c, O_WRONLY | O_NONBLOCK);
+    if (fd_s2c < 0) return;
+
+    int role = get_user_role(username); // find aceess authority of the user
+
+    // not found in the document (a name too long for the client record is not in the
+    // roles file either), or asking for every document without being the standby user.
+    // The answer fits the empty pipe so it never blocks.
+    if (role == ROLE_NONE || strlen(username) >= USERNAME_LEN ||
+        (standby && strcmp(username, STANDBY_USER) != 0)) {
+        dprintf(fd_s2c, "Reject UNAUTHORISED\n");
+        close(fd_s2c);
+        unlink(fifo_c2s); unlink(fifo_s2c);
+        return;
+    }
+
+    // a name that is not a valid document, or one over the limit, is turned away
+    hosted_doc* d = open_document(name);
+    if (!d) {
+        dprintf(fd_s2c, "Reject INVALID_DOCUMENT\n");
+        close(fd_s2c);
+        unlink(fifo_c2s); unlink(fifo_s2c);
+        return;
+    }
+
+    // the client holds the write end already, so reads block instead of seeing EOF
+    int fd_c2s = open(fifo_c2s, O_RDONLY | O_NONBLOCK);
+    if (fd_c2s < 0) {
+        close(fd_s2c);
+        return;
+    }
+    fcntl(fd_c2s, F_SETFL, fcntl(fd_c2s, F_GETFL) & ~O_NONBLOCK);
+
+    // found in the document, init a client server
+    client* cli = init_client(channel, fd_c2s, fd_s2c, role);
+    if (!cli) {
+        close(fd_c2s); close(fd_s2c);
+        unlink(fifo_c2s); unlink(fifo_s2c);
+        return;
+    }
+    cli->binary = binary || standby;
+    cli->standby = standby;
+    cli->layout = layout;
+    cli->resume_from = resume_from;
+    cli->doc = d;
+    cli->id = next_client_id++;
+    strncpy(cli->username, username, sizeof(cli->username));
+    cli->username[sizeof(cli->username) - 1] = '\0';
+    pthread_mutex_lock(&roles_lock);
+    client_limits(cli);
+    pthread_mutex_unlock(&roles_lock);
+
+    // the thread id must be valid before the timing thread can see the client, and the
+    // client must be in the list before its thread can take it out again
+    pthread_mutex_lock(&clients_lock);
+    if (pthread_create(&cli->thread, NULL, client_thread, cli) != 0) {
+        pthread_mutex_unlock(&clients_lock);
+        close(fd_c2s); close(fd_s2c);
+        free_client(cli);
+        return;
+    }
+    pthread_detach(cli->thread); // auto detect and end of the thread and clean it
+    cli->next = clients;
+    clients = cli;
+    pthread_mutex_unlock(&clients_lock);
+    trace_event(TRACE_CONNECT, cli->id, (uint32_t)role);
+}
+
+// === role reload ===
+/**
+ * Bring the connected clients of a document in line with the role table. A client whose
+ * role changed gets the PERM? answer with its new role, a client that was removed is told
+ * it is unauthorised and disconnected, and every token bucket takes the new limits.
+ * Called by the timing thread under the document's version_lock, so a role never changes
+ * in the middle of a tick.
+ */
+void apply_roles(hosted_doc* d) {
+    pthread_mutex_lock(&roles_lock);
+    if (d->roles_applied == roles_generation) {
+        pthread_mutex_unlock(&roles_lock);
+        return;
+    }
+    d->roles_applied = roles_generation;
+    d->roles_epoch++; // commands authorized before this are checked again
+
+    pthread_mutex_lock(&clients_lock);
+    for (client* cli = clients; cli; cli = cli->next) {
+        if (!cli->online || cli->doc != d) continue;
+        int role = roles_lookup(role_table, cli->username);
+
+        if (role == ROLE_NONE) {
+            pthread_mutex_lock(&cli->out_lock);
+            out_drop(cli);
+            if (cli->binary) {
+                op o = {.opcode = OP_RESULT, .args = {RESULT_UNAUTHORISED, 0}};
+                size_t len;
+                unsigned char* frame = frame_build(&o, &len);
+                if (frame) out_append(cli, (const char*)frame, len);
+                free(frame);
+            } else {
+                const char* msg = "Reject UNAUTHORISED\n";
+                out_append(cli, msg, strlen(msg));
+            }
+            pthread_mutex_unlock(&cli->out_lock);
+
+            // the last write is best effort, the pipe is closed right after it
+            client_flush(cli);
+            pthread_mutex_lock(&cli->out_lock);
+            kick_client(cli);
+            pthread_mutex_unlock(&cli->out_lock);
+        } else {
+            if (role != atomic_load(&cli->role)) {
+                atomic_store(&cli->role, role);
+                handle_perm(cli, NULL);
+            }
+            client_limits(cli); // the line of the user or the role may have changed
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+    pthread_mutex_unlock(&roles_lock);
+}
+
+/**
+ * Load roles.txt into a new table and replace the current one. A file that can not be
+ * read keeps the current table, and so does an empty one: it is far more likely a file
+ * caught in the middle of being written than a wish to disconnect every user.
+ */
+static void reload_roles() {
+    roles* table = roles_load(ROLES_FILE);
+    if (!table) return;
+    if (table->count == 0 && role_table) {
+        fprintf(stderr, "%s has no users, keeping the current roles\n", ROLES_FILE);
+        roles_free(table);
+        return;
+    }
+
+    pthread_mutex_lock(&roles_lock);
+    roles* old = role_table;
+    role_table = table;
+    roles_generation++;
+    pthread_mutex_unlock(&roles_lock);
+
+    roles_free(old);
+}
+
+/**
+ * Watch the directory of roles.txt and reload it whenever it is written and closed, or
+ * renamed into place (editors usually save by renaming a new file over the old one). A
+ * file that was just created may still be empty, its close brings the reload.
+ */
+void* roles_thread(void* arg) {
+    (void)arg;
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("inotify");
+        return NULL;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (True) {
+        ssize_t len = read(fd, events, sizeof(events));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            break;
+        }
+
+        // one reload per batch of events is enough
+        int changed = False;
+        for (char* p = events; p < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len > 0 && strcmp(event->name, ROLES_FILE) == 0) changed = True;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed) reload_roles();
+    }
 
-// === Main ===
-int main(int argc, char* argv[]) {
-    // FIX: Ensure correct parameter checking for the server
-    if (argc < 2) { 
-        fprintf(stderr, "Usage: %s <time_interval_ms>\n", argv[0]); 
-        return 1;
+    close(fd);
+    return NULL;
+}
+
+// === Thread function DEFINITIONS ===
+/**
+ * Queue the handshake of a client: its role line and the last committed version of its
+ * document, or the versions since the one it holds
+ */
+static void client_welcome(client* cli) {
+    // get the current content from doc and send message to client as required
+    // the handshake is queued without the byte budget, it is needed in full. The view is
+    // taken under out_lock, so a broadcast is either left out (the view has it) or queued
+    // after the handshake.
+    pthread_mutex_lock(&cli->out_lock);
+    doc_view* view = view_acquire(cli->doc); // the last committed version, never waits for a tick
+    const char* content = view->text;
+    uint64_t snapshot_version = view->version;
+    size_t len = view->len;
+
+    // a client that holds an older version gets the versions since instead of the content
+    size_t catch_up_len = 0;
+    char* versions = cli->resume_from ? catch_up(cli, cli->resume_from, view->version, len, &catch_up_len) : NULL;
+    if (versions) {
+        snapshot_version = cli->resume_from;
+        len = 0;
     }
+
+    // readers are told where the published snapshot is, so they can read it themselves
+    char region[80] = "";
+    if (atomic_load(&cli->role) == ROLE_READ && cli->doc->published.header) {
+        snprintf(region, sizeof(region), " %s %s", PROTOCOL_SNAPSHOT, cli->doc->published.name);
+    }
+    // the layout of the content follows it on a line of its own
+    int layout = cli->layout && !versions;
+    char header[160];
+    int header_len = snprintf(header, sizeof(header), "%s%s%s%s%s\n%lu\n%lu\n", role_name(atomic_load(&cli->role)),
+                              cli->binary ? " " PROTOCOL_BINARY : "", region, versions ? " " PROTOCOL_RESUME : "",
+                              layout ? " " PROTOCOL_LAYOUT : "", snapshot_version, len);
+    out_append(cli, header, header_len); // role (binary framing, snapshot region, resume, layout), version, len
+    out_append(cli, content, len); // content
     
-    int time_interval = atoi(argv[1]); // get the time interval
-    if (time_interval <= 0) time_interval = 100; // Sanity check
+    // FIX: Send a newline separator to handle client fread/fgets transition
+    out_append(cli, "\n", 1); 
+    if (layout) {
+        out_append(cli, view->layout, view->layout_len);
+        out_append(cli, "\n", 1);
+    }
+    if (versions) out_append(cli, versions, catch_up_len);
+    cli->welcomed = True;
+    pthread_mutex_unlock(&cli->out_lock);
+    client_flush(cli);
     
-    printf("Server PID: %d\n", getpid()); // send pid
+    free(versions);
+    view_release(view);
+}
 
-    doc = markdown_init();
+/**
+ * Queue the handshake of a standby: "<role> BINARY STANDBY\n", then one OP_REPLICA_DOC
+ * frame with the last committed version of every document. Taken under out_lock like a
+ * client's, so a version is in a snapshot, or queued after them, or both; the standby
+ * skips the versions it has already.
+ */
+static void standby_welcome(client* cli) {
+    pthread_mutex_lock(&cli->out_lock);
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "%s %s %s\n", role_name(atomic_load(&cli->role)), PROTOCOL_BINARY,
+                              PROTOCOL_STANDBY);
+    out_append(cli, header, header_len);
+    pthread_mutex_lock(&documents_lock);
+    for (hosted_doc* d = documents; d; d = d->next) {
+        doc_view* view = view_acquire(d);
+        size_t len = 0;
+        char* frame = replica_copy(d, view, &len);
+        view_release(view);
+        if (!frame) {
+            kick_client(cli); // a standby missing a document would diverge
+            break;
+        }
+        out_append(cli, frame, len);
+        free(frame);
+    }
+    pthread_mutex_unlock(&documents_lock);
+    cli->welcomed = True;
+    pthread_mutex_unlock(&cli->out_lock);
+    client_flush(cli);
+}
 
-    // create the first version;
-    versions = malloc(sizeof(version));
-    if (!versions) return 1; // Handle malloc failure
-    current_version = versions;
-    versions->num = 1;
-    versions->next = NULL;
-    versions->head = NULL;
+/**
+ * Answer a standby that asked for one document again (OP_REPLICA_DOC with its name) with
+ * the last committed version, taken under out_lock like standby_welcome. Called by the
+ * standby's reader thread.
+ */
+void standby_resend(client* cli, const op* o) {
+    char name[CHANNEL_MAX];
+    if (o->len == 0 || o->len >= sizeof(name)) return;
+    memcpy(name, o->payload, o->len);
+    name[o->len] = '\0';
+
+    // only a document that exists, a standby never creates one on the primary
+    pthread_mutex_lock(&documents_lock);
+    hosted_doc* d = documents;
+    while (d && strcmp(d->name, name) != 0) d = d->next;
+    pthread_mutex_unlock(&documents_lock);
+    if (!d) return;
+
+    pthread_mutex_lock(&cli->out_lock);
+    doc_view* view = view_acquire(d);
+    size_t len = 0;
+    char* frame = replica_copy(d, view, &len);
+    view_release(view);
+    if (!frame) {
+        kick_client(cli); // it would wait for the copy forever, it starts over instead
+    } else if (!cli->kicked) {
+        out_append(cli, frame, len);
+    }
+    free(frame);
+    pthread_mutex_unlock(&cli->out_lock);
+}
 
-    // start the console thread
-    pthread_t console_thread_id;
-    pthread_create(&console_thread_id, NULL, console_thread, NULL);
+/**
+ * This is a client thread fucntion, used to recieve meassgae from client and write to the command list
+ */
+void* client_thread(void* c) {
+    client* cli = (client*)c; // get the client struct
+    trace_thread("client");
 
-    // start the timing thread
-    pthread_t timing_thread_id;
-    int* buffer = malloc(sizeof(int));
-    if (!buffer) return 1; // Handle malloc failure
-    *buffer = time_interval;
-    pthread_create(&timing_thread_id, NULL, timing_thread, buffer);
+    if (cli->standby) {
+        standby_welcome(cli);
+    } else {
+        client_welcome(cli);
+    }
 
-    // siginal
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGRTMIN);
-    sigprocmask(SIG_BLOCK, &mask, NULL);
+    // returns on DISCONNECT as well as on a closed pipe, the teardown is the same
+    read_commands(cli);
 
-    while (True) {
-        siginfo_t info;
-        sigwaitinfo(&mask, &info); // block the server unitll someone is trying to connect
+    // Handle case where client pipe is closed unexpectedly (e.g. client close(fd_c2s))
+    pthread_mutex_lock(&clients_lock);
+    cli->online = False;
+    pthread_mutex_unlock(&clients_lock);
 
-        if (online == False) continue; // don't create new client when quit is set, stay until exit(0)
+    // commands still waiting for a tick point at the client and into its ring. The tick
+    // signals space on every release; the timeout only bounds a missed wakeup.
+    in_ring* r = &cli->in;
+    pthread_mutex_lock(&r->lock);
+    while (r->inflight_head) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 100 * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&r->space, &r->lock, &until);
+    }
+    pthread_mutex_unlock(&r->lock);
+    remove_client(cli);
 
-        // init
-        pid_t pid = info.si_pid; // get pid
-        char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN]; // create fd
-        // FIX: Check if FIFO creation succeeded
-        if (!create_fifos(pid, fifo_c2s, fifo_s2c)) { 
-            perror("mkfifo failed");
-            continue;
+    // close and unlink
+    close(cli->fd_c2s);
+    if (cli->fd_s2c >= 0) close(cli->fd_s2c);
+    
+    char fifo_c2s[FIFO_NAME_LEN], fifo_s2c[FIFO_NAME_LEN];
+    channel_fifos(cli->channel, fifo_c2s, fifo_s2c);
+    unlink(fifo_c2s);
+    unlink(fifo_s2c);
+    trace_event(TRACE_DISCONNECT, cli->id, 0);
+    free_client(cli);
+    trace_thread_exit();
+    
+    return NULL;
+}
+
+/**
+ * Refill the token buckets of the active clients for the time since their last refill
+ */
+static void refill_buckets(hosted_doc* d, uint64_t now) {
+    for (client* cli = d->active_head; cli; cli = cli->next_active) {
+        if (cli->rate > 0) {
+            cli->tokens += cli->rate * (double)(now - cli->refilled_ns) / 1e9;
+            if (cli->tokens > cli->burst) cli->tokens = cli->burst;
+        }
+        cli->refilled_ns = now;
+    }
+}
+
+/**
+ * Take the commands of this tick off the client queues: one per active client and round,
+ * until tick_budget commands are taken or every queue is empty or out of tokens. The next
+ * tick starts the round with the client the budget stopped at. Return the commands in the
+ * order they are to be applied. Caller must hold the document's version_lock.
+ */
+static command* tick_take(hosted_doc* d, uint64_t now) {
+    refill_buckets(d, now);
+
+    command* head = NULL;
+    command* tail = NULL;
+    size_t taken = 0;
+    int progress = False; // the running round took a command
+    client* prev = NULL;
+    client* cli = d->active_head;
+    while (cli && (tick_budget == 0 || taken < tick_budget)) {
+        if (cli->rate == 0 || cli->tokens >= 1) {
+            command* com = cli->queue_head;
+            cli->queue_head = com->next;
+            if (!cli->queue_head) cli->queue_tail = NULL;
+            atomic_fetch_sub(&cli->queue_depth, 1);
+            if (cli->rate > 0) cli->tokens -= 1;
+            com->next = NULL;
+            if (tail) {
+                tail->next = com;
+            } else {
+                head = com;
+            }
+            tail = com;
+            taken++;
+            progress = True;
+        }
+
+        client* next = cli->next_active;
+        if (!cli->queue_head) {
+            // idle again, it leaves the round
+            if (prev) {
+                prev->next_active = next;
+            } else {
+                d->active_head = next;
+            }
+            if (d->active_tail == cli) d->active_tail = prev;
+            cli->active = False;
+            cli->next_active = NULL;
+        } else {
+            prev = cli;
+        }
+        cli = next;
+
+        if (!cli && progress) {
+            // another round
+            progress = False;
+            prev = NULL;
+            cli = d->active_head;
         }
+    }
+
+    // the clients before the one the budget stopped at go to the back
+    if (cli && prev) {
+        d->active_tail->next_active = d->active_head;
+        d->active_head = cli;
+        prev->next_active = NULL;
+        d->active_tail = prev;
+    }
 
-        kill(pid, SIGRTMIN + 1); // send signal to client
+    // a client still active with an empty bucket was held back by its limit
+    for (client* held = d->active_head; held; held = held->next_active) {
+        if (held->rate > 0 && held->tokens < 1) atomic_fetch_add(&held->throttled, 1);
+    }
+    return head;
+}
 
-        // FIX: Check for open errors
-        int fd_c2s = open(fifo_c2s, O_RDONLY);
-        if (fd_c2s < 0) {
-            perror("open C2S failed");
-            unlink(fifo_c2s); unlink(fifo_s2c);
+/**
+ * One tick of a document: apply its commands, commit, and hand the latest version to the
+ * worker's publisher, which broadcasts it while the next tick runs
+ */
+static void tick_document(worker* w, hosted_doc* d) {
+    pthread_mutex_lock(&d->version_lock); // acquire the lock for the command line
+    document* doc = d->engine; // a standby replaces it when it loads a snapshot
+    version* current_version = d->current_version;
+
+    // a reloaded roles.txt takes effect between ticks
+    apply_roles(d);
+
+    uint64_t tick_start = stats_now_ns();
+    command* head = tick_take(d, tick_start);
+    command* cur = head;
+    uint64_t last = tick_start; // end of the previous command, start of the next
+    uint64_t count = 0;
+    int kept = True; // every edit of the tick is in tick_ops
+    int recorded = d == default_doc && recording.file; // the recording holds one document
+    if (head) trace_event(TRACE_TICK_BEGIN, 0, 0);
+
+    // Deal with all the command
+    while(cur){
+        if (cur->is_finish == True){
+            cur = cur->next;
             continue;
         }
-        int fd_s2c = open(fifo_s2c, O_WRONLY); // open two fds
-        if (fd_s2c < 0) {
-            perror("open S2C failed");
-            close(fd_c2s);
-            unlink(fifo_c2s); unlink(fifo_s2c);
+
+        // --- Command Processing Block ---
+        hist_record(&w->tick_stats.queued, last > cur->queued_ns ? last - cur->queued_ns : 0);
+        trace_event(TRACE_APPLY_BEGIN, cur->sender->id, (uint32_t)cur->op.opcode);
+        int result = apply_command(cur);
+        trace_event(TRACE_APPLY_END, cur->sender->id, (uint32_t)result);
+        if (recorded && apply_is_edit(cur->op.opcode) && result != REJECTED && cur->parse_error == SUCCESS) {
+            record_op(&recording, &cur->op, current_version->num, result); // it reached the document
+        }
+        uint64_t done = stats_now_ns();
+        int opcode = cur->op.opcode > OP_NONE && cur->op.opcode < OP_COUNT ? cur->op.opcode : OP_NONE;
+        hist_record(&w->tick_stats.apply[opcode], done - last);
+        last = done;
+        count++;
+
+        // edits are kept in the history, queries are not
+        if (cur->op.opcode > OP_NONE && cur->op.opcode < OP_COUNT &&
+            command_table[cur->op.opcode].role == ROLE_WRITE) {
+            if (builder_add(&d->tick_ops, cur->sender->username, &cur->op, result_code(result)) != SUCCESS) {
+                kept = False;
+            }
+        }
+
+        // the publisher replies to failed edits
+        cur->result = result;
+
+        // Mark as finish
+        cur->is_finish = True;
+        cur = cur->next;
+    } // End of command processing loop
+
+    // the commands go to the publisher, which releases them after replying
+    uint64_t base = doc->version;
+
+    // increment the version, the ops of the tick go into the history
+    int committed = False;
+    if (doc->is_modify == MODIFIED) {
+        uint64_t started = stats_now_ns();
+        markdown_increment_version(doc);
+        hist_record(&w->tick_stats.increment, stats_now_ns() - started);
+        current_version->num++;
+        // a version missing an op, or missing altogether, would leave a gap where the
+        // history holds consecutive versions: it starts over after this one, which the
+        // publisher sends as a copy
+        if (!kept || history_commit(&d->history_store, &d->tick_ops, doc->version) != SUCCESS) {
+            builder_reset(&d->tick_ops);
+            history_clear(&d->history_store);
+        }
+        trace_event(TRACE_COMMIT, doc->version, 0);
+        committed = True;
+    } else {
+        builder_reset(&d->tick_ops);
+    }
+    if (recorded) record_tick(&recording, doc->version, committed);
+
+    if (head) trace_event(TRACE_TICK_END, count, 0);
+    if (count > 0) {
+        hist_record(&w->tick_stats.tick, stats_now_ns() - tick_start);
+        hist_record(&w->tick_stats.tick_commands, count);
+    }
+
+    // hold a publisher slot before letting go, so QUIT can wait for this tick
+    publish_reserve(w);
+    pthread_mutex_unlock(&d->version_lock);
+
+    // the view is copied here, before the next tick changes the document. Only this
+    // thread changes the document, so it is read here without the lock.
+    doc_view* view = NULL;
+    if (committed && view_publish(d, doc) == SUCCESS) {
+        view = view_acquire(d);
+    }
+    publish_tick(w, d, head, base, view);
+}
+
+/**
+ * This is a timing thread fucntion, one per worker. Each time interval, tick every
+ * document of the worker in turn
+ */
+void* timing_thread(void* arg) {
+    worker* w = (worker*)arg;
+    char name[TRACE_NAME];
+    snprintf(name, sizeof(name), "timing %d", w->id);
+    trace_thread(name);
+
+    while (True) {
+        usleep(w->interval * 1000);
+
+        // documents are only ever prepended, the rest of the list does not change
+        pthread_mutex_lock(&documents_lock);
+        hosted_doc* docs = w->docs;
+        pthread_mutex_unlock(&documents_lock);
+        for (hosted_doc* d = docs; d; d = d->next_in_worker) {
+            tick_document(w, d);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * This is the publisher thread function, one per worker. It serializes and fans out
+ * version N while the timing thread applies version N+1.
+ */
+void* publish_thread(void* arg) {
+    worker* w = (worker*)arg;
+    char name[TRACE_NAME];
+    snprintf(name, sizeof(name), "publisher %d", w->id);
+    trace_thread(name);
+    while (True) {
+        pthread_mutex_lock(&w->publish_lock);
+        while (!w->outputs_head) {
+            pthread_cond_wait(&w->publish_ready, &w->publish_lock);
+        }
+        tick_output* out = w->outputs_head;
+        w->outputs_head = out->next;
+        if (!w->outputs_head) w->outputs_tail = NULL;
+        pthread_mutex_unlock(&w->publish_lock);
+
+        publish_output(w, out);
+        free(out);
+
+        pthread_mutex_lock(&w->publish_lock);
+        w->outputs_pending--;
+        pthread_cond_broadcast(&w->publish_done);
+        pthread_mutex_unlock(&w->publish_lock);
+    }
+    return NULL;
+}
+
+
+// === console thread ===
+/**
+ * This function is used to keep listen the quit command and exit the program gracefully
+ */
+void* console_thread(void* arg) {
+    char line[64];
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (strcmp(line, "STATS") == 0) {
+            stats_report(stdout);
             continue;
         }
 
-        char temp[64];
-        // Read client username (first message sent to server)
-        ssize_t len = read(fd_c2s, temp, sizeof(temp) - 1);
-        if (len <= 0) {
-            close(fd_c2s); close(fd_s2c);
-            unlink(fifo_c2s); unlink(fifo_s2c);
+        // TRACE [file]: dump the trace rings
+        if (strncmp(line, "TRACE", 5) == 0 && (line[5] == '\0' || line[5] == ' ')) {
+            const char* path = line[5] == ' ' && line[6] ? line + 6 : TRACE_FILE;
+            if (trace_dump(path) == SUCCESS) {
+                printf("TRACE %s\n", path);
+            } else {
+                perror("trace dump");
+            }
+            fflush(stdout);
             continue;
         }
 
-        temp[len] = '\0'; // make it a string to use the strcspn function below
-        temp[strcspn(temp, "\n")] = '\0'; // remove all the newline
+        if (strcmp(line, "QUIT") == 0) {
+            // determine if there is any client online, a standby does not hold the server up
+            pthread_mutex_lock(&clients_lock);
+            int count = 0;
+            client* c = clients;
+            while (c) {
+                if (!c->standby) count++;
+                c = c->next;
+            }
+
+            // stop the server in the critical section
+            if (count == 0){
+                online = False;
+            }
 
-        const char* role = get_user_role(temp); // find aceess authority of the user 
-        
-        // not found in the document
-        if (!role) {
-            dprintf(fd_s2c, "Reject UNAUTHORISED\n");
-            // Give time for client to receive and read
-            sleep(1); 
+            pthread_mutex_unlock(&clients_lock);
             
-            // close fd and unlink fifo
-            close(fd_c2s); close(fd_s2c);
-            unlink(fifo_c2s); unlink(fifo_s2c);
-            continue;
+            if (count > 0) {
+                printf("QUIT rejected, %d clients still connected.\n", count);
+                continue;
+            }
+
+            // a standby told the primary quits does not take over, it gets the time a
+            // CONNECT has to read up to the goodbye. clients_lock is only held for a pass
+            // over the list, a standby that goes away meanwhile leaves it.
+            pthread_mutex_lock(&clients_lock);
+            for (c = clients; c; c = c->next) {
+                op bye = {.opcode = OP_DISCONNECT};
+                if (c->standby) client_send_frame(c, &bye);
+            }
+            pthread_mutex_unlock(&clients_lock);
+            for (int waited = 0; waited < STANDBY_TIMEOUT_MS; waited++) {
+                int left = False;
+                pthread_mutex_lock(&clients_lock);
+                for (c = clients; c; c = c->next) {
+                    if (!c->standby) continue;
+                    client_flush(c);
+                    pthread_mutex_lock(&c->out_lock);
+                    if (c->out_head && !c->kicked) left = True;
+                    pthread_mutex_unlock(&c->out_lock);
+                }
+                pthread_mutex_unlock(&clients_lock);
+                if (!left) break;
+                usleep(1000);
+            }
+
+            // clean all pipes
+            system("rm -f FIFO_C2S_* FIFO_S2C_*");
+            unlink(rendezvous);
+
+            // no tick starts once every document is locked, the last ones still read the
+            // histories and the regions
+            pthread_mutex_lock(&documents_lock);
+            for (hosted_doc* d = documents; d; d = d->next) pthread_mutex_lock(&d->version_lock);
+            for (int i = 0; i < workers_count; i++) publish_drain(&workers[i]);
+
+            // every client is gone, so are its queued commands
+            for (hosted_doc* d = documents; d; d = d->next) free(d->current_version);
+            // the descriptors live in slabs
+            while (command_slabs) {
+                command_slab* next_slab = command_slabs->next;
+                free(command_slabs);
+                command_slabs = next_slab;
+            }
+            command_pool = NULL;
+            record_close(&recording);
+
+            // save every document as <name>.md, the default one is doc.md
+            for (hosted_doc* d = documents; d; d = d->next) {
+                snapshot_destroy(&d->published);
+                history_free(&d->history_store);
+                view_release(d->latest_view);
+                d->latest_view = NULL;
+                builder_free(&d->tick_ops);
+
+                char path[CHANNEL_MAX + 4];
+                snprintf(path, sizeof(path), "%s.md", d->name);
+                char* content = markdown_flatten(d->engine);
+                FILE* f = fopen(path, "w");
+                if (f) {
+                    fwrite(content, 1, strlen(content), f);
+                    fclose(f);
+                }
+                free(content);
+                markdown_free(d->engine);
+            }
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+
+// === standby ===
+/**
+ * Publish what the standby applied, for queries and local readers once it takes over
+ */
+static void standby_publish(hosted_doc* d) {
+    document* doc = d->engine; // only this thread changes the document while following
+    if (view_publish(d, doc) != SUCCESS) return;
+    if (d->published.header) {
+        doc_view* view = view_acquire(d);
+        snapshot_publish(&d->published, view->version, view->text, view->len);
+        view_release(view);
+    }
+}
+
+/**
+ * Replace a document with a snapshot of the primary, its chunks laid out as layout says.
+ * The history is kept when the snapshot is the version it ends with, a standby that starts
+ * over usually is.
+ */
+static int standby_load(hosted_doc* d, uint64_t num, const char* text, size_t len, const char* layout) {
+    document* loaded = markdown_load(text, len, layout, num);
+    if (!loaded) return REJECTED;
+    pthread_mutex_lock(&d->version_lock);
+    if (num != d->engine->version) history_clear(&d->history_store); // versions follow on in a history
+    markdown_free(d->engine);
+    d->engine = loaded;
+    d->current_version->num = num + 1;
+    builder_reset(&d->tick_ops);
+    pthread_mutex_unlock(&d->version_lock);
+    standby_publish(d);
+    return SUCCESS;
+}
+
+typedef struct standby_apply_state {
+    hosted_doc* doc;
+    int diverged;
+    int kept; // every op is in tick_ops
+} standby_apply_state;
+
+/**
+ * Apply one op of a version of the primary. Only the edits that succeeded there changed
+ * its document, every op goes into the history as it was.
+ */
+static void standby_op(const char* user, const op* o, int result, void* arg) {
+    standby_apply_state* state = (standby_apply_state*)arg;
+    hosted_doc* d = state->doc;
+    if (builder_add(&d->tick_ops, user, o, result) != SUCCESS) state->kept = False;
+    if (result == RESULT_SUCCESS && apply_op(d->engine, d->current_version->num, o) != SUCCESS) {
+        state->diverged = True;
+    }
+}
+
+/**
+ * Commit version num of the primary with the same number. A version the standby has
+ * already is skipped; one that does not follow on, does not apply cleanly or leaves
+ * another text than the primary's (root) is REJECTED.
+ */
+static int standby_apply(hosted_doc* d, uint64_t num, uint64_t root, const unsigned char* entry, size_t len) {
+    pthread_mutex_lock(&d->version_lock);
+    document* doc = d->engine;
+    if (num <= doc->version) {
+        pthread_mutex_unlock(&d->version_lock);
+        return SUCCESS;
+    }
+    standby_apply_state state = {d, False, True};
+    int result = REJECTED;
+    if (num == doc->version + 1 && history_decode(entry, len, standby_op, &state) >= 0 && !state.diverged) {
+        markdown_increment_version(doc);
+        if (doc->version == num && merkle_root(doc->hashes) == root) {
+            d->current_version->num++;
+            // like a tick of the primary, a version the history can not keep starts it over
+            if (!state.kept || history_commit(&d->history_store, &d->tick_ops, num) != SUCCESS) {
+                history_clear(&d->history_store);
+            }
+            result = SUCCESS;
         }
+    }
+    builder_reset(&d->tick_ops);
+    pthread_mutex_unlock(&d->version_lock);
+    if (result == SUCCESS) standby_publish(d);
+    return result;
+}
+
+/**
+ * One subscription to the primary: connect as a standby, load the snapshots of every
+ * document and apply the versions that follow until the stream ends. Return
+ * STANDBY_QUIT when the primary said goodbye or turned the standby away, STANDBY_LOST
+ * otherwise.
+ */
+static int standby_session(int pid) {
+    // a new channel each time, the primary may still be closing the last one
+    static unsigned sessions = 0;
+    char channel[CHANNEL_MAX];
+    snprintf(channel, sizeof(channel), "standby_%d_%u", getpid(), sessions++);
+    int fd_c2s, fd_s2c;
+    if (channel_connect(pid, channel, STANDBY_USER, NULL, CONNECT_STANDBY, 0, STANDBY_TIMEOUT_MS, &fd_c2s,
+                        &fd_s2c) != SUCCESS) {
+        return STANDBY_LOST;
+    }
+    FILE* in = fdopen(fd_s2c, "r");
+    if (!in) {
+        close(fd_c2s);
+        close(fd_s2c);
+        return STANDBY_LOST;
+    }
+
+    int result = STANDBY_LOST;
+    char line[64];
+    if (fgets(line, sizeof(line), in) && strncmp(line, "Reject", 6) == 0) {
+        fprintf(stderr, "standby: %s", line);
+        result = STANDBY_QUIT;
+    }
 
-        // found in the document, init a client server
-        client* cli = init_client(pid, fd_c2s, fd_s2c, role);
-        if (!cli) {
-            close(fd_c2s); close(fd_s2c);
-            unlink(fifo_c2s); unlink(fifo_s2c);
+    unsigned char* buffer = NULL;
+    size_t cap = 0;
+    op o;
+    while (result == STANDBY_LOST && frame_read(in, &buffer, &cap, &o) == SUCCESS) {
+        if (o.opcode == OP_DISCONNECT) {
+            result = STANDBY_QUIT;
+            break;
+        }
+        if (o.opcode != OP_REPLICA_DOC && o.opcode != OP_REPLICA_VERSION) continue; // PERM? answers
+        if (o.args[0] == 0 || o.args[0] >= CHANNEL_MAX || o.args[0] > o.len) break;
+        char name[CHANNEL_MAX];
+        memcpy(name, o.payload, o.args[0]);
+        name[o.args[0]] = '\0';
+        hosted_doc* d = open_document(name);
+        if (!d) break;
+
+        const char* body = o.payload + o.args[0];
+        size_t body_len = o.len - o.args[0];
+        if (o.opcode == OP_REPLICA_DOC) {
+            // the content, then its layout (arg1 long)
+            if (o.args[1] > body_len) break;
+            char* layout = strndup(body + body_len - o.args[1], o.args[1]);
+            int loaded = layout && standby_load(d, o.version, body, body_len - o.args[1], layout) == SUCCESS;
+            free(layout);
+            if (!loaded) break;
+            d->replica_stale = False;
+            continue;
+        }
+        if (d->replica_stale) continue; // versions before the fresh copy are in it
+        if (body_len < REPLICA_ROOT_BYTES) break;
+        uint64_t root = 0;
+        for (int i = REPLICA_ROOT_BYTES - 1; i >= 0; i--) root = root << 8 | (unsigned char)body[i];
+
+        // out of step: drop the document and ask for the primary's copy, the other
+        // documents go on
+        if (standby_apply(d, o.version, root, (const unsigned char*)body + REPLICA_ROOT_BYTES,
+                          body_len - REPLICA_ROOT_BYTES) != SUCCESS) {
+            fprintf(stderr, "standby: %s diverged at version %lu, asking for a copy\n", name, o.version);
+            op ask = {.opcode = OP_REPLICA_DOC, .payload = name, .len = strlen(name)};
+            size_t ask_len;
+            unsigned char* frame = frame_build(&ask, &ask_len);
+            int sent = frame && write(fd_c2s, frame, ask_len) == (ssize_t)ask_len;
+            free(frame);
+            if (!sent) break; // starts over from every snapshot
+            d->replica_stale = True;
             continue;
         }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+        hist_record(&standby_stats.replication, now_ns > o.args[1] ? now_ns - o.args[1] : 0);
+        atomic_fetch_add(&standby_applied, 1);
+    }
 
-        // FIX: Must protect the clients linked list modification
-        pthread_mutex_lock(&clients_lock);
-        cli->next = clients;
-        clients = cli;
-        pthread_mutex_unlock(&clients_lock);
+    free(buffer);
+    fclose(in);
+    close(fd_c2s);
+    return result;
+}
+
+/**
+ * Stand by for the primary: mirror its documents until it goes away. A standby that was
+ * closed or fell out of step while the primary lives connects again and starts over.
+ * Return True when the primary crashed and this server takes over, False when it quit.
+ */
+static int follow_primary(int pid) {
+    char path[FIFO_NAME_LEN];
+    snprintf(path, sizeof(path), FIFO_SERVER, pid);
+    atomic_store(&following, True);
+    while (standby_session(pid) == STANDBY_LOST) {
+        // a live primary holds its rendezvous FIFO open for reading, one that crashed left
+        // it without a reader and one that quit removed it
+        int fd = open(path, O_WRONLY | O_NONBLOCK);
+        if (fd >= 0) {
+            close(fd);
+        } else if (errno == ENXIO) {
+            atomic_store(&following, False);
+            return True;
+        } else {
+            return False;
+        }
+        usleep(STANDBY_RETRY_MS * 1000);
+    }
+    return False;
+}
+
+// === Main ===
+/**
+ * Used to interrupt a waiting client thread, its ppoll just returns EINTR
+ */
+void handle_kick(int sig) {
+    (void)sig;
+}
+
+int main(int argc, char* argv[]) {
+    // options: -q <queue_bytes> -t <stall_ms> -p <resync|disconnect>
+    //          -H <history_entries> -B <history_bytes> -A <history_age_s>
+    //          -s <stats_file> -S <stats_period_s> -r <recording> -w <workers>
+    //          -b <tick_budget> -l <read|write:rate[:burst]> -F <primary_pid>
+    int opt;
+    char* record_path = NULL;
+    while ((opt = getopt(argc, argv, "q:t:p:H:B:A:s:S:r:w:b:l:F:")) != -1) {
+        char role[8];
+        double rate, burst = 0;
+        if (opt == 'F') {
+            follow_pid = atoi(optarg);
+        } else if (opt == 'b') {
+            tick_budget = strtoul(optarg, NULL, 10);
+        } else if (opt == 'l' && sscanf(optarg, "%7[a-z]:%lf:%lf", role, &rate, &burst) >= 2 &&
+                   (strcmp(role, "read") == 0 || strcmp(role, "write") == 0) && rate >= 0) {
+            int index = strcmp(role, "write") == 0;
+            role_rate[index] = rate;
+            role_burst[index] = burst >= 1 ? burst : rate >= 1 ? rate : 1; // a second's worth
+        } else if (opt == 'w') {
+            workers_count = atoi(optarg);
+        } else if (opt == 'r') {
+            record_path = optarg;
+        } else if (opt == 's') {
+            stats_file = optarg;
+        } else if (opt == 'S') {
+            stats_period = atol(optarg);
+        } else if (opt == 'H') {
+            history_entries = strtoul(optarg, NULL, 10);
+        } else if (opt == 'B') {
+            history_bytes = strtoul(optarg, NULL, 10);
+        } else if (opt == 'A') {
+            history_age = atol(optarg);
+        } else if (opt == 'q') {
+            out_queue_bytes = strtoul(optarg, NULL, 10);
+        } else if (opt == 't') {
+            out_stall_ms = atol(optarg);
+        } else if (opt == 'p' && strcmp(optarg, "resync") == 0) {
+            slow_policy = SLOW_RESYNC;
+        } else if (opt == 'p' && strcmp(optarg, "disconnect") == 0) {
+            slow_policy = SLOW_DISCONNECT;
+        } else {
+            optind = argc + 1; // force the usage message
+            break;
+        }
+    }
+
+    // FIX: Ensure correct parameter checking for the server
+    if (optind >= argc) { 
+        fprintf(stderr, "Usage: %s <time_interval_ms> [-q queue_bytes] [-t stall_ms] [-p resync|disconnect]"
+                        " [-H history_entries] [-B history_bytes] [-A history_age_s]"
+                        " [-s stats_file] [-S stats_period_s] [-r recording] [-w workers]"
+                        " [-b tick_budget] [-l read|write:rate[:burst]] [-F primary_pid]\n", argv[0]); 
+        return 1;
+    }
+    
+    int time_interval = atoi(argv[optind]); // get the time interval
+    if (time_interval <= 0) time_interval = 100; // Sanity check
+    if (out_queue_bytes == 0) out_queue_bytes = OUT_QUEUE_BYTES;
+    if (out_stall_ms <= 0) out_stall_ms = OUT_STALL_MS;
+    if (stats_period <= 0) stats_period = STATS_PERIOD;
+    if (workers_count <= 0) workers_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers_count <= 0) workers_count = 1;
+    if (workers_count > WORKERS_MAX) workers_count = WORKERS_MAX;
+
+    // a client that closed its pipe must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // no SA_RESTART, so a kicked client thread leaves its wait for input
+    struct sigaction sa;
+    sa.sa_handler = handle_kick;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // SIGUSR2 dumps the trace, only the trace thread takes it. Threads inherit the mask.
+    sigset_t trace_set;
+    sigemptyset(&trace_set);
+    sigaddset(&trace_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &trace_set, NULL);
+    pthread_t trace_thread_id;
+    pthread_create(&trace_thread_id, NULL, trace_signal_thread, NULL);
+    
+    printf("Server PID: %d\n", getpid()); // send pid
+
+    if (history_entries == 0) history_entries = HISTORY_ENTRIES;
+    if (record_path && record_open(&recording, record_path) != SUCCESS) {
+        perror("recording");
+        return 1;
+    }
+
+    // the workers own no document yet, the default one is hosted from the start
+    workers = calloc(workers_count, sizeof(worker));
+    if (!workers) return 1;
+    for (int i = 0; i < workers_count; i++) {
+        workers[i].id = i;
+        workers[i].interval = time_interval;
+        pthread_mutex_init(&workers[i].publish_lock, NULL);
+        pthread_cond_init(&workers[i].publish_ready, NULL);
+        pthread_cond_init(&workers[i].publish_done, NULL);
+    }
+    default_doc = open_document(DOCUMENT_DEFAULT);
+    if (!default_doc) return 1;
+
+    // roles are read once here and reloaded by the roles thread when the file changes
+    reload_roles();
+    pthread_t roles_thread_id;
+    pthread_create(&roles_thread_id, NULL, roles_thread, NULL);
+
+    // start the console thread
+    pthread_t console_thread_id;
+    pthread_create(&console_thread_id, NULL, console_thread, NULL);
 
-        pthread_create(&cli->thread, NULL, client_thread, cli);
-        pthread_detach(cli->thread); // auto detect and end of the thread and clean it
+    // start each worker's publisher, then the timing thread that feeds it
+    for (int i = 0; i < workers_count; i++) {
+        pthread_t publish_thread_id, timing_thread_id;
+        pthread_create(&publish_thread_id, NULL, publish_thread, &workers[i]);
+        pthread_create(&timing_thread_id, NULL, timing_thread, &workers[i]);
+    }
+    if (stats_file) {
+        pthread_t stats_thread_id;
+        pthread_create(&stats_thread_id, NULL, stats_thread, NULL);
+    }
+
+    // a standby mirrors the primary until it is gone, then takes its rendezvous FIFO, so
+    // clients reconnect to the pid they know and resume at the same version numbers
+    int server_pid = getpid();
+    if (follow_pid) {
+        printf("Standby of %d\n", follow_pid);
+        fflush(stdout);
+        if (!follow_primary(follow_pid)) {
+            printf("Primary %d quit\n", follow_pid);
+            return 0;
+        }
+        printf("Took over from %d\n", follow_pid);
+        fflush(stdout);
+        pthread_mutex_lock(&documents_lock);
+        for (hosted_doc* d = documents; d; d = d->next) {
+            if (d->replica_stale) fprintf(stderr, "standby: %s may differ, its copy did not arrive\n", d->name);
+        }
+        pthread_mutex_unlock(&documents_lock);
+        server_pid = follow_pid;
+    }
+
+    // clients connect through the rendezvous FIFO. It is opened for reading and writing,
+    // so it never reports EOF while no client is writing to it.
+    snprintf(rendezvous, sizeof(rendezvous), FIFO_SERVER, server_pid);
+    unlink(rendezvous);
+    if (mkfifo(rendezvous, 0666) != 0) {
+        perror("mkfifo failed");
+        return 1;
+    }
+    FILE* requests = fopen(rendezvous, "r+");
+    if (!requests) {
+        perror("open rendezvous failed");
+        unlink(rendezvous);
+        return 1;
+    }
+
+    // every request is one line written in one go, so lines never interleave
+    char request[256];
+    while (fgets(request, sizeof(request), requests)) {
+        size_t len = strcspn(request, "\n");
+        if (request[len] != '\n') {
+            // too long to be a request, skip the rest of the line
+            int c;
+            while ((c = fgetc(requests)) != EOF && c != '\n');
+            continue;
+        }
+        request[len] = '\0';
+
+        if (online == False) continue; // don't create new client when quit is set, stay until exit(0)
+        accept_client(request);
     }
     return 0;
 }
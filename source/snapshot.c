@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include "../libs/snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SUCCESS 0
+#define INVALID -1
+#define SNAPSHOT_INITIAL (64 * 1024) // first size of a region
+
+// === server ===
+int snapshot_create(snapshot_region *r, const char *name) {
+    memset(r, 0, sizeof(snapshot_region));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->writer = 1;
+
+    shm_unlink(name); // left over from a server that did not quit
+    r->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (r->fd < 0) return INVALID;
+    if (ftruncate(r->fd, SNAPSHOT_INITIAL) != 0) {
+        snapshot_destroy(r);
+        return INVALID;
+    }
+    r->header = mmap(NULL, SNAPSHOT_INITIAL, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->header == MAP_FAILED) {
+        r->header = NULL;
+        snapshot_destroy(r);
+        return INVALID;
+    }
+    r->size = SNAPSHOT_INITIAL;
+
+    r->header->magic = SNAPSHOT_MAGIC;
+    atomic_store(&r->header->seq, 0);
+    atomic_store(&r->header->size, r->size);
+    return snapshot_publish(r, 0, "", 0);
+}
+
+/**
+ * Make room for len bytes of text. Readers keep their smaller mapping until they see the
+ * new size, the part they have mapped stays valid because the region never shrinks.
+ */
+static int grow(snapshot_region *r, size_t len) {
+    size_t need = sizeof(snapshot_header) + len + 1;
+    if (need <= r->size) return SUCCESS;
+
+    size_t size = r->size;
+    while (size < need) size *= 2;
+    if (ftruncate(r->fd, size) != 0) return INVALID;
+    void *bigger = mremap(r->header, r->size, size, MREMAP_MAYMOVE);
+    if (bigger == MAP_FAILED) return INVALID;
+    r->header = bigger;
+    r->size = size;
+    return SUCCESS;
+}
+
+int snapshot_publish(snapshot_region *r, uint64_t version, const char *text, size_t len) {
+    if (!r->header || grow(r, len) != SUCCESS) return INVALID;
+    snapshot_header *h = r->header;
+
+    // odd seq: readers that overlap this write retry
+    uint64_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    atomic_store_explicit(&h->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&h->size, r->size, memory_order_relaxed);
+    h->version = version;
+    h->len = len;
+    memcpy(h->text, text, len);
+    h->text[len] = '\0';
+
+    atomic_store_explicit(&h->seq, seq + 2, memory_order_release);
+    return SUCCESS;
+}
+
+void snapshot_destroy(snapshot_region *r) {
+    if (r->header) munmap(r->header, r->size);
+    if (r->fd >= 0) close(r->fd);
+    if (r->writer && r->name[0]) shm_unlink(r->name);
+    r->header = NULL;
+    r->fd = -1;
+}
+
+// === readers ===
+int snapshot_open(snapshot_region *r, const char *name) {
+    memset(r, 0, sizeof(snapshot_region));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+
+    r->fd = shm_open(name, O_RDONLY, 0);
+    if (r->fd < 0) return INVALID;
+    struct stat st;
+    if (fstat(r->fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header)) {
+        snapshot_close(r);
+        return INVALID;
+    }
+    r->header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (r->header == MAP_FAILED || r->header->magic != SNAPSHOT_MAGIC) {
+        if (r->header == MAP_FAILED) r->header = NULL;
+        snapshot_close(r);
+        return INVALID;
+    }
+    r->size = st.st_size;
+    return SUCCESS;
+}
+
+/**
+ * Map the region again at its published size
+ */
+static void remap(snapshot_region *r, size_t size) {
+    void *bigger = mmap(NULL, size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (bigger == MAP_FAILED) return;
+    munmap(r->header, r->size);
+    r->header = bigger;
+    r->size = size;
+}
+
+uint64_t snapshot_begin(snapshot_region *r) {
+    while (1) {
+        uint64_t seq = atomic_load_explicit(&r->header->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield(); // a write is in progress, it is a memcpy away from done
+            continue;
+        }
+        size_t size = atomic_load_explicit(&r->header->size, memory_order_relaxed);
+        if (size > r->size) {
+            remap(r, size);
+            continue;
+        }
+        return seq;
+    }
+}
+
+int snapshot_retry(const snapshot_region *r, uint64_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->header->seq, memory_order_relaxed) != seq;
+}
+
+char *snapshot_read(snapshot_region *r, uint64_t *version, size_t *len) {
+    char *copy = NULL;
+    uint64_t seq;
+    do {
+        seq = snapshot_begin(r);
+        size_t n = r->header->len;
+        if (n > r->size - sizeof(snapshot_header) - 1) continue; // torn, the retry catches it
+
+        char *bigger = realloc(copy, n + 1);
+        if (!bigger) {
+            free(copy);
+            return NULL;
+        }
+        copy = bigger;
+        memcpy(copy, r->header->text, n);
+        copy[n] = '\0';
+        *version = r->header->version;
+        *len = n;
+    } while (snapshot_retry(r, seq));
+    return copy;
+}
+
+void snapshot_close(snapshot_region *r) {
+    if (r->header) munmap(r->header, r->size);
+    if (r->fd >= 0) close(r->fd);
+    r->header = NULL;
+    r->fd = -1;
+}
@@ -0,0 +1,91 @@
+#include "../libs/stats.h"
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Values below HIST_SUB have their own bucket. Above, the top HIST_SUB_BITS + 1 bits
+ * pick the bucket: the position of the highest bit, then the bits right below it.
+ */
+static size_t bucket_of(uint64_t value) {
+    if (value < HIST_SUB) return (size_t)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    return (size_t)(shift + 1) * HIST_SUB + ((value >> shift) & (HIST_SUB - 1));
+}
+
+/**
+ * The smallest value that falls in a bucket
+ */
+static uint64_t bucket_low(size_t index) {
+    if (index < HIST_SUB) return index;
+    int shift = (int)(index / HIST_SUB) - 1;
+    return ((uint64_t)HIST_SUB + index % HIST_SUB) << shift;
+}
+
+void hist_record(histogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+void hist_merge(histogram *into, histogram *from) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+        if (n) atomic_fetch_add_explicit(&into->counts[i], n, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&into->total, atomic_load_explicit(&from->total, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed),
+                              memory_order_relaxed);
+}
+
+void hist_reset(histogram *h) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+}
+
+uint64_t hist_percentile(histogram *h, double p) {
+    // the total may run ahead of the buckets while a record is in flight, count them instead
+    uint64_t total = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        total += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p * (double)total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen > rank) return bucket_low(i);
+    }
+    return 0;
+}
+
+void hist_print_header(FILE *out, const char *unit_name) {
+    fprintf(out, "%-20s %10s %10s %10s %10s %10s %10s  (%s)\n",
+            "", "count", "mean", "p50", "p99", "p999", "max", unit_name);
+}
+
+void hist_print(FILE *out, const char *name, histogram *h, double unit) {
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    double mean = total ? (double)sum / (double)total : 0;
+    fprintf(out, "%-20s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, total,
+            mean / unit,
+            hist_percentile(h, 0.50) / unit,
+            hist_percentile(h, 0.99) / unit,
+            hist_percentile(h, 0.999) / unit,
+            hist_percentile(h, 1.0) / unit);
+}
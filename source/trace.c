@@ -0,0 +1,142 @@
+#include "../libs/trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SUCCESS 0
+#define INVALID -1
+#define NS_PER_SEC 1000000000ULL
+
+static trace_ring *rings = NULL; // every ring, never freed
+static uint32_t ring_count = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring *local_ring = NULL;
+
+static const char *event_names[TRACE_EVENTS] = {
+    [TRACE_ENQUEUE] = "enqueue",
+    [TRACE_TICK_BEGIN] = "tick",
+    [TRACE_APPLY_BEGIN] = "apply",
+    [TRACE_APPLY_END] = "apply",
+    [TRACE_TICK_END] = "tick",
+    [TRACE_COMMIT] = "commit",
+    [TRACE_BROADCAST] = "broadcast",
+    [TRACE_WRITE] = "write",
+    [TRACE_CONNECT] = "connect",
+    [TRACE_DISCONNECT] = "disconnect",
+    [TRACE_QUERY] = "query",
+};
+
+void trace_thread(const char *name) {
+    pthread_mutex_lock(&rings_lock);
+    trace_ring *ring = rings;
+    while (ring && ring->in_use) ring = ring->next;
+    if (!ring) {
+        ring = calloc(1, sizeof(trace_ring));
+        if (!ring) {
+            pthread_mutex_unlock(&rings_lock);
+            return;
+        }
+        ring->thread = ring_count++;
+        ring->next = rings;
+        rings = ring;
+    }
+    ring->in_use = 1;
+    if (name) {
+        strncpy(ring->name, name, TRACE_NAME - 1);
+    } else {
+        snprintf(ring->name, TRACE_NAME, "thread %u", ring->thread);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    local_ring = ring;
+}
+
+void trace_thread_exit() {
+    if (!local_ring) return;
+    pthread_mutex_lock(&rings_lock);
+    local_ring->in_use = 0;
+    pthread_mutex_unlock(&rings_lock);
+    local_ring = NULL;
+}
+
+void trace_event(uint16_t event, uint64_t arg, uint32_t arg2) {
+    trace_ring *ring = local_ring;
+    if (!ring) {
+        trace_thread(NULL);
+        ring = local_ring;
+        if (!ring) return;
+    }
+
+    // only this thread moves head, the release store publishes the record to a dump
+    uint64_t i = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record *r = &ring->records[i & (TRACE_RING - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->ts_ns = (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    r->arg = arg;
+    r->arg2 = arg2;
+    r->event = event;
+    r->reserved = 0;
+    atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+}
+
+/**
+ * Copy the live records of a ring, oldest first. The writer keeps going meanwhile, so
+ * head is read again afterwards and the records it may have overwritten are dropped.
+ * Return the number of records copied into out.
+ */
+static uint32_t copy_ring(trace_ring *ring, trace_record *out) {
+    uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t start = end > TRACE_RING ? end - TRACE_RING : 0;
+    for (uint64_t i = start; i < end; i++) {
+        out[i - start] = ring->records[i & (TRACE_RING - 1)];
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    // the writer is at most at index head, which overwrites the slot of head - TRACE_RING
+    uint64_t now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = now >= TRACE_RING ? now - TRACE_RING + 1 : 0;
+    if (valid <= start) return (uint32_t)(end - start);
+    if (valid >= end) return 0;
+    memmove(out, out + (valid - start), (end - valid) * sizeof(trace_record));
+    return (uint32_t)(end - valid);
+}
+
+int trace_dump(const char *path) {
+    trace_record *copy = malloc(sizeof(trace_record) * TRACE_RING);
+    if (!copy) return INVALID;
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        free(copy);
+        return INVALID;
+    }
+
+    // rings are only ever added at the front, the list can be walked after the count
+    pthread_mutex_lock(&rings_lock);
+    trace_ring *first = rings;
+    uint32_t count = ring_count;
+    pthread_mutex_unlock(&rings_lock);
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), f);
+    fwrite(&count, sizeof(count), 1, f);
+    for (trace_ring *ring = first; ring; ring = ring->next) {
+        char name[TRACE_NAME];
+        pthread_mutex_lock(&rings_lock);
+        memcpy(name, ring->name, TRACE_NAME);
+        pthread_mutex_unlock(&rings_lock);
+
+        uint32_t n = copy_ring(ring, copy);
+        fwrite(&ring->thread, sizeof(ring->thread), 1, f);
+        fwrite(name, 1, TRACE_NAME, f);
+        fwrite(&n, sizeof(n), 1, f);
+        fwrite(copy, sizeof(trace_record), n, f);
+    }
+
+    free(copy);
+    return fclose(f) == 0 ? SUCCESS : INVALID;
+}
+
+const char *trace_event_name(uint16_t event) {
+    return event < TRACE_EVENTS && event_names[event] ? event_names[event] : "unknown";
+}
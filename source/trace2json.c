@@ -0,0 +1,118 @@
+// trace2json: convert a trace dump of the server (see libs/trace.h) into Chrome trace JSON
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../libs/trace.h"
+#include "../libs/protocol.h"
+
+#define True 1
+#define False 0
+
+/**
+ * What arg and arg2 mean for each event, NULL when unused
+ */
+static const char *arg_names[TRACE_EVENTS][2] = {
+    [TRACE_ENQUEUE] = {"client", "commands"},
+    [TRACE_TICK_END] = {"commands", NULL},
+    [TRACE_APPLY_BEGIN] = {"client", NULL},
+    [TRACE_APPLY_END] = {"client", "result"},
+    [TRACE_COMMIT] = {"version", NULL},
+    [TRACE_BROADCAST] = {"version", "clients"},
+    [TRACE_WRITE] = {"client", "bytes"},
+    [TRACE_CONNECT] = {"client", "role"},
+    [TRACE_DISCONNECT] = {"client", NULL},
+    [TRACE_QUERY] = {"client", "opcode"},
+};
+
+typedef struct thread_trace {
+    uint32_t thread;
+    char name[TRACE_NAME + 1];
+    uint32_t count;
+    trace_record *records;
+} thread_trace;
+
+static void print_args(FILE *out, const trace_record *r) {
+    const char *first = r->event < TRACE_EVENTS ? arg_names[r->event][0] : NULL;
+    const char *second = r->event < TRACE_EVENTS ? arg_names[r->event][1] : NULL;
+    fprintf(out, ",\"args\":{");
+    if (first) fprintf(out, "\"%s\":%lu", first, r->arg);
+    if (second) fprintf(out, "%s\"%s\":%u", first ? "," : "", second, r->arg2);
+    fprintf(out, "}");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace_dump> [output.json]\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror("open trace");
+        return 1;
+    }
+    FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+    if (!out) {
+        perror("open output");
+        return 1;
+    }
+
+    char magic[8];
+    uint32_t count;
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&count, sizeof(count), 1, in) != 1) {
+        fprintf(stderr, "not a trace dump\n");
+        return 1;
+    }
+
+    thread_trace *threads = calloc(count ? count : 1, sizeof(thread_trace));
+    if (!threads) return 1;
+    uint64_t origin = UINT64_MAX; // timestamps are printed relative to the oldest record
+    for (uint32_t t = 0; t < count; t++) {
+        thread_trace *th = &threads[t];
+        if (fread(&th->thread, sizeof(th->thread), 1, in) != 1 || fread(th->name, 1, TRACE_NAME, in) != TRACE_NAME ||
+            fread(&th->count, sizeof(th->count), 1, in) != 1 || th->count > TRACE_RING) {
+            fprintf(stderr, "truncated trace dump\n");
+            return 1;
+        }
+        th->name[TRACE_NAME] = '\0';
+        th->records = malloc(sizeof(trace_record) * (th->count ? th->count : 1));
+        if (!th->records || fread(th->records, sizeof(trace_record), th->count, in) != th->count) {
+            fprintf(stderr, "truncated trace dump\n");
+            return 1;
+        }
+        if (th->count > 0 && th->records[0].ts_ns < origin) origin = th->records[0].ts_ns;
+    }
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    int first = True;
+    for (uint32_t t = 0; t < count; t++) {
+        thread_trace *th = &threads[t];
+        fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", th->thread, th->name);
+        first = False;
+
+        for (uint32_t i = 0; i < th->count; i++) {
+            const trace_record *r = &th->records[i];
+            double ts = (double)(r->ts_ns - origin) / 1000.0;
+            const char *name = trace_event_name(r->event);
+            const char *phase = "i";
+            if (r->event == TRACE_TICK_BEGIN || r->event == TRACE_APPLY_BEGIN) phase = "B";
+            if (r->event == TRACE_TICK_END || r->event == TRACE_APPLY_END) phase = "E";
+            if (r->event == TRACE_APPLY_BEGIN) name = op_name((int)r->arg2);
+
+            fprintf(out, ",\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", phase, name,
+                    th->thread, ts);
+            if (phase[0] == 'i') fprintf(out, ",\"s\":\"t\"");
+            print_args(out, r);
+            fprintf(out, "}");
+        }
+        free(th->records);
+    }
+    fprintf(out, "\n]}\n");
+
+    free(threads);
+    fclose(in);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef CHECK_H
+#define CHECK_H
+#include <stdio.h>
+/**
+ * This file is the header file of the unit tests. Each test program runs its checks in
+ * main and returns check_report(): 0 when every check held, 1 otherwise.
+ */
+
+static int check_failed = 0;
+
+#define CHECK(cond)                                                                     \
+    do {                                                                                \
+        if (!(cond)) {                                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+            check_failed++;                                                             \
+        }                                                                               \
+    } while (0)
+
+static int check_report(const char *name) {
+    if (check_failed) {
+        fprintf(stderr, "%s: %d checks failed\n", name, check_failed);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+#endif
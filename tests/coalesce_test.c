@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libs/coalesce.h"
+#include "../libs/markdown.h"
+#include "../libs/apply.h"
+#include "check.h"
+
+/**
+ * Apply the edits one by one, and their merge as one command, to two copies of text at
+ * the same version. True when both commit to the same text.
+ */
+static int same_as_separate(const char *text, const op *edits, int count) {
+    document *separate = markdown_init();
+    document *merged = markdown_init();
+    int same = 0;
+    if (separate && merged) {
+        markdown_insert(separate, 0, 0, text);
+        markdown_increment_version(separate);
+        markdown_insert(merged, 0, 0, text);
+        markdown_increment_version(merged);
+
+        coalesced c;
+        coalesce_start(&c, &edits[0]);
+        apply_op(separate, 1, &edits[0]);
+        for (int i = 1; i < count; i++) {
+            CHECK(coalesce_continues(&c, &edits[i]));
+            coalesce_add(&c, &edits[i]);
+            apply_op(separate, 1, &edits[i]);
+        }
+        apply_op(merged, 1, &c.merged);
+        markdown_increment_version(separate);
+        markdown_increment_version(merged);
+        same = strcmp(separate->current_version, merged->current_version) == 0;
+        if (!same) fprintf(stderr, "separate \"%s\", merged \"%s\"\n", separate->current_version, merged->current_version);
+    }
+    markdown_free(separate);
+    markdown_free(merged);
+    return same;
+}
+
+/**
+ * Typing a word one character at a time is one insert of the word
+ */
+static void test_typing(void) {
+    op edits[5];
+    const char *word = "hello";
+    for (int i = 0; i < 5; i++) {
+        edits[i] = (op){.opcode = OP_INSERT, .version = 1, .args = {2 + (uint64_t)i, 0}, .payload = word + i, .len = 1};
+    }
+    CHECK(same_as_separate("abcd", edits, 5));
+
+    coalesced c;
+    coalesce_start(&c, &edits[0]);
+    for (int i = 1; i < 5; i++) coalesce_add(&c, &edits[i]);
+    CHECK(c.merged.args[0] == 2 && c.merged.len == 5 && memcmp(c.merged.payload, "hello", 5) == 0);
+}
+
+/**
+ * Backspacing and deleting forward, the positions of the text as it was, are one delete
+ * of the span they cover
+ */
+static void test_deleting(void) {
+    op back[] = {
+        {.opcode = OP_DEL, .version = 1, .args = {5, 1}},
+        {.opcode = OP_DEL, .version = 1, .args = {4, 1}},
+        {.opcode = OP_DEL, .version = 1, .args = {3, 1}},
+    };
+    CHECK(same_as_separate("abcdefgh", back, 3));
+
+    op overlapping[] = {
+        {.opcode = OP_DEL, .version = 1, .args = {2, 3}},
+        {.opcode = OP_DEL, .version = 1, .args = {4, 2}},
+        {.opcode = OP_DEL, .version = 1, .args = {1, 1}},
+    };
+    CHECK(same_as_separate("abcdefgh", overlapping, 3));
+
+    coalesced c;
+    coalesce_start(&c, &overlapping[0]);
+    coalesce_add(&c, &overlapping[1]);
+    coalesce_add(&c, &overlapping[2]);
+    CHECK(c.merged.args[0] == 1 && c.merged.args[1] == 5);
+}
+
+/**
+ * Edits that do not continue the merged command stay separate
+ */
+static void test_breaks(void) {
+    op insert = {.opcode = OP_INSERT, .version = 1, .args = {2, 0}, .payload = "ab", .len = 2};
+    coalesced c;
+    coalesce_start(&c, &insert);
+
+    op gap = {.opcode = OP_INSERT, .version = 1, .args = {5, 0}, .payload = "c", .len = 1};
+    op later = {.opcode = OP_INSERT, .version = 2, .args = {4, 0}, .payload = "c", .len = 1};
+    op del = {.opcode = OP_DEL, .version = 1, .args = {3, 1}};
+    CHECK(!coalesce_continues(&c, &gap));
+    CHECK(!coalesce_continues(&c, &later));
+    CHECK(!coalesce_continues(&c, &del));
+
+    char full[COALESCE_MAX];
+    memset(full, 'x', sizeof(full));
+    op too_long = {.opcode = OP_INSERT, .version = 1, .args = {4, 0}, .payload = full, .len = COALESCE_MAX - 1};
+    CHECK(!coalesce_continues(&c, &too_long));
+    CHECK(coalesce_takes(&too_long));
+    too_long.len = COALESCE_MAX + 1;
+    CHECK(!coalesce_takes(&too_long));
+
+    op bold = {.opcode = OP_BOLD, .version = 1, .args = {0, 2}};
+    CHECK(!coalesce_takes(&bold));
+
+    coalesce_start(&c, &del);
+    op apart = {.opcode = OP_DEL, .version = 1, .args = {5, 1}};
+    op touching = {.opcode = OP_DEL, .version = 1, .args = {4, 1}};
+    CHECK(!coalesce_continues(&c, &apart));
+    CHECK(coalesce_continues(&c, &touching));
+}
+
+int main(void) {
+    test_typing();
+    test_deleting();
+    test_breaks();
+    return check_report("coalesce");
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libs/history.h"
+#include "check.h"
+
+/**
+ * What history_decode hands back, one op after the other
+ */
+typedef struct seen {
+    char users[8][HISTORY_USER_MAX];
+    op ops[8];
+    char payloads[8][16];
+    int results[8];
+    int count;
+} seen;
+
+static void remember(const char *user, const op *o, int result, void *arg) {
+    seen *s = arg;
+    if (s->count == 8) return;
+    snprintf(s->users[s->count], HISTORY_USER_MAX, "%s", user);
+    s->ops[s->count] = *o;
+    snprintf(s->payloads[s->count], sizeof(s->payloads[0]), "%.*s", (int)o->len, o->payload ? o->payload : "");
+    s->results[s->count] = result;
+    s->count++;
+}
+
+/**
+ * Commit version num with one insert of its number
+ */
+static int commit_one(history *h, history_builder *b, uint64_t num) {
+    char text[24];
+    int len = snprintf(text, sizeof(text), "%lu", num);
+    op o = {.opcode = OP_INSERT, .version = num - 1, .args = {num, 0}, .payload = text, .len = (size_t)len};
+    if (builder_add(b, "daniel", &o, RESULT_SUCCESS) != 0) return -1;
+    return history_commit(h, b, num);
+}
+
+/**
+ * The ops of an entry decode as they were added: users by name, positions that go back
+ * as well as forward, payloads and results
+ */
+static void test_entry(void) {
+    history h;
+    history_builder b = {0};
+    CHECK(history_init(&h, 4, 0, 0) == 0);
+
+    op ops[] = {
+        {.opcode = OP_INSERT, .args = {10, 0}, .payload = "abc", .len = 3},
+        {.opcode = OP_DEL, .args = {2, 5}},
+        {.opcode = OP_BOLD, .args = {7, 3}},
+        {.opcode = OP_INSERT, .args = {1000000, 0}, .payload = "x", .len = 1},
+    };
+    const char *users[] = {"daniel", "ryan", "daniel", "yao"};
+    int results[] = {RESULT_SUCCESS, RESULT_INVALID_POSITION, RESULT_SUCCESS, RESULT_SUCCESS};
+    for (int i = 0; i < 4; i++) CHECK(builder_add(&b, users[i], &ops[i], results[i]) == 0);
+    CHECK(history_commit(&h, &b, 1) == 0);
+
+    history_entry e;
+    CHECK(history_get(&h, 1, &e) == 0);
+    seen s = {0};
+    CHECK(history_decode(e.data, e.len, remember, &s) == 4);
+    CHECK(s.count == 4);
+    for (int i = 0; i < s.count; i++) {
+        CHECK(strcmp(s.users[i], users[i]) == 0);
+        CHECK(s.ops[i].opcode == ops[i].opcode);
+        CHECK(s.ops[i].args[0] == ops[i].args[0] && s.ops[i].args[1] == ops[i].args[1]);
+        CHECK(s.results[i] == results[i]);
+    }
+    CHECK(strcmp(s.payloads[0], "abc") == 0 && strcmp(s.payloads[3], "x") == 0);
+
+    // a cut entry is malformed rather than read past its end
+    CHECK(history_decode(e.data, e.len - 1, remember, &s) < 0);
+    free(e.data);
+    builder_free(&b);
+    history_free(&h);
+}
+
+/**
+ * The ring keeps the newest versions: the oldest go first when the count or the byte
+ * limit is reached
+ */
+static void test_retention(void) {
+    history h;
+    history_builder b = {0};
+    CHECK(history_init(&h, 3, 0, 0) == 0);
+    for (uint64_t v = 1; v <= 5; v++) CHECK(commit_one(&h, &b, v) == 0);
+    uint64_t oldest, newest;
+    history_range(&h, &oldest, &newest);
+    CHECK(oldest == 3 && newest == 5);
+
+    history_entry e;
+    CHECK(history_get(&h, 2, &e) != 0);
+    CHECK(history_get(&h, 6, &e) != 0);
+    CHECK(history_get(&h, 4, &e) == 0);
+    seen s = {0};
+    CHECK(history_decode(e.data, e.len, remember, &s) == 1);
+    CHECK(e.num == 4 && strcmp(s.payloads[0], "4") == 0);
+    free(e.data);
+    history_free(&h);
+
+    // every entry here takes the same bytes, room for two of them
+    CHECK(history_init(&h, 100, 0, 0) == 0);
+    CHECK(commit_one(&h, &b, 1) == 0);
+    size_t one = h.bytes;
+    history_free(&h);
+    CHECK(history_init(&h, 100, 2 * one, 0) == 0);
+    for (uint64_t v = 1; v <= 6; v++) CHECK(commit_one(&h, &b, v) == 0);
+    history_range(&h, &oldest, &newest);
+    CHECK(oldest == 5 && newest == 6);
+    CHECK(h.bytes <= 2 * one);
+    builder_free(&b);
+    history_free(&h);
+}
+
+/**
+ * More users in one tick than the table starts with keep their own names
+ */
+static void test_many_users(void) {
+    history h;
+    history_builder b = {0};
+    CHECK(history_init(&h, 2, 0, 0) == 0);
+    char name[HISTORY_USER_MAX];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "user%d", i);
+        op o = {.opcode = OP_DEL, .args = {(uint64_t)i, 1}};
+        CHECK(builder_add(&b, name, &o, RESULT_SUCCESS) == 0);
+    }
+    CHECK(history_commit(&h, &b, 1) == 0);
+    history_entry e;
+    CHECK(history_get(&h, 1, &e) == 0);
+    seen s = {0};
+    CHECK(history_decode(e.data, e.len, remember, &s) == 100);
+    CHECK(strcmp(s.users[7], "user7") == 0);
+    free(e.data);
+    builder_free(&b);
+    history_free(&h);
+}
+
+int main(void) {
+    test_entry();
+    test_retention();
+    test_many_users();
+    return check_report("history");
+}
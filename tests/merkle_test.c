@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libs/merkle.h"
+#include "check.h"
+
+#define TEXT_MAX 40000
+
+/**
+ * Two trees hold the same blocks and the same root
+ */
+static int same_tree(const merkle *a, const merkle *b) {
+    if (a->count != b->count || merkle_root(a) != merkle_root(b)) return 0;
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->blocks[i].pos != b->blocks[i].pos || a->blocks[i].len != b->blocks[i].len ||
+            a->blocks[i].hash != b->blocks[i].hash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * The blocks follow each other over the whole text, within the size bounds but the last
+ */
+static int covers(const merkle *m, size_t len) {
+    size_t pos = 0;
+    for (size_t i = 0; i < m->count; i++) {
+        const merkle_block *b = &m->blocks[i];
+        if (b->pos != pos || b->len == 0 || b->len > MERKLE_BLOCK_MAX) return 0;
+        if (i + 1 < m->count && b->len < MERKLE_BLOCK_MIN) return 0;
+        pos += b->len;
+    }
+    return pos == len;
+}
+
+static void fill(char *text, size_t len, unsigned *seed) {
+    for (size_t i = 0; i < len; i++) text[i] = "abcdefgh \n"[rand_r(seed) % 10];
+}
+
+/**
+ * Cutting depends on the text alone, so equal texts get equal trees
+ */
+static void test_build(void) {
+    merkle a, b;
+    merkle_init(&a);
+    merkle_init(&b);
+    CHECK(merkle_build(&a, "", 0) == 0);
+    CHECK(merkle_root(&a) == 0);
+
+    static char text[TEXT_MAX];
+    unsigned seed = 1;
+    fill(text, sizeof(text), &seed);
+    CHECK(merkle_build(&a, text, sizeof(text)) == 0);
+    CHECK(merkle_build(&b, text, sizeof(text)) == 0);
+    CHECK(same_tree(&a, &b));
+    CHECK(covers(&a, sizeof(text)));
+    CHECK(a.count > 1);
+
+    text[sizeof(text) / 2] ^= 1;
+    CHECK(merkle_build(&b, text, sizeof(text)) == 0);
+    CHECK(merkle_root(&a) != merkle_root(&b));
+    CHECK(a.blocks[0].hash == b.blocks[0].hash); // far from the change
+    merkle_free(&a);
+    merkle_free(&b);
+}
+
+/**
+ * An update from the old text gives the tree a build of the new text gives, for inserts,
+ * deletes and replacements anywhere, including the ends and an emptied text
+ */
+static void test_update(void) {
+    static char old[TEXT_MAX * 2], text[TEXT_MAX * 2];
+    unsigned seed = 7;
+    size_t old_len = TEXT_MAX;
+    fill(old, old_len, &seed);
+
+    merkle updated, built;
+    merkle_init(&updated);
+    merkle_init(&built);
+    CHECK(merkle_build(&updated, old, old_len) == 0);
+    for (int round = 0; round < 300; round++) {
+        size_t pos = old_len ? rand_r(&seed) % (old_len + 1) : 0;
+        size_t cut = rand_r(&seed) % 600;
+        if (cut > old_len - pos) cut = old_len - pos;
+        size_t add = rand_r(&seed) % 600;
+        if (round % 50 == 49) {
+            pos = 0; // empty it now and then
+            cut = old_len;
+            add = 0;
+        }
+        if (old_len - cut + add > sizeof(text)) add = 0;
+
+        memcpy(text, old, pos);
+        fill(text + pos, add, &seed);
+        memcpy(text + pos + add, old + pos + cut, old_len - pos - cut);
+        size_t len = old_len - cut + add;
+
+        CHECK(merkle_update(&updated, old, old_len, text, len) == 0);
+        CHECK(merkle_build(&built, text, len) == 0);
+        CHECK(same_tree(&updated, &built));
+        CHECK(covers(&updated, len));
+
+        memcpy(old, text, len);
+        old_len = len;
+    }
+    merkle_free(&updated);
+    merkle_free(&built);
+}
+
+int main(void) {
+    test_build();
+    test_update();
+    return check_report("merkle");
+}
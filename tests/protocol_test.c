@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libs/protocol.h"
+#include "check.h"
+
+/**
+ * Varints round trip at every length, and a truncated one asks for more input
+ */
+static void test_varints(void) {
+    uint64_t values[] = {0, 1, 127, 128, 300, 16383, 16384, 1ULL << 32, UINT64_MAX};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        unsigned char buf[16];
+        size_t n = varint_encode(values[i], buf);
+        uint64_t back = 0;
+        CHECK(varint_decode(buf, n, &back) == (int)n);
+        CHECK(back == values[i]);
+        if (n > 1) CHECK(varint_decode(buf, n - 1, &back) == 0);
+    }
+}
+
+/**
+ * A frame decodes to what was built, a cut frame is incomplete at every length, and two
+ * frames back to back are split where the first one ends
+ */
+static void test_frames(void) {
+    op o = {.opcode = OP_INSERT, .version = 300, .args = {5, 70000}, .payload = "hello", .len = 5};
+    size_t len;
+    unsigned char *frame = frame_build(&o, &len);
+    CHECK(frame != NULL);
+    if (!frame) return;
+
+    op back;
+    CHECK(frame_decode(frame, len, &back) == (long)len);
+    CHECK(back.opcode == OP_INSERT && back.version == 300);
+    CHECK(back.args[0] == 5 && back.args[1] == 70000);
+    CHECK(back.len == 5 && memcmp(back.payload, "hello", 5) == 0);
+    for (size_t cut = 0; cut < len; cut++) CHECK(frame_decode(frame, cut, &back) == 0);
+
+    op empty = {.opcode = OP_DOC};
+    size_t empty_len;
+    unsigned char *second = frame_build(&empty, &empty_len);
+    unsigned char *both = malloc(len + empty_len);
+    if (second && both) {
+        memcpy(both, frame, len);
+        memcpy(both + len, second, empty_len);
+        CHECK(frame_decode(both, len + empty_len, &back) == (long)len);
+        CHECK(frame_decode(both + len, empty_len, &back) == (long)empty_len);
+        CHECK(back.opcode == OP_DOC && back.len == 0);
+    }
+    free(both);
+    free(second);
+
+    // a payload length (the byte ahead of "hello") that does not fill the body is malformed
+    frame[len - 6]++;
+    CHECK(frame_decode(frame, len, &back) < 0);
+    free(frame);
+}
+
+/**
+ * frame_read takes one frame at a time off a stream and stops at its end
+ */
+static void test_frame_read(void) {
+    FILE *f = tmpfile();
+    CHECK(f != NULL);
+    if (!f) return;
+    for (uint64_t v = 1; v <= 3; v++) {
+        op o = {.opcode = OP_DEL, .version = v, .args = {v, v * 2}};
+        size_t len;
+        unsigned char *frame = frame_build(&o, &len);
+        if (frame) fwrite(frame, 1, len, f);
+        free(frame);
+    }
+    rewind(f);
+
+    unsigned char *buffer = NULL;
+    size_t cap = 0;
+    op o;
+    for (uint64_t v = 1; v <= 3; v++) {
+        CHECK(frame_read(f, &buffer, &cap, &o) == 0);
+        CHECK(o.opcode == OP_DEL && o.version == v && o.args[1] == v * 2);
+    }
+    CHECK(frame_read(f, &buffer, &cap, &o) != 0);
+    free(buffer);
+    fclose(f);
+}
+
+/**
+ * Text commands take their numbers and payload, unknown keywords and missing arguments
+ * are refused
+ */
+static void test_text(void) {
+    op o;
+    CHECK(op_parse_text("INSERT 3 hello world", &o) == 0);
+    CHECK(o.opcode == OP_INSERT && o.args[0] == 3);
+    CHECK(o.len == 11 && memcmp(o.payload, "hello world", 11) == 0);
+    CHECK(op_parse_text("DEL 4 2", &o) == 0);
+    CHECK(o.opcode == OP_DEL && o.args[0] == 4 && o.args[1] == 2);
+    CHECK(op_parse_text("DELX 4 2", &o) != 0);
+    CHECK(op_parse_text("DEL 4", &o) != 0);
+    CHECK(op_parse_text("INSERT 3", &o) != 0);
+    CHECK(strcmp(op_name(OP_BOLD), "BOLD") == 0);
+    CHECK(strcmp(result_name(RESULT_UNAUTHORISED), "UNAUTHORISED") == 0);
+}
+
+int main(void) {
+    test_varints();
+    test_frames();
+    test_frame_read();
+    test_text();
+    return check_report("protocol");
+}